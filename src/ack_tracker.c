@@ -0,0 +1,171 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "ack_tracker.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ACK_BUCKETS 1024
+
+/* One publish waiting for its confirmation. They are in a hash table by
+ * their message id, and also in a list ordered by their deadlines, as
+ * the timeout is the same for all
+ */
+typedef struct Pending {
+    int mid;
+    void *userdata;
+    uint64_t deadline;
+    struct Pending *bucket_next;
+    struct Pending *prev;
+    struct Pending *next;
+} Pending;
+
+typedef struct AckTracker {
+    AckTrackerConfiguration *config;
+    Pending *buckets[ACK_BUCKETS];
+    Pending *oldest;
+    Pending *newest;
+    int count;
+} AckTracker;
+
+static void pending_unlink(AckTracker *t, Pending *p)
+{
+    Pending **b = &t->buckets[(unsigned int)p->mid % ACK_BUCKETS];
+    while (*b != p) {
+        b = &(*b)->bucket_next;
+    }
+    *b = p->bucket_next;
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        t->oldest = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    } else {
+        t->newest = p->prev;
+    }
+    t->count--;
+}
+
+static void pending_finish(AckTracker *t, Pending *p, AckResult result)
+{
+    pending_unlink(t, p);
+    t->config->done_callback(p->userdata, result,
+                             t->config->callback_context);
+    free(p);
+}
+
+AckTracker *ack_tracker_init(AckTrackerConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->done_callback != NULL);
+    AckTracker *retval = SAFEMALLOC(sizeof(AckTracker));
+    retval->config = config;
+    memset(retval->buckets, 0, sizeof(retval->buckets));
+    retval->oldest = NULL;
+    retval->newest = NULL;
+    retval->count = 0;
+    return retval;
+}
+
+/* The message ids wrap around, so a new publish can get the id of one
+ * still waiting. The new one is put in front of it, so the ack goes to
+ * the new one, and the old one times out.
+ */
+void ack_tracker_add(AckTracker *t, int mid, void *userdata)
+{
+    assert(t != NULL);
+    Pending *p = SAFEMALLOC(sizeof(Pending));
+    p->mid = mid;
+    p->userdata = userdata;
+    p->deadline = monotonic_ms() + t->config->timeout_ms;
+    const unsigned int bucket = (unsigned int)mid % ACK_BUCKETS;
+    p->bucket_next = t->buckets[bucket];
+    t->buckets[bucket] = p;
+    p->prev = t->newest;
+    p->next = NULL;
+    if (t->newest) {
+        t->newest->next = p;
+    } else {
+        t->oldest = p;
+    }
+    t->newest = p;
+    t->count++;
+}
+
+// the ids which are not tracked are ignored
+void ack_tracker_ack(AckTracker *t, int mid, bool success)
+{
+    assert(t != NULL);
+    Pending *p = t->buckets[(unsigned int)mid % ACK_BUCKETS];
+    while (p && p->mid != mid) {
+        p = p->bucket_next;
+    }
+    if (p) {
+        pending_finish(t, p, success ? ACK_OK : ACK_REFUSED);
+    }
+}
+
+/* returns the time in ms until the oldest publish times out,
+ * or -1 if none is waiting
+ */
+int ack_tracker_get_timeout(AckTracker *t)
+{
+    assert(t != NULL);
+    if (!t->oldest) {
+        return -1;
+    }
+    const uint64_t now = monotonic_ms();
+    return t->oldest->deadline > now ? (int)(t->oldest->deadline - now) : 0;
+}
+
+void ack_tracker_expire(AckTracker *t)
+{
+    assert(t != NULL);
+    const uint64_t now = monotonic_ms();
+    while (t->oldest && t->oldest->deadline <= now) {
+        DEBUG("Unit [%s]: the publish with mid %d timed out",
+              t->config->label, t->oldest->mid);
+        pending_finish(t, t->oldest, ACK_TIMEOUT);
+    }
+}
+
+int ack_tracker_pending(AckTracker *t)
+{
+    assert(t != NULL);
+    return t->count;
+}
+
+void ack_tracker_destroy(AckTracker *t)
+{
+    assert(t != NULL);
+    if (t->count) {
+        WARNING("Unit [%s]: giving up waiting for %d publishes",
+                t->config->label, t->count);
+    }
+    while (t->oldest) {
+        pending_finish(t, t->oldest, ACK_TIMEOUT);
+    }
+    free(t);
+}
@@ -0,0 +1,52 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file ack_tracker.h
+ *   @brief The ack_tracker keeps the publishes waiting for their
+ *   confirmation from the broker, by their message id. Each of them is
+ *   finished exactly once: when the broker acknowledges it (or it's
+ *   sent, for QoS 0), when the broker refuses it, or when it's not
+ *   confirmed within the timeout.
+ */
+#ifndef ACK_TRACKER_H
+#define ACK_TRACKER_H
+#include <stdbool.h>
+
+typedef enum { ACK_OK, ACK_REFUSED, ACK_TIMEOUT } AckResult;
+
+typedef struct {
+    const char *label;
+    int timeout_ms;
+    void *callback_context;
+    // called with the userdata passed to ack_tracker_add(). Also called
+    // with ACK_TIMEOUT for the unfinished ones when the tracker is
+    // destroyed.
+    void (*done_callback)(void *userdata, AckResult result, void *ctx);
+} AckTrackerConfiguration;
+
+struct AckTracker;
+
+struct AckTracker *ack_tracker_init(AckTrackerConfiguration *config);
+void ack_tracker_add(struct AckTracker *t, int mid, void *userdata);
+void ack_tracker_ack(struct AckTracker *t, int mid, bool success);
+int ack_tracker_get_timeout(struct AckTracker *t);
+void ack_tracker_expire(struct AckTracker *t);
+int ack_tracker_pending(struct AckTracker *t);
+void ack_tracker_destroy(struct AckTracker *t);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "batcher.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_BUCKETS 1024
+
+/* One open batch. The batches are in a hash table by their url, and
+ * also in a list ordered by their creation, which is the same as the
+ * order of their deadlines, as the linger time is the same for all
+ */
+typedef struct Batch {
+    char *url;
+    Buffer body;
+    int items;
+    uint64_t deadline;
+    struct Batch *bucket_next;
+    struct Batch *prev;
+    struct Batch *next;
+} Batch;
+
+typedef struct Batcher {
+    BatcherConfiguration *config;
+    Batch *buckets[BATCH_BUCKETS];
+    Batch *oldest;
+    Batch *newest;
+} Batcher;
+
+static unsigned int batch_hash(const char *str)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash % BATCH_BUCKETS;
+}
+
+/* returns the length of the valid UTF-8 sequence at the start of data,
+ * or 0 if it's not valid. The overlong forms, the surrogates and the
+ * code points above U+10FFFF are not valid either.
+ */
+static size_t utf8_length(const unsigned char *data, size_t len)
+{
+    const unsigned char c = data[0];
+    // the valid range of the second byte
+    unsigned char min = 0x80;
+    unsigned char max = 0xbf;
+    size_t n;
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        if (c == 0xe0) {
+            min = 0xa0;
+        } else if (c == 0xed) {
+            max = 0x9f;
+        }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        if (c == 0xf0) {
+            min = 0x90;
+        } else if (c == 0xf4) {
+            max = 0x8f;
+        }
+    } else {
+        return 0;
+    }
+    if (len < n || data[1] < min || data[1] > max) {
+        return 0;
+    }
+    for (size_t i = 2; i < n; i++) {
+        if ((data[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/* appending the data as a quoted JSON string. The bytes which are not
+ * part of a valid UTF-8 sequence are escaped as \u00XX, so binary
+ * payloads still give valid JSON.
+ */
+static void append_json_string(Buffer *b, const char *data, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    buffer_reserve(b, b->length + len + 2);
+    buffer_append(b, "\"", 1);
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = data[i];
+        if (c >= 0x80) {
+            const size_t n =
+                utf8_length((const unsigned char *)data + i, len - i);
+            if (n) {
+                i += n - 1;
+                continue;
+            }
+        } else if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        buffer_append(b, data + start, i - start);
+        start = i + 1;
+        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        switch (c) {
+        case '"':
+        case '\\':
+            esc[1] = c;
+            buffer_append(b, esc, 2);
+            break;
+        case '\n':
+            buffer_append(b, "\\n", 2);
+            break;
+        case '\r':
+            buffer_append(b, "\\r", 2);
+            break;
+        case '\t':
+            buffer_append(b, "\\t", 2);
+            break;
+        default:
+            buffer_append(b, esc, 6);
+        }
+    }
+    buffer_append(b, data + start, len - start);
+    buffer_append(b, "\"", 1);
+}
+
+static void batch_unlink(Batcher *b, Batch *batch)
+{
+    Batch **p = &b->buckets[batch_hash(batch->url)];
+    while (*p != batch) {
+        p = &(*p)->bucket_next;
+    }
+    *p = batch->bucket_next;
+    if (batch->prev) {
+        batch->prev->next = batch->next;
+    } else {
+        b->oldest = batch->next;
+    }
+    if (batch->next) {
+        batch->next->prev = batch->prev;
+    } else {
+        b->newest = batch->prev;
+    }
+}
+
+static void batch_flush(Batcher *b, Batch *batch)
+{
+    batch_unlink(b, batch);
+    const char *content_type = "application/x-ndjson";
+    if (b->config->format == BATCH_FORMAT_JSON) {
+        buffer_append(&batch->body, "]", 1);
+        content_type = "application/json";
+    }
+    DEBUG("Unit [%s]: flushing batch of %d items to %s", b->config->label,
+          batch->items, batch->url);
+    b->config->flush_callback(batch->url, batch->body.data, batch->body.length,
+                              content_type, b->config->callback_context);
+    buffer_free(&batch->body);
+    free(batch->url);
+    free(batch);
+}
+
+Batcher *batcher_init(BatcherConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->flush_callback != NULL);
+    Batcher *retval = SAFEMALLOC(sizeof(Batcher));
+    retval->config = config;
+    memset(retval->buckets, 0, sizeof(retval->buckets));
+    retval->oldest = NULL;
+    retval->newest = NULL;
+    return retval;
+}
+
+void batcher_add(Batcher *b, const char *url, const char *topic,
+                 const char *payload, size_t payload_len, uint64_t timestamp)
+{
+    assert(b != NULL);
+    const unsigned int bucket = batch_hash(url);
+    Batch *batch = b->buckets[bucket];
+    while (batch && strcmp(batch->url, url)) {
+        batch = batch->bucket_next;
+    }
+    if (!batch) {
+        batch = SAFEMALLOC(sizeof(Batch));
+        batch->url = strdup(url);
+        buffer_init(&batch->body);
+        batch->items = 0;
+        batch->deadline = monotonic_ms() + b->config->linger_ms;
+        batch->bucket_next = b->buckets[bucket];
+        b->buckets[bucket] = batch;
+        batch->prev = b->newest;
+        batch->next = NULL;
+        if (b->newest) {
+            b->newest->next = batch;
+        } else {
+            b->oldest = batch;
+        }
+        b->newest = batch;
+    }
+
+    Buffer *body = &batch->body;
+    if (b->config->format == BATCH_FORMAT_JSON) {
+        buffer_append(body, batch->items ? "," : "[", 1);
+    }
+    buffer_append_str(body, "{\"topic\":");
+    append_json_string(body, topic, strlen(topic));
+    buffer_append_str(body, ",\"payload\":");
+    append_json_string(body, payload ? payload : "", payload_len);
+    char record_end[48];
+    snprintf(record_end, sizeof(record_end), ",\"timestamp\":%" PRIu64 "}",
+             timestamp);
+    buffer_append_str(body, record_end);
+    if (b->config->format == BATCH_FORMAT_NDJSON) {
+        buffer_append(body, "\n", 1);
+    }
+
+    if (++batch->items >= b->config->max_items) {
+        batch_flush(b, batch);
+    }
+}
+
+/* returns the time in ms until the oldest batch needs to be
+ * flushed, or -1 if there are no open batches
+ */
+int batcher_get_timeout(Batcher *b)
+{
+    assert(b != NULL);
+    if (!b->oldest) {
+        return -1;
+    }
+    const uint64_t now = monotonic_ms();
+    return b->oldest->deadline > now ? (int)(b->oldest->deadline - now) : 0;
+}
+
+/* flushes the oldest batch if its linger time is over, returns false if
+ * there was no such batch. One batch is flushed at a time, so the caller
+ * can stop when it runs out of connections.
+ */
+bool batcher_flush_expired(Batcher *b)
+{
+    assert(b != NULL);
+    if (!b->oldest || b->oldest->deadline > monotonic_ms()) {
+        return false;
+    }
+    batch_flush(b, b->oldest);
+    return true;
+}
+
+void batcher_flush_all(Batcher *b)
+{
+    assert(b != NULL);
+    while (b->oldest) {
+        batch_flush(b, b->oldest);
+    }
+}
+
+void batcher_destroy(Batcher *b)
+{
+    assert(b != NULL);
+    while (b->oldest) {
+        Batch *batch = b->oldest;
+        WARNING("Unit [%s]: dropping unsent batch of %d items to %s",
+                b->config->label, batch->items, batch->url);
+        batch_unlink(b, batch);
+        buffer_free(&batch->body);
+        free(batch->url);
+        free(batch);
+    }
+    free(b);
+}
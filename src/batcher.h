@@ -0,0 +1,55 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file batcher.h
+ *   @brief The batcher collects MQTT messages per target URL, and
+ *   hands them over as one request body when either the max number
+ *   of items is reached or the linger time of the batch expires.
+ *   The body is a JSON array or an NDJSON stream of
+ *   {"topic": ..., "payload": ..., "timestamp": ...} records.
+ */
+#ifndef BATCHER_H
+#define BATCHER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { BATCH_FORMAT_JSON, BATCH_FORMAT_NDJSON } BatchFormat;
+
+typedef struct {
+    const char *label;
+    int max_items;
+    int linger_ms;
+    BatchFormat format;
+    void *callback_context;
+    // called with the complete, NUL terminated body of a batch
+    void (*flush_callback)(const char *url, const char *body, size_t len,
+                           const char *content_type, void *ctx);
+} BatcherConfiguration;
+
+struct Batcher;
+
+struct Batcher *batcher_init(BatcherConfiguration *config);
+void batcher_add(struct Batcher *b, const char *url, const char *topic,
+                 const char *payload, size_t payload_len, uint64_t timestamp);
+int batcher_get_timeout(struct Batcher *b);
+bool batcher_flush_expired(struct Batcher *b);
+void batcher_flush_all(struct Batcher *b);
+void batcher_destroy(struct Batcher *b);
+
+#endif
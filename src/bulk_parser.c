@@ -0,0 +1,570 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "bulk_parser.h"
+#include "logging.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// max nesting of the JSON values within a record
+#define BULK_MAX_DEPTH 32
+// max number of the failed records listed in the result
+#define BULK_MAX_LISTED_ERRORS 100
+
+typedef enum {
+    // before the first record, or the opening '[' of an array
+    BULK_START,
+    // between the records
+    BULK_BETWEEN,
+    // within a record
+    BULK_RECORD,
+    // after the closing ']' of an array
+    BULK_END,
+    // the framing is broken, the rest of the body is ignored
+    BULK_ERROR
+} BulkState;
+
+typedef struct BulkParser {
+    BulkParserConfiguration *config;
+    BulkState state;
+    bool array;
+    // the scanning state of the current record
+    int depth;
+    bool in_string;
+    bool escape;
+    bool oversized;
+    // the JSON text of the current record
+    Buffer record;
+    // the decoded fields of the current record
+    Buffer key;
+    Buffer topic;
+    Buffer payload;
+    uint64_t index;
+    uint64_t published;
+    uint64_t failed;
+    // the JSON objects of the listed failed records, comma separated
+    Buffer errors;
+    // the reason of the BULK_ERROR state
+    const char *error;
+} BulkParser;
+
+static const char *skip_ws(const char *s)
+{
+    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') {
+        s++;
+    }
+    return s;
+}
+
+static bool parse_hex4(const char *s, unsigned int *value)
+{
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        const char c = s[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') {
+            *value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            *value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            *value |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void append_utf8(Buffer *out, unsigned int cp)
+{
+    char utf8[4];
+    size_t len;
+    if (cp < 0x80) {
+        utf8[0] = cp;
+        len = 1;
+    } else if (cp < 0x800) {
+        utf8[0] = 0xc0 | (cp >> 6);
+        utf8[1] = 0x80 | (cp & 0x3f);
+        len = 2;
+    } else if (cp < 0x10000) {
+        utf8[0] = 0xe0 | (cp >> 12);
+        utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+        utf8[2] = 0x80 | (cp & 0x3f);
+        len = 3;
+    } else {
+        utf8[0] = 0xf0 | (cp >> 18);
+        utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+        utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+        utf8[3] = 0x80 | (cp & 0x3f);
+        len = 4;
+    }
+    buffer_append(out, utf8, len);
+}
+
+/* decodes the JSON string starting at s into out, returns the
+ * position after its closing quote, or NULL if it's invalid
+ */
+static const char *parse_string(const char *s, Buffer *out)
+{
+    buffer_clear(out);
+    if (*s != '"') {
+        return NULL;
+    }
+    s++;
+    while (true) {
+        const char *run = s;
+        while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) {
+            s++;
+        }
+        buffer_append(out, run, s - run);
+        if (*s == '"') {
+            return s + 1;
+        }
+        if (*s != '\\') {
+            return NULL;
+        }
+        s++;
+        char c;
+        switch (*s) {
+        case '"':
+        case '\\':
+        case '/':
+            c = *s;
+            break;
+        case 'b':
+            c = '\b';
+            break;
+        case 'f':
+            c = '\f';
+            break;
+        case 'n':
+            c = '\n';
+            break;
+        case 'r':
+            c = '\r';
+            break;
+        case 't':
+            c = '\t';
+            break;
+        case 'u': {
+            unsigned int cp;
+            if (!parse_hex4(s + 1, &cp)) {
+                return NULL;
+            }
+            s += 4;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                // a surrogate pair
+                unsigned int low;
+                if (s[1] != '\\' || s[2] != 'u' || !parse_hex4(s + 3, &low) ||
+                    low < 0xdc00 || low > 0xdfff) {
+                    return NULL;
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                s += 6;
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                return NULL;
+            }
+            append_utf8(out, cp);
+            s++;
+            continue;
+        }
+        default:
+            return NULL;
+        }
+        buffer_append(out, &c, 1);
+        s++;
+    }
+}
+
+static const char *skip_digits(const char *s)
+{
+    while (*s >= '0' && *s <= '9') {
+        s++;
+    }
+    return s;
+}
+
+// returns the position after the JSON number at s, or NULL if it's invalid
+static const char *skip_number(const char *s)
+{
+    if (*s == '-') {
+        s++;
+    }
+    // no leading zeros
+    if (*s == '0') {
+        s++;
+    } else if (*s >= '1' && *s <= '9') {
+        s = skip_digits(s);
+    } else {
+        return NULL;
+    }
+    if (*s == '.') {
+        const char *fraction = s + 1;
+        if ((s = skip_digits(fraction)) == fraction) {
+            return NULL;
+        }
+    }
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '+' || *s == '-') {
+            s++;
+        }
+        const char *exponent = s;
+        if ((s = skip_digits(exponent)) == exponent) {
+            return NULL;
+        }
+    }
+    return s;
+}
+
+// returns the position after the JSON value at s, or NULL if it's invalid
+static const char *skip_value(const char *s, int depth)
+{
+    s = skip_ws(s);
+    if (*s == '"') {
+        s++;
+        while (*s != '"') {
+            if (!*s || (*s == '\\' && !*++s)) {
+                return NULL;
+            }
+            s++;
+        }
+        return s + 1;
+    }
+    if (*s == '{' || *s == '[') {
+        if (depth >= BULK_MAX_DEPTH) {
+            return NULL;
+        }
+        const bool object = *s == '{';
+        const char close = object ? '}' : ']';
+        s = skip_ws(s + 1);
+        if (*s == close) {
+            return s + 1;
+        }
+        while (true) {
+            if (object) {
+                if (*s != '"' || !(s = skip_value(s, depth + 1))) {
+                    return NULL;
+                }
+                s = skip_ws(s);
+                if (*s != ':') {
+                    return NULL;
+                }
+                s++;
+            }
+            if (!(s = skip_value(s, depth + 1))) {
+                return NULL;
+            }
+            s = skip_ws(s);
+            if (*s == close) {
+                return s + 1;
+            }
+            if (*s != ',') {
+                return NULL;
+            }
+            s = skip_ws(s + 1);
+        }
+    }
+    static const char *const literals[] = {"true", "false", "null"};
+    for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+        const size_t len = strlen(literals[i]);
+        if (!strncmp(s, literals[i], len)) {
+            return s + len;
+        }
+    }
+    return skip_number(s);
+}
+
+/* decodes the current record into r, returns NULL if it's valid,
+ * otherwise the reason why it isn't
+ */
+static const char *parse_record(BulkParser *p, BulkRecord *r)
+{
+    bool has_topic = false;
+    r->qos = 0;
+    r->retain = false;
+    buffer_clear(&p->payload);
+    buffer_append(&p->payload, "", 0);
+    const char *s = skip_ws(p->record.data);
+    if (*s != '{') {
+        return "not an object";
+    }
+    s = skip_ws(s + 1);
+    while (*s != '}') {
+        if (!(s = parse_string(s, &p->key))) {
+            return "invalid JSON";
+        }
+        s = skip_ws(s);
+        if (*s != ':') {
+            return "invalid JSON";
+        }
+        s = skip_ws(s + 1);
+        if (!strcmp(p->key.data, "topic")) {
+            if (!(s = parse_string(s, &p->topic))) {
+                return "invalid topic";
+            }
+            has_topic = true;
+        } else if (!strcmp(p->key.data, "payload")) {
+            if (*s == '"') {
+                s = parse_string(s, &p->payload);
+            } else {
+                // any other JSON value is published as it is
+                const char *start = s;
+                if ((s = skip_value(s, 0))) {
+                    buffer_clear(&p->payload);
+                    buffer_append(&p->payload, start, s - start);
+                }
+            }
+            if (!s) {
+                return "invalid payload";
+            }
+        } else if (!strcmp(p->key.data, "qos")) {
+            char *end;
+            const long qos = strtol(s, &end, 10);
+            if (end == s || qos < 0 || qos > 2) {
+                return "invalid qos";
+            }
+            r->qos = (int)qos;
+            s = end;
+        } else if (!strcmp(p->key.data, "retain")) {
+            if (!strncmp(s, "true", 4)) {
+                r->retain = true;
+                s += 4;
+            } else if (!strncmp(s, "false", 5)) {
+                s += 5;
+            } else {
+                return "invalid retain";
+            }
+        } else if (!(s = skip_value(s, 0))) {
+            return "invalid JSON";
+        }
+        s = skip_ws(s);
+        if (*s == ',') {
+            s = skip_ws(s + 1);
+            if (*s != '"') {
+                return "invalid JSON";
+            }
+        } else if (*s != '}') {
+            return "invalid JSON";
+        }
+    }
+    if (!has_topic || !p->topic.length ||
+        strlen(p->topic.data) != p->topic.length ||
+        strpbrk(p->topic.data, "+#")) {
+        return "invalid topic";
+    }
+    r->topic = p->topic.data;
+    r->payload = p->payload.data;
+    r->payload_len = p->payload.length;
+    return NULL;
+}
+
+static void record_failed(BulkParser *p, const char *reason)
+{
+    p->failed++;
+    if (p->failed > BULK_MAX_LISTED_ERRORS) {
+        return;
+    }
+    char item[96];
+    snprintf(item, sizeof(item), "%s{\"index\":%" PRIu64 ",\"error\":\"%s\"}",
+             p->failed > 1 ? "," : "", p->index, reason);
+    buffer_append_str(&p->errors, item);
+}
+
+static void record_done(BulkParser *p)
+{
+    BulkRecord r;
+    const char *reason = "record too big";
+    if (!p->oversized) {
+        reason = parse_record(p, &r);
+    }
+    if (!reason &&
+        !p->config->record_callback(&r, p->config->callback_context)) {
+        reason = "publish failed";
+    }
+    if (reason) {
+        DEBUG("Unit [%s]: bulk record %" PRIu64 " failed: %s",
+              p->config->label, p->index, reason);
+        record_failed(p, reason);
+    } else {
+        p->published++;
+    }
+    p->index++;
+}
+
+static void record_append(BulkParser *p, const char *data, size_t len)
+{
+    if (p->oversized) {
+        return;
+    }
+    if (p->record.length + len > p->config->max_record_size) {
+        p->oversized = true;
+        return;
+    }
+    buffer_append(&p->record, data, len);
+}
+
+static bool framing_error(BulkParser *p, const char *reason)
+{
+    WARNING("Unit [%s]: bulk request stopped at record %" PRIu64 ": %s",
+            p->config->label, p->index, reason);
+    p->state = BULK_ERROR;
+    p->error = reason;
+    return false;
+}
+
+BulkParser *bulk_parser_new(BulkParserConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->record_callback != NULL);
+    BulkParser *retval = SAFEMALLOC(sizeof(BulkParser));
+    retval->config = config;
+    retval->state = BULK_START;
+    retval->array = false;
+    retval->depth = 0;
+    retval->in_string = false;
+    retval->escape = false;
+    retval->oversized = false;
+    buffer_init(&retval->record);
+    buffer_init(&retval->key);
+    buffer_init(&retval->topic);
+    buffer_init(&retval->payload);
+    retval->index = 0;
+    retval->published = 0;
+    retval->failed = 0;
+    buffer_init(&retval->errors);
+    retval->error = NULL;
+    return retval;
+}
+
+/* processes the next chunk of the body, the records completed by it
+ * are passed to the callback. Returns false if the framing is broken.
+ */
+bool bulk_parser_feed(BulkParser *p, const char *data, size_t len)
+{
+    assert(p != NULL);
+    // the start of the part of the current record in this chunk
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        const char c = data[i];
+        if (p->state == BULK_ERROR) {
+            return false;
+        }
+        if (p->state == BULK_RECORD) {
+            // only the strings and the nesting are tracked here, the
+            // record is parsed when it's complete
+            if (p->in_string) {
+                if (p->escape) {
+                    p->escape = false;
+                } else if (c == '\\') {
+                    p->escape = true;
+                } else if (c == '"') {
+                    p->in_string = false;
+                }
+            } else if (c == '"') {
+                p->in_string = true;
+            } else if (c == '{' || c == '[') {
+                p->depth++;
+            } else if ((c == '}' || c == ']') && --p->depth == 0) {
+                record_append(p, data + start, i + 1 - start);
+                record_done(p);
+                p->state = BULK_BETWEEN;
+            }
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            continue;
+        }
+        if (p->state == BULK_END) {
+            return framing_error(p, "data after the end of the array");
+        }
+        if (p->state == BULK_START && c == '[') {
+            p->array = true;
+            p->state = BULK_BETWEEN;
+        } else if (c == '{') {
+            p->state = BULK_RECORD;
+            p->depth = 1;
+            p->in_string = false;
+            p->escape = false;
+            p->oversized = false;
+            buffer_clear(&p->record);
+            start = i;
+        } else if (p->array && c == ',' && p->state == BULK_BETWEEN) {
+            continue;
+        } else if (p->array && c == ']' && p->state == BULK_BETWEEN) {
+            p->state = BULK_END;
+        } else {
+            return framing_error(p, "a record is not a JSON object");
+        }
+    }
+    if (p->state == BULK_RECORD) {
+        record_append(p, data + start, len - start);
+    }
+    return p->state != BULK_ERROR;
+}
+
+// called at the end of the body, returns false if it was broken
+bool bulk_parser_finish(BulkParser *p)
+{
+    assert(p != NULL);
+    if (p->state == BULK_RECORD) {
+        return framing_error(p, "truncated record");
+    }
+    if (p->array && p->state != BULK_END && p->state != BULK_ERROR) {
+        return framing_error(p, "unterminated array");
+    }
+    return p->state != BULK_ERROR;
+}
+
+// the summary of the request as a JSON object
+void bulk_parser_result(BulkParser *p, Buffer *out)
+{
+    assert(p != NULL);
+    char counts[128];
+    snprintf(counts, sizeof(counts),
+             "{\"published\":%" PRIu64 ",\"failed\":%" PRIu64 ",\"errors\":[",
+             p->published, p->failed);
+    buffer_append_str(out, counts);
+    if (p->errors.length) {
+        buffer_append(out, p->errors.data, p->errors.length);
+    }
+    buffer_append_str(out, "]");
+    if (p->error) {
+        buffer_append_str(out, ",\"error\":\"");
+        buffer_append_str(out, p->error);
+        buffer_append_str(out, "\"");
+    }
+    buffer_append_str(out, "}");
+}
+
+void bulk_parser_free(BulkParser *p)
+{
+    if (!p) {
+        return;
+    }
+    buffer_free(&p->record);
+    buffer_free(&p->key);
+    buffer_free(&p->topic);
+    buffer_free(&p->payload);
+    buffer_free(&p->errors);
+    free(p);
+}
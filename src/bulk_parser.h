@@ -0,0 +1,62 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file bulk_parser.h
+ *   @brief The bulk parser reads the body of a bulk publish request as
+ *   it arrives: a JSON array or an NDJSON stream of
+ *   {"topic": ..., "payload": ..., "qos": ..., "retain": ...} records.
+ *   Only the current record is buffered, each one is passed to the
+ *   callback as soon as it's complete. A string payload is published
+ *   decoded, any other JSON value as its JSON text. The invalid records
+ *   are skipped, and reported in the result with their index, but a
+ *   broken JSON framing stops the processing of the rest of the body.
+ */
+#ifndef BULK_PARSER_H
+#define BULK_PARSER_H
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    const char *topic;
+    // NUL terminated, but it may contain NUL bytes
+    const char *payload;
+    size_t payload_len;
+    int qos;
+    bool retain;
+} BulkRecord;
+
+typedef struct {
+    const char *label;
+    // the bigger records are skipped as invalid
+    size_t max_record_size;
+    void *callback_context;
+    // called with each valid record, returns false if it couldn't be
+    // published
+    bool (*record_callback)(const BulkRecord *record, void *ctx);
+} BulkParserConfiguration;
+
+struct BulkParser;
+
+struct BulkParser *bulk_parser_new(BulkParserConfiguration *config);
+bool bulk_parser_feed(struct BulkParser *p, const char *data, size_t len);
+bool bulk_parser_finish(struct BulkParser *p);
+void bulk_parser_result(struct BulkParser *p, Buffer *out);
+void bulk_parser_free(struct BulkParser *p);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "compress.h"
+#include "logging.h"
+#include <assert.h>
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+// the output buffer grows by this much while decompressing
+#define DECOMPRESS_CHUNK 16384
+// gzip header instead of the zlib one
+#define GZIP_WINDOW_BITS (15 + 16)
+// accepting both gzip and zlib headers
+#define GUNZIP_WINDOW_BITS (15 + 32)
+
+typedef struct Compressor {
+    CompressionType type;
+    int level;
+    z_stream zs;
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} Compressor;
+
+typedef struct Decompressor {
+    CompressionType type;
+    size_t max_size;
+    bool finished;
+    z_stream zs;
+#ifdef HAVE_LIBZSTD
+    ZSTD_DStream *zstd;
+#endif
+} Decompressor;
+
+bool compression_supported(CompressionType type)
+{
+#ifndef HAVE_LIBZSTD
+    if (type == COMPRESSION_ZSTD) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+Compressor *compressor_new(CompressionType type, int level)
+{
+    if (type == COMPRESSION_NONE || !compression_supported(type)) {
+        return NULL;
+    }
+    Compressor *retval = SAFEMALLOC(sizeof(Compressor));
+    memset(retval, 0, sizeof(Compressor));
+    retval->type = type;
+    retval->level = level;
+    if (type == COMPRESSION_GZIP) {
+        if (level == COMPRESSION_LEVEL_DEFAULT) {
+            retval->level = Z_DEFAULT_COMPRESSION;
+        }
+        if (deflateInit2(&retval->zs, retval->level, Z_DEFLATED,
+                         GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(retval);
+            return NULL;
+        }
+    }
+#ifdef HAVE_LIBZSTD
+    if (type == COMPRESSION_ZSTD) {
+        if (level == COMPRESSION_LEVEL_DEFAULT) {
+            retval->level = ZSTD_CLEVEL_DEFAULT;
+        }
+        retval->zstd = ZSTD_createCCtx();
+        if (!retval->zstd) {
+            free(retval);
+            return NULL;
+        }
+    }
+#endif
+    return retval;
+}
+
+// the value of the Content-Encoding header
+const char *compressor_encoding(const Compressor *c)
+{
+    assert(c != NULL);
+    return c->type == COMPRESSION_ZSTD ? "zstd" : "gzip";
+}
+
+/* Compresses the data into out, replacing its content. Returns false
+ * if it failed, or if the result is not smaller than the input.
+ */
+bool compressor_compress(Compressor *c, const void *data, size_t len,
+                         Buffer *out)
+{
+    assert(c != NULL);
+    assert(out != NULL);
+    buffer_clear(out);
+    if (c->type == COMPRESSION_GZIP) {
+        buffer_reserve(out, deflateBound(&c->zs, len));
+        c->zs.next_in = (Bytef *)data;
+        c->zs.avail_in = len;
+        c->zs.next_out = (Bytef *)out->data;
+        c->zs.avail_out = out->capacity - 1;
+        const int ret = deflate(&c->zs, Z_FINISH);
+        out->length = c->zs.total_out;
+        deflateReset(&c->zs);
+        if (ret != Z_STREAM_END) {
+            buffer_clear(out);
+            return false;
+        }
+    }
+#ifdef HAVE_LIBZSTD
+    if (c->type == COMPRESSION_ZSTD) {
+        buffer_reserve(out, ZSTD_compressBound(len));
+        const size_t ret = ZSTD_compressCCtx(c->zstd, out->data,
+                                             out->capacity - 1, data, len,
+                                             c->level);
+        if (ZSTD_isError(ret)) {
+            buffer_clear(out);
+            return false;
+        }
+        out->length = ret;
+    }
+#endif
+    out->data[out->length] = '\0';
+    return out->length < len;
+}
+
+void compressor_free(Compressor *c)
+{
+    if (!c) {
+        return;
+    }
+    if (c->type == COMPRESSION_GZIP) {
+        deflateEnd(&c->zs);
+    }
+#ifdef HAVE_LIBZSTD
+    if (c->zstd) {
+        ZSTD_freeCCtx(c->zstd);
+    }
+#endif
+    free(c);
+}
+
+/* Returns a decompressor for the Content-Encoding, or NULL if it's not
+ * supported. The decompressed size is limited to max_size.
+ */
+Decompressor *decompressor_new(const char *content_encoding, size_t max_size)
+{
+    assert(content_encoding != NULL);
+    CompressionType type;
+    if (!strcasecmp(content_encoding, "gzip") ||
+        !strcasecmp(content_encoding, "x-gzip") ||
+        !strcasecmp(content_encoding, "deflate")) {
+        type = COMPRESSION_GZIP;
+    } else if (!strcasecmp(content_encoding, "zstd") &&
+               compression_supported(COMPRESSION_ZSTD)) {
+        type = COMPRESSION_ZSTD;
+    } else {
+        return NULL;
+    }
+    Decompressor *retval = SAFEMALLOC(sizeof(Decompressor));
+    memset(retval, 0, sizeof(Decompressor));
+    retval->type = type;
+    retval->max_size = max_size;
+    retval->finished = false;
+    if (type == COMPRESSION_GZIP &&
+        inflateInit2(&retval->zs, GUNZIP_WINDOW_BITS) != Z_OK) {
+        free(retval);
+        return NULL;
+    }
+#ifdef HAVE_LIBZSTD
+    if (type == COMPRESSION_ZSTD) {
+        retval->zstd = ZSTD_createDStream();
+        if (!retval->zstd) {
+            free(retval);
+            return NULL;
+        }
+        ZSTD_initDStream(retval->zstd);
+    }
+#endif
+    return retval;
+}
+
+static bool decompressor_feed_gzip(Decompressor *d, const void *data,
+                                   size_t len, Buffer *out)
+{
+    d->zs.next_in = (Bytef *)data;
+    d->zs.avail_in = len;
+    while (d->zs.avail_in > 0 && !d->finished) {
+        buffer_reserve(out, out->length + DECOMPRESS_CHUNK);
+        d->zs.next_out = (Bytef *)out->data + out->length;
+        d->zs.avail_out = out->capacity - 1 - out->length;
+        const uInt avail_out = d->zs.avail_out;
+        const int ret = inflate(&d->zs, Z_NO_FLUSH);
+        out->length += avail_out - d->zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            d->finished = true;
+        } else if (ret != Z_OK) {
+            return false;
+        }
+        if (out->length > d->max_size) {
+            return false;
+        }
+    }
+    // trailing garbage after the end of the stream
+    return d->zs.avail_in == 0;
+}
+
+#ifdef HAVE_LIBZSTD
+static bool decompressor_feed_zstd(Decompressor *d, const void *data,
+                                   size_t len, Buffer *out)
+{
+    ZSTD_inBuffer in = {data, len, 0};
+    while (in.pos < in.size) {
+        buffer_reserve(out, out->length + ZSTD_DStreamOutSize());
+        ZSTD_outBuffer o = {out->data + out->length,
+                            out->capacity - 1 - out->length, 0};
+        const size_t ret = ZSTD_decompressStream(d->zstd, &o, &in);
+        if (ZSTD_isError(ret)) {
+            return false;
+        }
+        out->length += o.pos;
+        // 0 is returned when a frame is complete
+        d->finished = ret == 0;
+        if (out->length > d->max_size) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/* Decompresses the next chunk of the body, and appends it to out.
+ * Returns false if the data is corrupt, or the result is too big.
+ */
+bool decompressor_feed(Decompressor *d, const void *data, size_t len,
+                       Buffer *out)
+{
+    assert(d != NULL);
+    assert(out != NULL);
+    bool ret = false;
+    if (d->type == COMPRESSION_GZIP) {
+        ret = decompressor_feed_gzip(d, data, len, out);
+    }
+#ifdef HAVE_LIBZSTD
+    if (d->type == COMPRESSION_ZSTD) {
+        ret = decompressor_feed_zstd(d, data, len, out);
+    }
+#endif
+    buffer_reserve(out, out->length);
+    out->data[out->length] = '\0';
+    return ret;
+}
+
+// returns true if the end of the compressed stream was reached
+bool decompressor_finished(const Decompressor *d)
+{
+    assert(d != NULL);
+    return d->finished;
+}
+
+void decompressor_free(Decompressor *d)
+{
+    if (!d) {
+        return;
+    }
+    if (d->type == COMPRESSION_GZIP) {
+        inflateEnd(&d->zs);
+    }
+#ifdef HAVE_LIBZSTD
+    if (d->zstd) {
+        ZSTD_freeDStream(d->zstd);
+    }
+#endif
+    free(d);
+}
@@ -0,0 +1,57 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file compress.h
+ *   @brief Compression of the outgoing request bodies, and streaming
+ *   decompression of the incoming ones, with gzip, or with zstd if
+ *   mqrestt is built with libzstd. The compressor keeps its state
+ *   between the calls, so it's not set up again for each body.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+} CompressionType;
+
+// the default level of the algorithm
+#define COMPRESSION_LEVEL_DEFAULT -1
+
+struct Compressor;
+struct Decompressor;
+
+bool compression_supported(CompressionType type);
+struct Compressor *compressor_new(CompressionType type, int level);
+const char *compressor_encoding(const struct Compressor *c);
+bool compressor_compress(struct Compressor *c, const void *data, size_t len,
+                         Buffer *out);
+void compressor_free(struct Compressor *c);
+
+struct Decompressor *decompressor_new(const char *content_encoding,
+                                      size_t max_size);
+bool decompressor_feed(struct Decompressor *d, const void *data, size_t len,
+                       Buffer *out);
+bool decompressor_finished(const struct Decompressor *d);
+void decompressor_free(struct Decompressor *d);
+
+#endif
@@ -50,11 +50,64 @@ Configuration *init_config(const char *filepath, bool dump)
     static cfg_opt_t mqtt2rest_unit_opts[] = {
         CFG_STR("webservice_baseurl", "localhost", CFGF_NONE),
         CFG_STR("mqtt_topic", "default_topic", CFGF_NONE),
+        CFG_STR("mqtt_share_group", NULL, CFGF_NONE),
+        CFG_STR("mqtt_client_id", NULL, CFGF_NONE),
+        CFG_BOOL("mqtt_persistent_session", false, CFGF_NONE),
+        CFG_INT("mqtt_qos", 2, CFGF_NONE),
+        CFG_STR("url_template", "", CFGF_NONE),
+        CFG_STR_LIST("rewrite", "{}", CFGF_NONE),
+        CFG_INT("max_connections", 8, CFGF_NONE),
+        CFG_STR("http_version", "http1.1", CFGF_NONE),
+        CFG_INT("max_streams", 100, CFGF_NONE),
+        CFG_INT("connect_timeout_ms", 5000, CFGF_NONE),
+        CFG_INT("request_timeout_ms", 10000, CFGF_NONE),
+        CFG_INT("max_retries", 3, CFGF_NONE),
+        CFG_INT("retry_base_ms", 100, CFGF_NONE),
+        CFG_INT("retry_max_ms", 10000, CFGF_NONE),
+        CFG_INT("breaker_threshold", 5, CFGF_NONE),
+        CFG_INT("breaker_cooldown_ms", 30000, CFGF_NONE),
+        CFG_INT("rate_limit", 0, CFGF_NONE),
+        CFG_INT("rate_limit_burst", 0, CFGF_NONE),
+        CFG_STR("rate_limit_scope", "unit", CFGF_NONE),
+        CFG_INT("rate_limit_prefix_segments", 1, CFGF_NONE),
+        CFG_INT("batch_size", 1, CFGF_NONE),
+        CFG_INT("batch_linger_ms", 100, CFGF_NONE),
+        CFG_STR("batch_format", "json", CFGF_NONE),
+        CFG_BOOL("batch_per_url", false, CFGF_NONE),
+        CFG_INT("queue_size", 1024, CFGF_NONE),
+        CFG_STR("queue_overflow", "block", CFGF_NONE),
+        CFG_INT("sender_workers", 0, CFGF_NONE),
+        CFG_STR("spool_dir", "", CFGF_NONE),
+        CFG_INT("spool_max_size_mb", 256, CFGF_NONE),
+        CFG_INT("spool_segment_size_mb", 16, CFGF_NONE),
+        CFG_INT("spool_sync_interval_ms", 1000, CFGF_NONE),
+        CFG_INT("spool_replay_rate", 0, CFGF_NONE),
+        CFG_BOOL("spool_before_ack", false, CFGF_NONE),
+        CFG_STR("compression", "none", CFGF_NONE),
+        CFG_INT("compression_level", 0, CFGF_NONE),
+        CFG_INT("compression_min_size", 1024, CFGF_NONE),
+        CFG_INT("dedup_window_ms", 0, CFGF_NONE),
+        CFG_INT("dedup_size", 4096, CFGF_NONE),
+        CFG_BOOL("conflate", false, CFGF_NONE),
+        CFG_INT("conflate_max_topics", 4096, CFGF_NONE),
         CFG_BOOL("enabled", true, CFGF_NONE), CFG_END()};
 
     static cfg_opt_t rest2mqtt_unit_opts[] = {
         CFG_INT("listen_port", 8888, CFGF_NONE),
+        CFG_INT("max_clients", 4096, CFGF_NONE),
+        CFG_INT("http_threads", 0, CFGF_NONE),
+        CFG_INT("publish_queue_size", 1024, CFGF_NONE),
+        CFG_INT("max_body_size", 16777216, CFGF_NONE),
+        CFG_STR("bulk_path", "", CFGF_NONE),
+        CFG_BOOL("publish_ack", false, CFGF_NONE),
+        CFG_INT("publish_ack_timeout_ms", 5000, CFGF_NONE),
+        CFG_INT("max_outstanding_messages", 0, CFGF_NONE),
+        CFG_INT("resume_outstanding_messages", 0, CFGF_NONE),
+        CFG_INT("max_outstanding_bytes", 0, CFGF_NONE),
+        CFG_INT("resume_outstanding_bytes", 0, CFGF_NONE),
+        CFG_INT("retry_after", 1, CFGF_NONE),
         CFG_STR("mqtt_topic_root", "default_topic", CFGF_NONE),
+        CFG_STR_LIST("rewrite", "{}", CFGF_NONE),
         CFG_BOOL("enabled", true, CFGF_NONE), CFG_END()};
 
     cfg_opt_t opts[] = {
@@ -68,6 +121,12 @@ Configuration *init_config(const char *filepath, bool dump)
         CFG_INT("mqtt_broker_port", 1883, CFGF_NONE),
 
         CFG_INT("mqtt_keepalive", 30, CFGF_NONE),
+        CFG_STR("mqtt_protocol_version", "3.1", CFGF_NONE),
+        CFG_INT("mqtt_receive_maximum", 0, CFGF_NONE),
+        CFG_INT("mqtt_topic_alias_maximum", 0, CFGF_NONE),
+        CFG_INT("mqtt_message_expiry", 0, CFGF_NONE),
+        CFG_BOOL("mqtt_shared_connection", false, CFGF_NONE),
+        CFG_STR("mqtt_client_id", NULL, CFGF_NONE),
         CFG_BOOL("mqtt_tls", false, CFGF_NONE),
         CFG_STR("mqtt_cafile", "-----", CFGF_NONE),
         CFG_STR("mqtt_capath", "-----", CFGF_NONE),
@@ -78,6 +137,8 @@ Configuration *init_config(const char *filepath, bool dump)
         CFG_STR("mqtt_user", "-----", CFGF_NONE),
         CFG_STR("mqtt_pw", "-----", CFGF_NONE),
 
+        CFG_INT("stats_interval", 0, CFGF_NONE),
+
         CFG_SEC("mqtt2rest_unit", mqtt2rest_unit_opts, CFGF_MULTI | CFGF_TITLE),
         CFG_SEC("rest2mqtt_unit", rest2mqtt_unit_opts, CFGF_MULTI | CFGF_TITLE),
         CFG_END()};
@@ -107,6 +168,37 @@ Configuration *init_config(const char *filepath, bool dump)
     retval->mqtt_broker_host = cfg_getstr(cfg, "mqtt_broker_host");
     retval->mqtt_broker_port = cfg_getint(cfg, "mqtt_broker_port");
     retval->mqtt_keepalive = cfg_getint(cfg, "mqtt_keepalive");
+    const char *protocol_version = cfg_getstr(cfg, "mqtt_protocol_version");
+    if (!strcmp(protocol_version, "3.1")) {
+        retval->mqtt_protocol_version = MQTT_PROTOCOL_3_1;
+    } else if (!strcmp(protocol_version, "3.1.1")) {
+        retval->mqtt_protocol_version = MQTT_PROTOCOL_3_1_1;
+    } else if (!strcmp(protocol_version, "5")) {
+        retval->mqtt_protocol_version = MQTT_PROTOCOL_5;
+    } else {
+        fprintf(stderr, "config error: unknown mqtt_protocol_version: %s\n",
+                protocol_version);
+        free_config();
+        return NULL;
+    }
+    retval->mqtt_receive_maximum = cfg_getint(cfg, "mqtt_receive_maximum");
+    retval->mqtt_topic_alias_maximum =
+        cfg_getint(cfg, "mqtt_topic_alias_maximum");
+    retval->mqtt_message_expiry = cfg_getint(cfg, "mqtt_message_expiry");
+    if (retval->mqtt_receive_maximum < 0 ||
+        retval->mqtt_receive_maximum > 65535 ||
+        retval->mqtt_topic_alias_maximum < 0 ||
+        retval->mqtt_topic_alias_maximum > 65535 ||
+        retval->mqtt_message_expiry < 0) {
+        fprintf(stderr, "config error: mqtt_receive_maximum and "
+                        "mqtt_topic_alias_maximum need to be between 0 and "
+                        "65535, mqtt_message_expiry can't be negative\n");
+        free_config();
+        return NULL;
+    }
+    retval->mqtt_shared_connection =
+        cfg_getbool(cfg, "mqtt_shared_connection");
+    retval->mqtt_client_id = cfg_getstr(cfg, "mqtt_client_id");
 
     retval->mqtt_tls = cfg_getbool(cfg, "mqtt_tls");
     retval->mqtt_cafile = cfg_getstr(cfg, "mqtt_cafile");
@@ -140,9 +232,112 @@ Configuration *init_config(const char *filepath, bool dump)
 
     retval->mqtt_user = cfg_getstr(cfg, "mqtt_user");
     retval->mqtt_pw = cfg_getstr(cfg, "mqtt_pw");
+
+    retval->stats_interval = cfg_getint(cfg, "stats_interval");
     return retval;
 }
 
+/* sets up the rate limiter of the unit, if rate_limit is set.
+ * Returns -1 on error.
+ */
+static int get_rate_limit(cfg_t *unit, Mqtt2RestUnitConfiguration *unitconfig)
+{
+    RateLimiterConfiguration *rl_config = &unitconfig->rate_limit_config;
+    unitconfig->rate_limiter = NULL;
+    rl_config->label = unitconfig->unit_name;
+    rl_config->rate = cfg_getint(unit, "rate_limit");
+    rl_config->burst = cfg_getint(unit, "rate_limit_burst");
+    rl_config->prefix_segments = cfg_getint(unit, "rate_limit_prefix_segments");
+    if (rl_config->rate < 0 || rl_config->burst < 0 ||
+        rl_config->prefix_segments < 0) {
+        fprintf(stderr, "config error: rate_limit, rate_limit_burst and "
+                        "rate_limit_prefix_segments can't be negative\n");
+        return -1;
+    }
+    const char *scope = cfg_getstr(unit, "rate_limit_scope");
+    if (!strcmp(scope, "unit")) {
+        rl_config->scope = RATE_LIMIT_UNIT;
+    } else if (!strcmp(scope, "host")) {
+        rl_config->scope = RATE_LIMIT_HOST;
+    } else if (!strcmp(scope, "prefix")) {
+        rl_config->scope = RATE_LIMIT_PREFIX;
+    } else {
+        fprintf(stderr, "config error: unknown rate_limit_scope: %s\n",
+                scope);
+        return -1;
+    }
+    if (!rl_config->rate) {
+        return 0;
+    }
+    if (!rl_config->burst) {
+        rl_config->burst = rl_config->rate;
+    }
+    INFO("\tRATE LIMIT: %d/s, burst: %d, per %s", rl_config->rate,
+         rl_config->burst, scope);
+    unitconfig->rate_limiter = rate_limiter_new(rl_config);
+    return 0;
+}
+
+/* the high and low water marks of the publishes outstanding in
+ * libmosquitto, a zero high water mark disables the limit
+ */
+static int get_outstanding_limits(cfg_t *unit,
+                                  Rest2MqttUnitConfiguration *unitconfig)
+{
+    const long max_messages = cfg_getint(unit, "max_outstanding_messages");
+    const long resume_messages =
+        cfg_getint(unit, "resume_outstanding_messages");
+    const long max_bytes = cfg_getint(unit, "max_outstanding_bytes");
+    const long resume_bytes = cfg_getint(unit, "resume_outstanding_bytes");
+    unitconfig->retry_after = cfg_getint(unit, "retry_after");
+    if (max_messages < 0 || resume_messages < 0 || max_bytes < 0 ||
+        resume_bytes < 0 || unitconfig->retry_after < 0) {
+        fprintf(stderr, "config error: the outstanding limits and "
+                        "retry_after can't be negative\n");
+        return -1;
+    }
+    if ((max_messages && resume_messages > max_messages) ||
+        (max_bytes && resume_bytes > max_bytes)) {
+        fprintf(stderr, "config error: the resume_outstanding_ limits need "
+                        "to be below the max_outstanding_ ones\n");
+        return -1;
+    }
+    unitconfig->max_outstanding_messages = max_messages;
+    unitconfig->resume_outstanding_messages = resume_messages;
+    unitconfig->max_outstanding_bytes = max_bytes;
+    unitconfig->resume_outstanding_bytes = resume_bytes;
+    if (max_messages || max_bytes) {
+        INFO("\tMAX OUTSTANDING: %ld messages, %ld bytes, resuming at %ld "
+             "messages, %ld bytes",
+             max_messages, max_bytes, resume_messages, resume_bytes);
+    }
+    return 0;
+}
+
+/* compiles the rewrite rules of the unit, the result
+ * is NULL if there are no rules
+ */
+static int get_rewrite_rules(cfg_t *unit, RewriteDirection direction,
+                             struct RewriteRules **rules)
+{
+    *rules = NULL;
+    const unsigned int count = cfg_size(unit, "rewrite");
+    if (!count) {
+        return 0;
+    }
+    *rules = rewrite_rules_new(direction);
+    for (unsigned int i = 0; i < count; i++) {
+        const char *rule = cfg_getnstr(unit, "rewrite", i);
+        INFO("\tREWRITE: %s", rule);
+        if (!rewrite_rules_add(*rules, rule)) {
+            rewrite_rules_free(*rules);
+            *rules = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int get_mqtt2rest_unitconfigs(Mqtt2RestUnitConfiguration *configarray[],
                               const int max_size)
 {
@@ -169,7 +364,273 @@ int get_mqtt2rest_unitconfigs(Mqtt2RestUnitConfiguration *configarray[],
 
         INFO("\tTOPIC: %s", cfg_getstr(unit, "mqtt_topic"));
         configarray[i]->mqtt_topic = cfg_getstr(unit, "mqtt_topic");
+        configarray[i]->mqtt_share_group = cfg_getstr(unit, "mqtt_share_group");
+        if (configarray[i]->mqtt_share_group) {
+            const char *group = configarray[i]->mqtt_share_group;
+            if (!strlen(group) || strpbrk(group, "/+#")) {
+                fprintf(stderr,
+                        "config error: invalid mqtt_share_group '%s' in "
+                        "unit %s\n",
+                        group, configarray[i]->unit_name);
+                return -1;
+            }
+            INFO("\tSHARE GROUP: %s", group);
+        }
+        configarray[i]->mqtt_persistent_session =
+            cfg_getbool(unit, "mqtt_persistent_session");
+        configarray[i]->mqtt_qos = cfg_getint(unit, "mqtt_qos");
+        if (configarray[i]->mqtt_qos < 0 || configarray[i]->mqtt_qos > 2) {
+            fprintf(stderr, "config error: mqtt_qos needs to be 0, 1 or 2\n");
+            return -1;
+        }
+        // by default the client id is the unit name, but the instances
+        // sharing a subscription need different ones
+        configarray[i]->mqtt_client_id = cfg_getstr(unit, "mqtt_client_id");
+        if (!configarray[i]->mqtt_client_id) {
+            if (configarray[i]->mqtt_share_group &&
+                configarray[i]->mqtt_persistent_session) {
+                fprintf(stderr, "config error: mqtt_client_id needs to be "
+                                "set for a persistent session with "
+                                "mqtt_share_group in unit %s\n",
+                        configarray[i]->unit_name);
+                return -1;
+            }
+            if (!configarray[i]->mqtt_share_group) {
+                configarray[i]->mqtt_client_id = configarray[i]->unit_name;
+            }
+        }
+
+        const char *url_template = cfg_getstr(unit, "url_template");
+        if (url_template && strlen(url_template)) {
+            INFO("\tURL TEMPLATE: %s", url_template);
+            configarray[i]->url_template = url_template_compile(
+                url_template, configarray[i]->mqtt_topic, true);
+            if (configarray[i]->url_template == NULL) {
+                return -1;
+            }
+        } else {
+            configarray[i]->url_template =
+                url_template_default(configarray[i]->webservice_baseurl,
+                                     configarray[i]->mqtt_topic);
+        }
+        if (get_rewrite_rules(unit, REWRITE_TOPIC_TO_URL,
+                              &configarray[i]->rewrite)) {
+            return -1;
+        }
+
+        INFO("\tMAX CONNECTIONS: %d", cfg_getint(unit, "max_connections"));
+        configarray[i]->max_connections = cfg_getint(unit, "max_connections");
+        configarray[i]->max_streams = cfg_getint(unit, "max_streams");
+        if (configarray[i]->max_connections < 1 ||
+            configarray[i]->max_streams < 1) {
+            fprintf(stderr, "config error: max_connections and max_streams "
+                            "need to be positive\n");
+            return -1;
+        }
+
+        const char *http_version = cfg_getstr(unit, "http_version");
+        INFO("\tHTTP VERSION: %s", http_version);
+        if (!strcmp(http_version, "http1.1")) {
+            configarray[i]->http_version = REST_HTTP_1_1;
+        } else if (!strcmp(http_version, "http2-prior-knowledge")) {
+            configarray[i]->http_version = REST_HTTP_2_PRIOR_KNOWLEDGE;
+        } else if (!strcmp(http_version, "http2")) {
+            configarray[i]->http_version = REST_HTTP_2;
+        } else {
+            fprintf(stderr, "config error: unknown http_version: %s\n",
+                    http_version);
+            return -1;
+        }
+        configarray[i]->connect_timeout_ms =
+            cfg_getint(unit, "connect_timeout_ms");
+        configarray[i]->request_timeout_ms =
+            cfg_getint(unit, "request_timeout_ms");
+        configarray[i]->max_retries = cfg_getint(unit, "max_retries");
+        configarray[i]->retry_base_ms = cfg_getint(unit, "retry_base_ms");
+        configarray[i]->retry_max_ms = cfg_getint(unit, "retry_max_ms");
+        configarray[i]->breaker_threshold =
+            cfg_getint(unit, "breaker_threshold");
+        configarray[i]->breaker_cooldown_ms =
+            cfg_getint(unit, "breaker_cooldown_ms");
+        if (configarray[i]->connect_timeout_ms < 0 ||
+            configarray[i]->request_timeout_ms < 0 ||
+            configarray[i]->max_retries < 0 ||
+            configarray[i]->retry_base_ms < 0 ||
+            configarray[i]->breaker_threshold < 0 ||
+            configarray[i]->breaker_cooldown_ms < 0) {
+            fprintf(stderr, "config error: the timeouts, the retry and the "
+                            "breaker settings can't be negative\n");
+            return -1;
+        }
+        if (configarray[i]->retry_max_ms < configarray[i]->retry_base_ms) {
+            fprintf(stderr, "config error: retry_max_ms can't be less than "
+                            "retry_base_ms\n");
+            return -1;
+        }
+        if (get_rate_limit(unit, configarray[i])) {
+            return -1;
+        }
+
+        configarray[i]->batch_size = cfg_getint(unit, "batch_size");
+        configarray[i]->batch_linger_ms = cfg_getint(unit, "batch_linger_ms");
+        if (configarray[i]->batch_linger_ms < 0) {
+            fprintf(stderr, "config error: batch_linger_ms can't be "
+                            "negative\n");
+            return -1;
+        }
+        configarray[i]->batch_per_url = cfg_getbool(unit, "batch_per_url");
+        const char *batch_format = cfg_getstr(unit, "batch_format");
+        if (!strcmp(batch_format, "json")) {
+            configarray[i]->batch_format = BATCH_FORMAT_JSON;
+        } else if (!strcmp(batch_format, "ndjson")) {
+            configarray[i]->batch_format = BATCH_FORMAT_NDJSON;
+        } else {
+            fprintf(stderr, "config error: unknown batch_format: %s\n",
+                    batch_format);
+            return -1;
+        }
+        if (configarray[i]->batch_size > 1) {
+            INFO("\tBATCHING: %d items / %d ms, %s", configarray[i]->batch_size,
+                 configarray[i]->batch_linger_ms, batch_format);
+        }
+
+        configarray[i]->queue_size = cfg_getint(unit, "queue_size");
+        if (configarray[i]->queue_size < 1 ||
+            configarray[i]->queue_size > RING_BUFFER_MAX_CAPACITY) {
+            fprintf(stderr, "config error: queue_size needs to be between 1 "
+                            "and %d\n",
+                    RING_BUFFER_MAX_CAPACITY);
+            return -1;
+        }
+        const char *queue_overflow = cfg_getstr(unit, "queue_overflow");
+        INFO("\tQUEUE: %d, on overflow: %s", configarray[i]->queue_size,
+             queue_overflow);
+        if (!strcmp(queue_overflow, "block")) {
+            configarray[i]->queue_overflow = RING_OVERFLOW_BLOCK;
+        } else if (!strcmp(queue_overflow, "drop_oldest")) {
+            configarray[i]->queue_overflow = RING_OVERFLOW_DROP_OLDEST;
+        } else if (!strcmp(queue_overflow, "drop_newest")) {
+            configarray[i]->queue_overflow = RING_OVERFLOW_DROP_NEWEST;
+        } else {
+            fprintf(stderr, "config error: unknown queue_overflow: %s\n",
+                    queue_overflow);
+            return -1;
+        }
+
+        configarray[i]->sender_workers = cfg_getint(unit, "sender_workers");
+        if (configarray[i]->sender_workers < 0) {
+            fprintf(stderr, "config error: invalid sender_workers: %d\n",
+                    configarray[i]->sender_workers);
+            return -1;
+        }
+
+        configarray[i]->spool_dir = cfg_getstr(unit, "spool_dir");
+        if (configarray[i]->spool_dir && !strlen(configarray[i]->spool_dir)) {
+            configarray[i]->spool_dir = NULL;
+        }
+        configarray[i]->spool_max_size_mb =
+            cfg_getint(unit, "spool_max_size_mb");
+        configarray[i]->spool_segment_size_mb =
+            cfg_getint(unit, "spool_segment_size_mb");
+        configarray[i]->spool_sync_interval_ms =
+            cfg_getint(unit, "spool_sync_interval_ms");
+        configarray[i]->spool_replay_rate =
+            cfg_getint(unit, "spool_replay_rate");
+        if (configarray[i]->spool_segment_size_mb < 1 ||
+            configarray[i]->spool_max_size_mb <
+                configarray[i]->spool_segment_size_mb) {
+            fprintf(stderr, "config error: spool_segment_size_mb needs to be "
+                            "positive, and at most spool_max_size_mb\n");
+            return -1;
+        }
+        if (configarray[i]->spool_sync_interval_ms < 0 ||
+            configarray[i]->spool_replay_rate < 0) {
+            fprintf(stderr, "config error: spool_sync_interval_ms and "
+                            "spool_replay_rate can't be negative\n");
+            return -1;
+        }
+        if (configarray[i]->spool_dir) {
+            INFO("\tSPOOL: %s, max %d MB", configarray[i]->spool_dir,
+                 configarray[i]->spool_max_size_mb);
+        }
+        const char *compression = cfg_getstr(unit, "compression");
+        if (!strcmp(compression, "none")) {
+            configarray[i]->compression = COMPRESSION_NONE;
+        } else if (!strcmp(compression, "gzip")) {
+            configarray[i]->compression = COMPRESSION_GZIP;
+        } else if (!strcmp(compression, "zstd")) {
+            configarray[i]->compression = COMPRESSION_ZSTD;
+        } else {
+            fprintf(stderr, "config error: unknown compression: %s\n",
+                    compression);
+            return -1;
+        }
+        if (!compression_supported(configarray[i]->compression)) {
+            fprintf(stderr, "config error: %s compression is not supported "
+                            "by this build\n",
+                    compression);
+            return -1;
+        }
+        const int max_level =
+            configarray[i]->compression == COMPRESSION_ZSTD ? 22 : 9;
+        configarray[i]->compression_level =
+            cfg_getint(unit, "compression_level");
+        if (configarray[i]->compression_level < 0 ||
+            configarray[i]->compression_level > max_level) {
+            fprintf(stderr, "config error: compression_level needs to be "
+                            "between 1 and %d, or 0 for the default\n",
+                    max_level);
+            return -1;
+        }
+        if (!configarray[i]->compression_level) {
+            configarray[i]->compression_level = COMPRESSION_LEVEL_DEFAULT;
+        }
+        configarray[i]->compression_min_size =
+            cfg_getint(unit, "compression_min_size");
+        if (configarray[i]->compression_min_size < 0) {
+            fprintf(stderr,
+                    "config error: compression_min_size can't be negative\n");
+            return -1;
+        }
+        if (configarray[i]->compression != COMPRESSION_NONE) {
+            INFO("\tCOMPRESSION: %s, min size: %d", compression,
+                 configarray[i]->compression_min_size);
+        }
+        configarray[i]->dedup_window_ms = cfg_getint(unit, "dedup_window_ms");
+        configarray[i]->dedup_size = cfg_getint(unit, "dedup_size");
+        if (configarray[i]->dedup_window_ms < 0 ||
+            configarray[i]->dedup_size < 1) {
+            fprintf(stderr, "config error: dedup_window_ms can't be "
+                            "negative, and dedup_size needs to be positive\n");
+            return -1;
+        }
+        configarray[i]->conflate = cfg_getbool(unit, "conflate");
+        configarray[i]->conflate_max_topics =
+            cfg_getint(unit, "conflate_max_topics");
+        if (configarray[i]->conflate_max_topics < 1) {
+            fprintf(stderr,
+                    "config error: conflate_max_topics needs to be positive\n");
+            return -1;
+        }
+        if (configarray[i]->conflate) {
+            INFO("\tCONFLATION: max %d topics",
+                 configarray[i]->conflate_max_topics);
+        }
+        configarray[i]->spool_before_ack =
+            cfg_getbool(unit, "spool_before_ack");
+        if (configarray[i]->spool_before_ack &&
+            (!configarray[i]->spool_dir || configarray[i]->batch_size > 1 ||
+             configarray[i]->conflate)) {
+            fprintf(stderr, "config error: spool_before_ack needs spool_dir, "
+                            "and can't be used with batching or conflation "
+                            "in unit %s\n",
+                    configarray[i]->unit_name);
+            return -1;
+        }
         configarray[i]->enabled = cfg_getbool(unit, "enabled");
+        // set up by main() if the connection is shared
+        configarray[i]->mqtt_hub = NULL;
+        configarray[i]->mqtt_hub_id = -1;
     }
     return unit_count;
 }
@@ -196,9 +657,62 @@ int get_rest2mqtt_unitconfigs(Rest2MqttUnitConfiguration *configarray[],
 
         INFO("\tListen port: %d", cfg_getint(unit, "listen_port"));
         configarray[i]->listen_port = cfg_getint(unit, "listen_port");
+        configarray[i]->max_clients = cfg_getint(unit, "max_clients");
+        if (configarray[i]->max_clients < 1) {
+            fprintf(stderr, "config error: max_clients needs to be positive\n");
+            return -1;
+        }
+        configarray[i]->http_threads = cfg_getint(unit, "http_threads");
+        configarray[i]->publish_queue_size =
+            cfg_getint(unit, "publish_queue_size");
+        if (configarray[i]->http_threads < 0 ||
+            configarray[i]->publish_queue_size < 1 ||
+            configarray[i]->publish_queue_size > RING_BUFFER_MAX_CAPACITY) {
+            fprintf(stderr, "config error: http_threads can't be negative, "
+                            "and publish_queue_size needs to be between 1 "
+                            "and %d\n",
+                    RING_BUFFER_MAX_CAPACITY);
+            return -1;
+        }
+        if (cfg_getint(unit, "max_body_size") < 1) {
+            fprintf(stderr, "config error: max_body_size needs to be "
+                            "positive\n");
+            return -1;
+        }
+        configarray[i]->max_body_size = cfg_getint(unit, "max_body_size");
+        configarray[i]->bulk_path = cfg_getstr(unit, "bulk_path");
+        if (!strlen(configarray[i]->bulk_path)) {
+            configarray[i]->bulk_path = NULL;
+        } else {
+            INFO("\tBULK PATH: %s", configarray[i]->bulk_path);
+        }
+        configarray[i]->publish_ack = cfg_getbool(unit, "publish_ack");
+        configarray[i]->publish_ack_timeout_ms =
+            cfg_getint(unit, "publish_ack_timeout_ms");
+        if (configarray[i]->publish_ack_timeout_ms < 1) {
+            fprintf(stderr, "config error: publish_ack_timeout_ms needs to "
+                            "be positive\n");
+            return -1;
+        }
+        if (configarray[i]->publish_ack) {
+            INFO("\tPUBLISH ACK TIMEOUT: %d ms",
+                 configarray[i]->publish_ack_timeout_ms);
+        }
+        if (get_outstanding_limits(unit, configarray[i])) {
+            return -1;
+        }
+        if (configarray[i]->http_threads > 0) {
+            INFO("\tHTTP THREADS: %d, publish queue: %d",
+                 configarray[i]->http_threads,
+                 configarray[i]->publish_queue_size);
+        }
 
         configarray[i]->mqtt_topic_root = cfg_getstr(unit, "mqtt_topic_root");
         INFO("\tTOPIC ROOT: %s", configarray[i]->mqtt_topic_root);
+        if (get_rewrite_rules(unit, REWRITE_URL_TO_TOPIC,
+                              &configarray[i]->rewrite)) {
+            return -1;
+        }
         configarray[i]->enabled = cfg_getbool(unit, "enabled");
     }
     return unit_count;
@@ -20,6 +20,15 @@
 
 #ifndef CONFIGURATION_H
 #define CONFIGURATION_H
+#include "batcher.h"
+#include "mqtt_client.h"
+#include "rate_limiter.h"
+#include "rest_client.h"
+#include "rewrite.h"
+#include "ring_buffer.h"
+#include "url_template.h"
+
+struct MqttHub;
 
 typedef struct {
     const char *appname;
@@ -30,6 +39,16 @@ typedef struct {
     const char *mqtt_broker_host;
     int mqtt_broker_port;
     int mqtt_keepalive;
+    MqttProtocolVersion mqtt_protocol_version;
+    // MQTT v5 only, 0 disables them
+    int mqtt_receive_maximum;
+    int mqtt_topic_alias_maximum;
+    int mqtt_message_expiry;
+    // the mqtt2rest units receive their messages over one shared
+    // connection, instead of one connection per unit
+    bool mqtt_shared_connection;
+    // the client id of the shared connection, NULL for the default
+    const char *mqtt_client_id;
 
     bool mqtt_tls;
     const char *mqtt_cafile;
@@ -41,6 +60,8 @@ typedef struct {
     const char *mqtt_user;
     const char *mqtt_pw;
 
+    // seconds between the statistics log lines of the units, 0 to disable
+    int stats_interval;
 } Configuration;
 
 /* This struct holds the configuration of
@@ -52,7 +73,62 @@ typedef struct {
     bool enabled;
     const char *webservice_baseurl;
     const char *mqtt_topic;
+    // NULL, or the group of the shared subscription to mqtt_topic
+    const char *mqtt_share_group;
+    // NULL if the library should generate one
+    const char *mqtt_client_id;
+    bool mqtt_persistent_session;
+    int mqtt_qos;
+    // compiled from url_template, or from the base url and the topic
+    struct UrlTemplate *url_template;
+    // the topic to url rewrite rules, NULL if there are none
+    struct RewriteRules *rewrite;
+    int max_connections;
+    RestHttpVersion http_version;
+    int max_streams;
+    int connect_timeout_ms;
+    int request_timeout_ms;
+    int max_retries;
+    int retry_base_ms;
+    int retry_max_ms;
+    int breaker_threshold;
+    int breaker_cooldown_ms;
+    // shared by the senders of the unit, NULL if rate_limit is 0
+    RateLimiterConfiguration rate_limit_config;
+    struct RateLimiter *rate_limiter;
+    // batching is enabled if batch_size > 1
+    int batch_size;
+    int batch_linger_ms;
+    BatchFormat batch_format;
+    bool batch_per_url;
+    int queue_size;
+    RingOverflowPolicy queue_overflow;
+    // 0: the messages are sent by the unit thread itself
+    int sender_workers;
+    // NULL if spooling is disabled
+    const char *spool_dir;
+    int spool_max_size_mb;
+    int spool_segment_size_mb;
+    int spool_sync_interval_ms;
+    int spool_replay_rate;
+    // the received messages are synced to the spool before they are
+    // acknowledged to the broker, and sent from there
+    bool spool_before_ack;
+    CompressionType compression;
+    int compression_level;
+    int compression_min_size;
+    // the repeated messages within dedup_window_ms are dropped, 0 disables
+    int dedup_window_ms;
+    int dedup_size;
+    // only the latest pending message of each topic is sent, for at
+    // most conflate_max_topics topics at once
+    bool conflate;
+    int conflate_max_topics;
     Configuration *common_configuration;
+    // the shared connection and the id of the unit on it, NULL if the
+    // unit has its own connection
+    struct MqttHub *mqtt_hub;
+    int mqtt_hub_id;
 } Mqtt2RestUnitConfiguration;
 
 /* This struct holds the configuration of
@@ -64,7 +140,33 @@ typedef struct {
     const char *unit_name;
     bool enabled;
     int listen_port;
+    // max number of concurrent HTTP connections
+    int max_clients;
+    // 0: the requests are handled by the unit thread, otherwise by a
+    // pool of this many threads, which queue them for the unit thread
+    int http_threads;
+    int publish_queue_size;
+    // the bigger request bodies are refused with 413, it also limits
+    // the size of a decompressed body
+    size_t max_body_size;
+    // the url of the bulk publish requests, NULL if it's disabled
+    const char *bulk_path;
+    // the response is held back until the publish is confirmed by the
+    // broker, or publish_ack_timeout_ms expires
+    bool publish_ack;
+    int publish_ack_timeout_ms;
+    // the requests are refused with 503 when more messages or bytes
+    // are waiting for the broker, 0 disables the limit, until they drop
+    // to the resume_ values
+    int max_outstanding_messages;
+    int resume_outstanding_messages;
+    size_t max_outstanding_bytes;
+    size_t resume_outstanding_bytes;
+    // the Retry-After of the 503 responses, in seconds
+    int retry_after;
     const char *mqtt_topic_root;
+    // the url to topic rewrite rules, NULL if there are none
+    struct RewriteRules *rewrite;
     Configuration *common_configuration;
 } Rest2MqttUnitConfiguration;
 
@@ -0,0 +1,177 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "conflation.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// one topic with a pending message
+typedef struct Pending {
+    Message *msg;
+    struct Pending *bucket_next;
+    struct Pending *next;
+} Pending;
+
+typedef struct Conflator {
+    ConflatorConfiguration *config;
+    Pending **buckets;
+    size_t mask;
+    // the order of sending, the oldest topic first
+    Pending *oldest;
+    Pending *newest;
+    size_t count;
+    // the unused entries, so they are not allocated for every topic
+    Pending *free_list;
+    uint64_t replaced;
+} Conflator;
+
+static size_t conflator_hash(const Conflator *c, const char *str)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash & c->mask;
+}
+
+Conflator *conflator_init(ConflatorConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->max_topics > 0);
+    size_t buckets = 16;
+    while (buckets < config->max_topics) {
+        buckets <<= 1;
+    }
+    Conflator *retval = SAFEMALLOC(sizeof(Conflator));
+    retval->config = config;
+    retval->buckets = SAFEMALLOC(buckets * sizeof(Pending *));
+    memset(retval->buckets, 0, buckets * sizeof(Pending *));
+    retval->mask = buckets - 1;
+    retval->oldest = NULL;
+    retval->newest = NULL;
+    retval->count = 0;
+    retval->free_list = NULL;
+    retval->replaced = 0;
+    return retval;
+}
+
+bool conflator_full(Conflator *c)
+{
+    assert(c != NULL);
+    return c->count >= c->config->max_topics;
+}
+
+/* takes the ownership of the message. If the topic already has a
+ * pending message, it's freed and replaced, otherwise the topic is
+ * added to the end of the list, so the caller has to check with
+ * conflator_full() first.
+ */
+void conflator_put(Conflator *c, Message *msg)
+{
+    assert(c != NULL);
+    assert(msg != NULL);
+    const size_t bucket = conflator_hash(c, msg->topic);
+    Pending *p = c->buckets[bucket];
+    while (p && strcmp(p->msg->topic, msg->topic)) {
+        p = p->bucket_next;
+    }
+    if (p) {
+        DEBUG("Unit [%s]: replacing the pending message of %s",
+              c->config->label, msg->topic);
+        message_free(p->msg);
+        p->msg = msg;
+        c->replaced++;
+        return;
+    }
+    assert(!conflator_full(c));
+    if (c->free_list) {
+        p = c->free_list;
+        c->free_list = p->next;
+    } else {
+        p = SAFEMALLOC(sizeof(Pending));
+    }
+    p->msg = msg;
+    p->bucket_next = c->buckets[bucket];
+    c->buckets[bucket] = p;
+    p->next = NULL;
+    if (c->newest) {
+        c->newest->next = p;
+    } else {
+        c->oldest = p;
+    }
+    c->newest = p;
+    c->count++;
+}
+
+// removes and returns the message of the oldest topic, NULL if empty
+Message *conflator_pop(Conflator *c)
+{
+    assert(c != NULL);
+    Pending *p = c->oldest;
+    if (!p) {
+        return NULL;
+    }
+    Pending **b = &c->buckets[conflator_hash(c, p->msg->topic)];
+    while (*b != p) {
+        b = &(*b)->bucket_next;
+    }
+    *b = p->bucket_next;
+    c->oldest = p->next;
+    if (!c->oldest) {
+        c->newest = NULL;
+    }
+    c->count--;
+    Message *msg = p->msg;
+    p->next = c->free_list;
+    c->free_list = p;
+    return msg;
+}
+
+size_t conflator_pending(Conflator *c)
+{
+    assert(c != NULL);
+    return c->count;
+}
+
+uint64_t conflator_replaced(Conflator *c)
+{
+    assert(c != NULL);
+    return c->replaced;
+}
+
+// the pending messages have to be popped by the caller before
+void conflator_destroy(Conflator *c)
+{
+    if (!c) {
+        return;
+    }
+    assert(c->count == 0);
+    while (c->free_list) {
+        Pending *p = c->free_list;
+        c->free_list = p->next;
+        free(p);
+    }
+    free(c->buckets);
+    free(c);
+}
@@ -0,0 +1,52 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file conflation.h
+ *   @brief The conflator keeps only the latest pending message of each
+ *   topic: a message replaces the not yet sent one with the same topic,
+ *   which keeps its place in the sending order. So for the "current
+ *   state" topics the number of requests is bounded by the number of
+ *   distinct topics, not by the message rate. The pending messages are
+ *   in a hash table by their topic, and in a list ordered by the
+ *   arrival of the first message of the topic. It holds at most
+ *   max_topics topics, the caller keeps the rest queued until there is
+ *   room. It's not thread safe, it's used by the sending thread.
+ */
+#ifndef CONFLATION_H
+#define CONFLATION_H
+#include "message.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *label;
+    size_t max_topics;
+} ConflatorConfiguration;
+
+struct Conflator;
+
+struct Conflator *conflator_init(ConflatorConfiguration *config);
+bool conflator_full(struct Conflator *c);
+void conflator_put(struct Conflator *c, Message *msg);
+Message *conflator_pop(struct Conflator *c);
+size_t conflator_pending(struct Conflator *c);
+uint64_t conflator_replaced(struct Conflator *c);
+void conflator_destroy(struct Conflator *c);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "dedup.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the number of slots probed for a hash
+#define DEDUP_PROBES 8
+
+typedef struct {
+    // 0 if the slot is empty
+    uint64_t hash;
+    uint64_t seen;
+} DedupEntry;
+
+typedef struct Dedup {
+    DedupConfiguration *config;
+    DedupEntry *entries;
+    size_t mask;
+    // read by the sender threads for the statistics
+    uint64_t suppressed;
+} Dedup;
+
+// FNV-1a, continuing from hash
+static uint64_t dedup_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+Dedup *dedup_init(DedupConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->window_ms > 0);
+    size_t capacity = DEDUP_PROBES;
+    while (capacity < config->capacity) {
+        capacity <<= 1;
+    }
+    Dedup *retval = SAFEMALLOC(sizeof(Dedup));
+    retval->config = config;
+    retval->entries = SAFEMALLOC(capacity * sizeof(DedupEntry));
+    memset(retval->entries, 0, capacity * sizeof(DedupEntry));
+    retval->mask = capacity - 1;
+    retval->suppressed = 0;
+    return retval;
+}
+
+/* Returns true if the same message was seen within the window, in
+ * which case it should be dropped. Otherwise the message is recorded.
+ */
+bool dedup_check(Dedup *d, const char *topic, const void *payload,
+                 size_t payload_len)
+{
+    assert(d != NULL);
+    // the NUL of the topic separates it from the payload
+    uint64_t hash = dedup_hash(14695981039346656037ull, topic,
+                               strlen(topic) + 1);
+    hash = dedup_hash(hash, payload, payload_len);
+    if (!hash) {
+        hash = 1;
+    }
+    const uint64_t now = monotonic_ms();
+    const uint64_t window = d->config->window_ms;
+    // the first expired slot, or the oldest one if none expired
+    DedupEntry *victim = NULL;
+    bool victim_expired = false;
+    for (int i = 0; i < DEDUP_PROBES; i++) {
+        DedupEntry *e = &d->entries[(hash + i) & d->mask];
+        const bool expired = !e->hash || now - e->seen >= window;
+        if (e->hash == hash && !expired) {
+            __atomic_add_fetch(&d->suppressed, 1, __ATOMIC_RELAXED);
+            DEBUG("Unit [%s]: dropping duplicate message on topic %s",
+                  d->config->label, topic);
+            return true;
+        }
+        if (expired) {
+            if (!victim_expired) {
+                victim = e;
+                victim_expired = true;
+            }
+        } else if (!victim || (!victim_expired && e->seen < victim->seen)) {
+            victim = e;
+        }
+    }
+    victim->hash = hash;
+    victim->seen = now;
+    return false;
+}
+
+uint64_t dedup_suppressed(Dedup *d)
+{
+    assert(d != NULL);
+    return __atomic_load_n(&d->suppressed, __ATOMIC_RELAXED);
+}
+
+void dedup_destroy(Dedup *d)
+{
+    if (!d) {
+        return;
+    }
+    free(d->entries);
+    free(d);
+}
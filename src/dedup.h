@@ -0,0 +1,50 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file dedup.h
+ *   @brief The dedup filter drops the repeats of the messages seen in
+ *   the last window_ms, e.g. the QoS 1 redeliveries after a reconnect.
+ *   The messages are identified by a 64 bit hash of their topic and
+ *   payload, which are kept in a fixed size hash table, with the time
+ *   they were last seen. When the table is full, the oldest entries in
+ *   the probed range are overwritten, so a repeat is not detected if
+ *   more than capacity distinct messages arrive within the window.
+ *   It's not thread safe, each filter is used by one receiving thread.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *label;
+    int window_ms;
+    // rounded up to the next power of 2
+    size_t capacity;
+} DedupConfiguration;
+
+struct Dedup;
+
+struct Dedup *dedup_init(DedupConfiguration *config);
+bool dedup_check(struct Dedup *d, const char *topic, const void *payload,
+                 size_t payload_len);
+uint64_t dedup_suppressed(struct Dedup *d);
+void dedup_destroy(struct Dedup *d);
+
+#endif
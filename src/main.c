@@ -40,7 +40,9 @@
 
 #include "configuration.h"
 #include "logging.h"
+#include "message.h"
 #include "mqtt2rest_unit.h"
+#include "mqtt_hub.h"
 #include "rest2mqtt_unit.h"
 #include <config.h>
 
@@ -51,8 +53,13 @@ static char *app_name = PACKAGE_NAME;
 
 Configuration *config = NULL;
 #define MAX_UNIT_NUM 32
+// max number of the free messages kept for reuse per size class
+#define MESSAGE_POOL_SIZE 1024
 
-static pthread_t threads[MAX_UNIT_NUM];
+// one more for the shared mqtt connection, and a terminating 0
+static pthread_t threads[MAX_UNIT_NUM + 2];
+// the shared mqtt connection, if enabled
+static struct MqttHub *mqtt_hub = NULL;
 
 /**
  * \brief   Callback function for handling signals.
@@ -76,6 +83,9 @@ void handle_signal(int sig)
         if (pid_file != NULL) {
             unlink(pid_file);
         }
+        // the shared connection and its units wait on the hub, so they
+        // can't miss the stop the way they could miss SIGUSR1
+        mqtt_hub_stop(mqtt_hub);
         // signal the unit threads to exit
         int i = 0;
         while (threads[i]) {
@@ -275,6 +285,8 @@ int main(int argc, char *argv[])
     // we need to call this only once, and it's not thread
     // safe, so we do it here
     mosquitto_lib_init();
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    message_pool_init(MESSAGE_POOL_SIZE);
 
     // setting up storage for the unit configuration list
     int mqtt2rest_count = MAX_UNIT_NUM;
@@ -300,6 +312,25 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // the mqtt2rest units have to be added to the shared connection
+    // before any of them is started
+    if (config->mqtt_shared_connection) {
+        mqtt_hub = mqtt_hub_new(config);
+        for (int i = 0; i < mqtt2rest_count; i++) {
+            if (!unit_configs[i]->enabled) {
+                continue;
+            }
+            unit_configs[i]->mqtt_hub = mqtt_hub;
+            unit_configs[i]->mqtt_hub_id =
+                mqtt_hub_add(mqtt_hub, unit_configs[i]);
+            if (unit_configs[i]->mqtt_hub_id < 0) {
+                ERROR("Invalid mqtt_topic in unit %s",
+                      unit_configs[i]->unit_name);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
     // create a thread for each mqtt2rest unit
     int threadcounter = 0;
     for (int i = 0; i < mqtt2rest_count; i++) {
@@ -331,22 +362,37 @@ int main(int argc, char *argv[])
         }
     }
     DEBUG("Started %d units", threadcounter);
+    if (mqtt_hub) {
+        int ret = pthread_create(&threads[threadcounter++], NULL,
+                                 mqtt_hub_run, (void *)mqtt_hub);
+        if (ret) {
+            fprintf(stderr, "Error - pthread_create() return code: %d\n", ret);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // waiting for all of the threads to exit, if ever
     for (int i = 0; i < threadcounter; i++) {
         pthread_join(threads[i], NULL);
     }
 
+    mqtt_hub_free(mqtt_hub);
     // freeing up the per-unit configs
     for (int i = 0; i < mqtt2rest_count; i++) {
+        url_template_free(unit_configs[i]->url_template);
+        rewrite_rules_free(unit_configs[i]->rewrite);
+        rate_limiter_free(unit_configs[i]->rate_limiter);
         free(unit_configs[i]);
     }
     for (int i = 0; i < rest2mqtt_count; i++) {
+        rewrite_rules_free(rest2mqtt_unit_configs[i]->rewrite);
         free(rest2mqtt_unit_configs[i]);
     }
     // free up the main config
     free_config();
     mosquitto_lib_cleanup();
+    curl_global_cleanup();
+    message_pool_cleanup();
     log_finalize();
     INFO("bye");
     return EXIT_SUCCESS;
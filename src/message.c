@@ -0,0 +1,124 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "message.h"
+#include "ring_buffer.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* The freed messages are kept in lock-free queues by their size class,
+ * as they are usually allocated by the mqtt thread and freed by a
+ * sender thread. The messages bigger than the largest class are
+ * allocated and freed directly.
+ */
+#define MESSAGE_POOL_CLASSES 5
+static const size_t pool_sizes[MESSAGE_POOL_CLASSES] = {256, 1024, 4096,
+                                                         16384, 65536};
+// the free messages of a size class take at most this many bytes, so
+// fewer of the larger ones are kept
+#define MESSAGE_POOL_CLASS_BYTES (1 << 20)
+static RingBufferConfiguration pool_configs[MESSAGE_POOL_CLASSES];
+static struct RingBuffer *pools[MESSAGE_POOL_CLASSES];
+
+static void pool_drop(void *item, void *ctx)
+{
+    (void)ctx;
+    free(item);
+}
+
+/* sets up the pool, keeping at most per_class free messages of each
+ * size class, and at most MESSAGE_POOL_CLASS_BYTES of them. Has to be
+ * called before the threads start.
+ */
+void message_pool_init(size_t per_class)
+{
+    for (int i = 0; i < MESSAGE_POOL_CLASSES; i++) {
+        RingBufferConfiguration *pool_config = &pool_configs[i];
+        pool_config->capacity = MESSAGE_POOL_CLASS_BYTES / pool_sizes[i];
+        if (pool_config->capacity > per_class) {
+            pool_config->capacity = per_class;
+        }
+        pool_config->overflow_policy = RING_OVERFLOW_DROP_NEWEST;
+        pool_config->callback_context = NULL;
+        pool_config->drop_callback = &pool_drop;
+        pools[i] = ring_buffer_init(pool_config);
+    }
+}
+
+void message_pool_cleanup()
+{
+    for (int i = 0; i < MESSAGE_POOL_CLASSES; i++) {
+        if (pools[i]) {
+            ring_buffer_destroy(pools[i]);
+            pools[i] = NULL;
+        }
+    }
+}
+
+/* copies the topic and the payload into one allocation
+ * together with the struct itself. The payload is NUL terminated,
+ * but it may contain NUL bytes, so payload_len is authoritative.
+ */
+Message *message_new(const char *topic, const void *payload,
+                     size_t payload_len)
+{
+    const size_t topic_len = strlen(topic);
+    const size_t size = sizeof(Message) + topic_len + 1 + payload_len + 1;
+    Message *msg = NULL;
+    int pool_class = 0;
+    while (pool_class < MESSAGE_POOL_CLASSES &&
+           pool_sizes[pool_class] < size) {
+        pool_class++;
+    }
+    if (pool_class == MESSAGE_POOL_CLASSES || !pools[pool_class]) {
+        msg = SAFEMALLOC(size);
+        pool_class = -1;
+    } else {
+        msg = ring_buffer_pop(pools[pool_class]);
+        if (!msg) {
+            msg = SAFEMALLOC(pool_sizes[pool_class]);
+        }
+    }
+    msg->topic = (char *)(msg + 1);
+    memcpy(msg->topic, topic, topic_len + 1);
+    msg->payload = NULL;
+    if (payload) {
+        msg->payload = msg->topic + topic_len + 1;
+        memcpy(msg->payload, payload, payload_len);
+        msg->payload[payload_len] = '\0';
+    }
+    msg->payload_len = payload_len;
+    msg->timestamp = realtime_ms();
+    msg->flags = 0;
+    msg->qos = 0;
+    msg->userdata = NULL;
+    msg->pool_class = pool_class;
+    return msg;
+}
+
+void message_free(Message *msg)
+{
+    if (msg->pool_class < 0) {
+        free(msg);
+        return;
+    }
+    // if the pool is full, it's freed by pool_drop()
+    ring_buffer_push(pools[msg->pool_class], msg);
+}
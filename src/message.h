@@ -0,0 +1,59 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file message.h
+ *   @brief A received MQTT message, owned by the mqtt2rest unit
+ *   from its arrival until it's sent or dropped. The payload is
+ *   binary safe, and it's posted directly from the message, so it
+ *   has to be kept alive until the request is finished. The messages
+ *   are recycled through a pool of a few size classes.
+ */
+#ifndef MESSAGE_H
+#define MESSAGE_H
+#include <stddef.h>
+#include <stdint.h>
+
+// the message is a complete batch request: the topic is the url of the
+// request, and the payload is the body
+#define MESSAGE_FLAG_BATCH 0x1
+// the message is published with the retain flag
+#define MESSAGE_FLAG_RETAIN 0x2
+
+typedef struct {
+    char *topic;
+    char *payload;
+    size_t payload_len;
+    // arrival time, ms since the epoch
+    uint64_t timestamp;
+    uint32_t flags;
+    // the QoS to publish with, for the messages going to MQTT
+    int qos;
+    // the HTTP request waiting for the publish to be confirmed, NULL
+    // if nothing waits for it
+    void *userdata;
+    // the size class of the pool, -1 if it's not pooled
+    int pool_class;
+} Message;
+
+void message_pool_init(size_t per_class);
+void message_pool_cleanup();
+Message *message_new(const char *topic, const void *payload,
+                     size_t payload_len);
+void message_free(Message *msg);
+
+#endif
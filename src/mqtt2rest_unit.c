@@ -20,68 +20,925 @@
 #include "mqtt_client.h"
 #include <assert.h>
 
-#include <curl/curl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "batcher.h"
 #include "configuration.h"
+#include "conflation.h"
+#include "dedup.h"
 #include "logging.h"
+#include "message.h"
+#include "mqtt_hub.h"
+#include "rest_client.h"
+#include "ring_buffer.h"
+#include "spool.h"
+#include "url_template.h"
+#include "utils.h"
 
-#define URL_MAX_SIZE 2048
-
-static int rest_post(Mqtt2RestUnitConfiguration *config, const char *url,
-                     const char *payload)
-{
-    CURL *curl;
-    CURLcode res;
-    int retval = 0;
-    const int len = strlen(config->webservice_baseurl);
-    DEBUG("len url: %d", strlen(url));
-    char full_url[URL_MAX_SIZE];
-    strncpy(full_url, config->webservice_baseurl, URL_MAX_SIZE - 1);
-    if (full_url[len - 1] != '/') {
-        DEBUG("Need to append a '/'");
-        full_url[len] = '/';
-        full_url[len + 1] = '\0';
-    }
-    strncat(full_url, url, URL_MAX_SIZE - len - 1);
-    INFO("FULL URL: %s", full_url);
-
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, full_url);
-        if (payload == NULL) {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "POST");
+// while the web service is down, the spool is probed this often
+#define SPOOL_PROBE_INTERVAL_MS 5000
+// with the prefix rate limit scope, the requests to the other prefixes
+// are still sent until this many wait for the limiter
+#define MAX_THROTTLED_REQUESTS 16
+
+/* one message being sent. The replayed messages are kept in a list
+ * in the order they were read from the spool, so they can be committed
+ * in the same order
+ */
+typedef struct Delivery {
+    Message *msg;
+    bool replay;
+    enum { DELIVERY_PENDING, DELIVERY_OK, DELIVERY_FAILED } state;
+    SpoolPosition position;
+    struct Delivery *next;
+} Delivery;
+
+/* The sending side of a unit: the queue of the received messages, and
+ * everything needed to post them. It's either driven by the unit thread
+ * itself, or by its own worker thread.
+ */
+typedef struct {
+    Mqtt2RestUnitConfiguration *config;
+    char label[64];
+    RestClientConfiguration rest_config;
+    struct RestClientHandle *rest;
+    // NULL if batching is disabled
+    BatcherConfiguration batch_config;
+    struct Batcher *batcher;
+    // NULL if the dedup filter is disabled, it's used by the receiving
+    // thread
+    DedupConfiguration dedup_config;
+    struct Dedup *dedup;
+    // the received messages waiting to be sent
+    RingBufferConfiguration queue_config;
+    struct RingBuffer *queue;
+    // NULL if conflation is disabled, otherwise the messages are moved
+    // from the queue to it, and they are sent from there
+    ConflatorConfiguration conflator_config;
+    struct Conflator *conflator;
+    // NULL if spooling is disabled
+    SpoolConfiguration spool_config;
+    struct Spool *spool;
+    // the outcome of the last request
+    bool endpoint_up;
+    // replay state: the outstanding replays, and the rate limiting
+    Delivery *replay_first;
+    Delivery *replay_last;
+    int replay_outstanding;
+    bool replay_failed;
+    double replay_tokens;
+    uint64_t replay_last_refill;
+    uint64_t next_probe;
+    // max number of parallel requests
+    int max_inflight;
+    // reused for assembling the urls
+    Buffer url;
+    // pollfds for the http transfers, the mqtt socket in the first one
+    struct pollfd *pfd;
+    nfds_t pfd_size;
+    uint64_t next_stats;
+    // the worker thread, and its eventfd to wake it up when the queue
+    // gets new messages, or when it has to stop
+    pthread_t thread;
+    int wakeup_fd;
+    bool sleeping;
+    bool stop;
+    // set by the unit while it waits for room in the full queue, the
+    // worker then signals the room_fd of the unit
+    bool room_wanted;
+    int room_fd;
+    // with the drop_oldest policy and a spool, the receiving thread
+    // spools the evicted messages. It holds this mutex meanwhile, and
+    // the worker while it takes the next message, so the newer messages
+    // can't get ahead of the evicted one.
+    bool evict_locked;
+    pthread_mutex_t evict_mutex;
+} Mqtt2RestSender;
+
+// a received message which didn't fit in the queue of its sender
+typedef struct {
+    Mqtt2RestSender *sender;
+    Message *msg;
+} BlockedMessage;
+
+typedef struct {
+    Mqtt2RestUnitConfiguration *config;
+    Mqtt2RestSender *senders;
+    int sender_count;
+    // the senders are run by their own threads
+    bool workers;
+    // the messages are received over the shared connection
+    bool shared;
+    // with the block overflow policy, the messages which didn't fit in
+    // the queues, in the order they were received
+    BlockedMessage *blocked;
+    size_t blocked_count;
+    size_t blocked_size;
+    // signalled by the workers when they make room in their queue
+    int room_fd;
+} Mqtt2RestUnit;
+
+/* the url of the message: from the most specific matching rewrite
+ * rule, or from the url template if none matches. Valid until the
+ * next call.
+ */
+static const char *build_url(Mqtt2RestSender *sender, const Message *msg)
+{
+    Mqtt2RestUnitConfiguration *unitconfig = sender->config;
+    if (!unitconfig->rewrite ||
+        !rewrite_apply(unitconfig->rewrite, msg->topic, &sender->url,
+                       msg->timestamp)) {
+        url_template_expand(unitconfig->url_template, &sender->url,
+                            msg->topic, msg->timestamp, NULL, 0);
+    }
+    return sender->url.data;
+}
+
+// stores the message in the spool if it's enabled, and frees it
+static void spool_or_drop(Mqtt2RestSender *sender, Message *msg)
+{
+    if (sender->spool) {
+        spool_append(sender->spool, msg);
+    }
+    message_free(msg);
+}
+
+// committing the delivered replays in the order they were read
+static void process_replays(Mqtt2RestSender *sender)
+{
+    while (sender->replay_first &&
+           sender->replay_first->state != DELIVERY_PENDING) {
+        Delivery *d = sender->replay_first;
+        if (d->state == DELIVERY_FAILED) {
+            sender->replay_failed = true;
+        } else if (!sender->replay_failed) {
+            spool_commit(sender->spool, d->position);
+        }
+        sender->replay_first = d->next;
+        if (!sender->replay_first) {
+            sender->replay_last = NULL;
+        }
+        sender->replay_outstanding--;
+        free(d);
+    }
+    if (!sender->replay_first && sender->replay_failed) {
+        // everything after the failed one is sent again later
+        spool_rewind(sender->spool);
+        sender->replay_failed = false;
+    }
+}
+
+/* the rejected messages are dropped, as sending them again would not
+ * help, only the failed ones are spooled
+ */
+static void on_rest_done(void *userdata, RestResult result, void *ctx)
+{
+    Mqtt2RestSender *sender = (Mqtt2RestSender *)ctx;
+    Delivery *d = (Delivery *)userdata;
+    sender->endpoint_up = result != REST_RESULT_FAILED;
+    if (!sender->endpoint_up) {
+        sender->next_probe = monotonic_ms() + SPOOL_PROBE_INTERVAL_MS;
+    }
+    if (d->replay) {
+        message_free(d->msg);
+        d->state = sender->endpoint_up ? DELIVERY_OK : DELIVERY_FAILED;
+        process_replays(sender);
+        return;
+    }
+    if (sender->endpoint_up) {
+        message_free(d->msg);
+    } else {
+        spool_or_drop(sender, d->msg);
+    }
+    free(d);
+}
+
+/* starts the request for the message, the delivery is owned
+ * by the rest client until on_rest_done() is called
+ */
+static void post_message(Mqtt2RestSender *sender, Delivery *d)
+{
+    const Message *msg = d->msg;
+    const char *url = msg->topic;
+    const char *content_type = NULL;
+    if (msg->flags & MESSAGE_FLAG_BATCH) {
+        content_type = sender->config->batch_format == BATCH_FORMAT_JSON
+                           ? "application/json"
+                           : "application/x-ndjson";
+    } else {
+        url = build_url(sender, msg);
+    }
+    DEBUG("Unit [%s]: URL: %s", sender->label, url);
+
+    // the request is only started here, the outcome is
+    // handled when the transfer completes in the poll loop
+    if (!rest_client_post(sender->rest, url, msg->payload,
+                          msg->payload_len, content_type, d)) {
+        on_rest_done(d, REST_RESULT_FAILED, sender);
+    }
+}
+
+static Delivery *delivery_new(Message *msg)
+{
+    Delivery *d = SAFEMALLOC(sizeof(Delivery));
+    d->msg = msg;
+    d->replay = false;
+    d->state = DELIVERY_PENDING;
+    d->next = NULL;
+    return d;
+}
+
+static void on_batch_flush(const char *url, const char *body, size_t len,
+                           const char *content_type, void *ctx)
+{
+    Mqtt2RestSender *sender = (Mqtt2RestSender *)ctx;
+    (void)content_type;
+    // the batch is sent as one message, so it can be spooled as well
+    Message *msg = message_new(url, body, len);
+    msg->flags |= MESSAGE_FLAG_BATCH;
+    post_message(sender, delivery_new(msg));
+}
+
+static void on_queue_drop(void *item, void *ctx)
+{
+    Mqtt2RestSender *sender = (Mqtt2RestSender *)ctx;
+    Message *msg = (Message *)item;
+    DEBUG("Unit [%s]: queue full, dropping message on topic %s",
+          sender->label, msg->topic);
+    spool_or_drop(sender, msg);
+}
+
+static void send_message(Mqtt2RestSender *sender, Message *msg)
+{
+    Mqtt2RestUnitConfiguration *unitconfig = sender->config;
+    // keeping the order: while there are spooled messages, or the web
+    // service is down, the new ones go to the end of the spool
+    if (sender->spool &&
+        (!sender->endpoint_up || spool_pending(sender->spool) > 0 ||
+         !rest_client_available(sender->rest))) {
+        spool_or_drop(sender, msg);
+        return;
+    }
+    if (sender->batcher) {
+        if (unitconfig->batch_per_url) {
+            batcher_add(sender->batcher, build_url(sender, msg), msg->topic,
+                        msg->payload, msg->payload_len, msg->timestamp);
+        } else {
+            batcher_add(sender->batcher, unitconfig->webservice_baseurl,
+                        msg->topic, msg->payload, msg->payload_len,
+                        msg->timestamp);
+        }
+        message_free(msg);
+        return;
+    }
+    // calling the URL with the payload
+    post_message(sender, delivery_new(msg));
+}
+
+static bool has_capacity(Mqtt2RestSender *sender)
+{
+    // while the requests are waiting for the rate limiter, the new
+    // messages are kept in the queue (or spooled)
+    const int throttled = rest_client_throttled(sender->rest);
+    if (throttled &&
+        (sender->config->rate_limit_config.scope != RATE_LIMIT_PREFIX ||
+         throttled >= MAX_THROTTLED_REQUESTS)) {
+        return false;
+    }
+    return rest_client_inflight(sender->rest) < sender->max_inflight;
+}
+
+/* sends the spooled messages again, in order, as fast as the
+ * connections allow, or at most spool_replay_rate messages per second
+ * if it's set. While the web service seems to be down, it's only probed
+ * with one message periodically.
+ */
+static void replay_spool(Mqtt2RestSender *sender)
+{
+    if (!sender->spool || sender->replay_failed) {
+        return;
+    }
+    const uint64_t now = monotonic_ms();
+    const int rate = sender->config->spool_replay_rate;
+    if (rate > 0) {
+        sender->replay_tokens +=
+            (now - sender->replay_last_refill) * rate / 1000.0;
+        if (sender->replay_tokens > rate) {
+            sender->replay_tokens = rate;
+        }
+        sender->replay_last_refill = now;
+    }
+
+    while ((!rate || sender->replay_tokens >= 1) && has_capacity(sender) &&
+           rest_client_available(sender->rest)) {
+        if (!sender->endpoint_up &&
+            (sender->replay_outstanding || now < sender->next_probe)) {
+            return;
+        }
+        SpoolPosition position;
+        Message *msg = spool_read(sender->spool, &position);
+        if (!msg) {
+            return;
+        }
+        if (rate > 0) {
+            sender->replay_tokens -= 1;
+        }
+        Delivery *d = delivery_new(msg);
+        d->replay = true;
+        d->position = position;
+        if (sender->replay_last) {
+            sender->replay_last->next = d;
         } else {
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
+            sender->replay_first = d;
+        }
+        sender->replay_last = d;
+        sender->replay_outstanding++;
+        if (!sender->endpoint_up) {
+            // probing, the next one waits for the outcome of this one
+            sender->next_probe = now + SPOOL_PROBE_INTERVAL_MS;
+        }
+        post_message(sender, d);
+    }
+}
+
+// whether replay_spool() would send a spooled message right away
+static bool replay_ready(Mqtt2RestSender *sender)
+{
+    return sender->endpoint_up && !sender->replay_failed &&
+           (!sender->config->spool_replay_rate ||
+            sender->replay_tokens >= 1) &&
+           spool_pending(sender->spool) >
+               (uint64_t)sender->replay_outstanding &&
+           has_capacity(sender) && rest_client_available(sender->rest);
+}
+
+// the number of messages waiting to be sent
+static size_t queued_messages(Mqtt2RestSender *sender)
+{
+    size_t retval = ring_buffer_depth(sender->queue);
+    if (sender->conflator) {
+        retval += conflator_pending(sender->conflator);
+    }
+    return retval;
+}
+
+// sending the queued messages, as long as there is free capacity
+static void dispatch_queue(Mqtt2RestSender *sender)
+{
+    // the queue is emptied into the conflator regardless of the
+    // capacity, so the new messages can replace the pending ones there
+    if (sender->conflator) {
+        if (sender->evict_locked) {
+            pthread_mutex_lock(&sender->evict_mutex);
+        }
+        Message *msg;
+        while (!conflator_full(sender->conflator) &&
+               (msg = ring_buffer_pop(sender->queue))) {
+            conflator_put(sender->conflator, msg);
+        }
+        if (sender->evict_locked) {
+            pthread_mutex_unlock(&sender->evict_mutex);
+        }
+    }
+    // with batching, a message only starts a request when it fills up a
+    // batch, but the batches are held back as well without a free
+    // connection
+    while (has_capacity(sender)) {
+        // while the breaker is open, the messages are kept in the queue,
+        // unless they can go to the spool
+        if (!sender->spool && !rest_client_available(sender->rest)) {
+            break;
+        }
+        if (sender->evict_locked) {
+            pthread_mutex_lock(&sender->evict_mutex);
+        }
+        Message *msg = sender->conflator
+                           ? conflator_pop(sender->conflator)
+                           : ring_buffer_pop(sender->queue);
+        if (msg) {
+            send_message(sender, msg);
+        }
+        if (sender->evict_locked) {
+            pthread_mutex_unlock(&sender->evict_mutex);
+        }
+        if (!msg) {
+            break;
+        }
+    }
+}
+
+/* puts the pollfds of the http transfers after the first 'first'
+ * pollfds in sender->pfd, returns their number
+ */
+static nfds_t get_rest_pollfds(Mqtt2RestSender *sender, const nfds_t first)
+{
+    const nfds_t needed = rest_client_pollfd_count(sender->rest) + first;
+    if (needed > sender->pfd_size) {
+        sender->pfd_size = needed;
+        sender->pfd =
+            SAFEREALLOC(sender->pfd, sender->pfd_size * sizeof(struct pollfd));
+    }
+    nfds_t rest_nfds = sender->pfd_size - first;
+    return rest_client_get_pollfds(sender->rest, sender->pfd + first,
+                                   &rest_nfds);
+}
+
+// shortens the timeout to the next deadline of the http side
+static int get_rest_timeout(Mqtt2RestSender *sender, int timeout)
+{
+    const int rest_timeout = rest_client_get_timeout(sender->rest);
+    if (rest_timeout >= 0 && rest_timeout < timeout) {
+        timeout = rest_timeout;
+    }
+    // the expired batches wait for a free connection
+    if (sender->batcher && has_capacity(sender)) {
+        const int batch_timeout = batcher_get_timeout(sender->batcher);
+        if (batch_timeout >= 0 && batch_timeout < timeout) {
+            timeout = batch_timeout;
+        }
+    }
+    if (sender->spool) {
+        const int spool_timeout = spool_get_timeout(sender->spool);
+        if (spool_timeout >= 0 && spool_timeout < timeout) {
+            timeout = spool_timeout;
+        }
+        // waking up for the next replay as well
+        if (spool_pending(sender->spool) >
+                (uint64_t)sender->replay_outstanding &&
+            timeout > 100) {
+            timeout = 100;
+        }
+        // the received messages are sent from the spool
+        if (sender->config->spool_before_ack && replay_ready(sender)) {
+            timeout = 0;
+        }
+    }
+    return timeout;
+}
+
+static void process_rest(Mqtt2RestSender *sender, const nfds_t first,
+                         const nfds_t count)
+{
+    rest_client_loop(sender->rest, sender->pfd + first, count);
+    if (sender->batcher) {
+        while (has_capacity(sender) &&
+               batcher_flush_expired(sender->batcher)) {
+        }
+    }
+    dispatch_queue(sender);
+    if (sender->spool) {
+        replay_spool(sender);
+        spool_sync(sender->spool, false);
+    }
+}
+
+static void log_stats(Mqtt2RestSender *sender)
+{
+    const int interval =
+        sender->config->common_configuration->stats_interval;
+    if (interval <= 0 || monotonic_ms() < sender->next_stats) {
+        return;
+    }
+    sender->next_stats = monotonic_ms() + interval * 1000;
+    INFO("Unit [%s] stats: queue depth: %zu/%zu (max %zu), dropped: %llu, "
+         "in-flight requests: %d",
+         sender->label, ring_buffer_depth(sender->queue),
+         ring_buffer_capacity(sender->queue),
+         ring_buffer_max_depth(sender->queue),
+         (unsigned long long)ring_buffer_dropped(sender->queue),
+         rest_client_inflight(sender->rest));
+    if (sender->spool) {
+        INFO("Unit [%s] stats: spooled: %llu, rejected by the spool: %llu",
+             sender->label, (unsigned long long)spool_pending(sender->spool),
+             (unsigned long long)spool_rejected(sender->spool));
+    }
+    if (sender->dedup) {
+        INFO("Unit [%s] stats: duplicates dropped: %llu", sender->label,
+             (unsigned long long)dedup_suppressed(sender->dedup));
+    }
+    if (sender->config->rate_limiter) {
+        INFO("Unit [%s] stats: waiting for the rate limit: %d, delayed "
+             "in the unit: %llu",
+             sender->label, rest_client_throttled(sender->rest),
+             (unsigned long long)rate_limiter_delayed(
+                 sender->config->rate_limiter));
+    }
+    if (sender->conflator) {
+        INFO("Unit [%s] stats: conflated topics: %zu, replaced: %llu",
+             sender->label, conflator_pending(sender->conflator),
+             (unsigned long long)conflator_replaced(sender->conflator));
+    }
+}
+
+static void sender_destroy(Mqtt2RestSender *sender);
+
+/* sets up the sending side, with a separate spool directory
+ * and log label for each worker. On failure, everything set up so far
+ * is released.
+ */
+static bool sender_init(Mqtt2RestSender *sender,
+                        Mqtt2RestUnitConfiguration *unitconfig,
+                        const int index, const bool worker)
+{
+    sender->config = unitconfig;
+    // so sender_destroy() can be called at any point below
+    sender->rest = NULL;
+    sender->batcher = NULL;
+    sender->spool = NULL;
+    sender->dedup = NULL;
+    sender->conflator = NULL;
+    sender->queue = NULL;
+    sender->pfd = NULL;
+    buffer_init(&sender->url);
+    sender->wakeup_fd = -1;
+    sender->room_fd = -1;
+    sender->evict_locked = false;
+    if (worker) {
+        snprintf(sender->label, sizeof(sender->label), "%s.%d",
+                 unitconfig->unit_name, index);
+    } else {
+        snprintf(sender->label, sizeof(sender->label), "%s",
+                 unitconfig->unit_name);
+    }
+
+    // set up the http client
+    RestClientConfiguration *rest_config = &sender->rest_config;
+    rest_config->label = sender->label;
+    rest_config->base_url = unitconfig->webservice_baseurl;
+    rest_config->max_connections = unitconfig->max_connections;
+    rest_config->http_version = unitconfig->http_version;
+    rest_config->max_streams = unitconfig->max_streams;
+    rest_config->connect_timeout_ms = unitconfig->connect_timeout_ms;
+    rest_config->request_timeout_ms = unitconfig->request_timeout_ms;
+    rest_config->max_retries = unitconfig->max_retries;
+    rest_config->retry_base_ms = unitconfig->retry_base_ms;
+    rest_config->retry_max_ms = unitconfig->retry_max_ms;
+    rest_config->breaker_threshold = unitconfig->breaker_threshold;
+    rest_config->breaker_cooldown_ms = unitconfig->breaker_cooldown_ms;
+    rest_config->compression = unitconfig->compression;
+    rest_config->compression_level = unitconfig->compression_level;
+    rest_config->compression_min_size = unitconfig->compression_min_size;
+    rest_config->rate_limiter = unitconfig->rate_limiter;
+    rest_config->callback_context = (void *)sender;
+    rest_config->done_callback = &on_rest_done;
+    sender->rest = rest_client_init(rest_config);
+    if (sender->rest == NULL) {
+        FATAL("Failed to init REST client");
+        sender_destroy(sender);
+        return false;
+    }
+    sender->max_inflight = unitconfig->max_connections;
+    if (unitconfig->http_version != REST_HTTP_1_1) {
+        sender->max_inflight *= unitconfig->max_streams;
+    }
+
+    BatcherConfiguration *batch_config = &sender->batch_config;
+    batch_config->label = sender->label;
+    batch_config->max_items = unitconfig->batch_size;
+    batch_config->linger_ms = unitconfig->batch_linger_ms;
+    batch_config->format = unitconfig->batch_format;
+    batch_config->callback_context = (void *)sender;
+    batch_config->flush_callback = &on_batch_flush;
+    if (unitconfig->batch_size > 1) {
+        sender->batcher = batcher_init(batch_config);
+    }
+
+    SpoolConfiguration *spool_config = &sender->spool_config;
+    spool_config->label = sender->label;
+    spool_config->dir = unitconfig->spool_dir;
+    spool_config->max_size = (size_t)unitconfig->spool_max_size_mb << 20;
+    spool_config->segment_size = (size_t)unitconfig->spool_segment_size_mb
+                                 << 20;
+    spool_config->sync_interval_ms = unitconfig->spool_sync_interval_ms;
+    if (unitconfig->spool_dir) {
+        sender->spool = spool_init(spool_config);
+        if (sender->spool == NULL) {
+            FATAL("Failed to init the spool in %s", unitconfig->spool_dir);
+            sender_destroy(sender);
+            return false;
+        }
+    }
+    sender->endpoint_up = true;
+    sender->replay_first = NULL;
+    sender->replay_last = NULL;
+    sender->replay_outstanding = 0;
+    sender->replay_failed = false;
+    sender->replay_tokens = 0;
+    sender->replay_last_refill = monotonic_ms();
+    sender->next_probe = 0;
+
+    DedupConfiguration *dedup_config = &sender->dedup_config;
+    dedup_config->label = sender->label;
+    dedup_config->window_ms = unitconfig->dedup_window_ms;
+    dedup_config->capacity = unitconfig->dedup_size;
+    if (unitconfig->dedup_window_ms > 0) {
+        sender->dedup = dedup_init(dedup_config);
+    }
+
+    ConflatorConfiguration *conflator_config = &sender->conflator_config;
+    conflator_config->label = sender->label;
+    conflator_config->max_topics = unitconfig->conflate_max_topics;
+    if (unitconfig->conflate) {
+        sender->conflator = conflator_init(conflator_config);
+    }
+
+    RingBufferConfiguration *queue_config = &sender->queue_config;
+    queue_config->capacity = unitconfig->queue_size;
+    queue_config->overflow_policy = unitconfig->queue_overflow;
+    // the shared connection can't wait for one unit
+    if (unitconfig->mqtt_hub &&
+        queue_config->overflow_policy == RING_OVERFLOW_BLOCK) {
+        queue_config->overflow_policy = RING_OVERFLOW_DROP_NEWEST;
+    }
+    queue_config->callback_context = (void *)sender;
+    queue_config->drop_callback = &on_queue_drop;
+    sender->queue = ring_buffer_init(queue_config);
+    if (worker && sender->spool &&
+        queue_config->overflow_policy == RING_OVERFLOW_DROP_OLDEST) {
+        sender->evict_locked = true;
+        pthread_mutex_init(&sender->evict_mutex, NULL);
+    }
+    sender->pfd_size = 16;
+    sender->pfd = SAFEMALLOC(sender->pfd_size * sizeof(struct pollfd));
+    sender->next_stats =
+        monotonic_ms() +
+        unitconfig->common_configuration->stats_interval * 1000;
+    sender->sleeping = false;
+    sender->stop = false;
+    sender->room_wanted = false;
+    if (worker) {
+        sender->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sender->wakeup_fd < 0) {
+            FATAL("Failed to create eventfd: %s", strerror(errno));
+            sender_destroy(sender);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void sender_destroy(Mqtt2RestSender *sender)
+{
+    // the unsent messages end up in the spool, if it's enabled
+    if (sender->conflator) {
+        Message *msg;
+        while ((msg = conflator_pop(sender->conflator))) {
+            spool_or_drop(sender, msg);
+        }
+        conflator_destroy(sender->conflator);
+    }
+    if (sender->queue) {
+        ring_buffer_destroy(sender->queue);
+    }
+    if (sender->batcher) {
+        if (sender->spool) {
+            batcher_flush_all(sender->batcher);
+        }
+        batcher_destroy(sender->batcher);
+    }
+    if (sender->rest) {
+        rest_client_destroy(sender->rest);
+    }
+    dedup_destroy(sender->dedup);
+    if (sender->spool) {
+        spool_destroy(sender->spool);
+    }
+    if (sender->wakeup_fd >= 0) {
+        close(sender->wakeup_fd);
+    }
+    if (sender->evict_locked) {
+        pthread_mutex_destroy(&sender->evict_mutex);
+    }
+    buffer_free(&sender->url);
+    free(sender->pfd);
+}
+
+static void signal_eventfd(const char *label, const int fd)
+{
+    const uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        ERROR("Unit [%s]: failed to signal eventfd: %s", label,
+              strerror(errno));
+    }
+}
+
+static void clear_eventfd(const char *label, const int fd)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        ERROR("Unit [%s]: failed to read eventfd: %s", label,
+              strerror(errno));
+    }
+}
+
+static void sender_wakeup(Mqtt2RestSender *sender)
+{
+    signal_eventfd(sender->label, sender->wakeup_fd);
+}
+
+// the loop of a worker thread, until the unit asks it to stop
+static void *sender_run(void *data)
+{
+    Mqtt2RestSender *sender = (Mqtt2RestSender *)data;
+    DEBUG("Starting sender thread %s", sender->label);
+    while (!__atomic_load_n(&sender->stop, __ATOMIC_ACQUIRE)) {
+        // the eventfd is the first pollfd, the rest are the
+        // sockets of the ongoing http transfers
+        const nfds_t rest_nfds = get_rest_pollfds(sender, 1);
+        sender->pfd[0].fd = sender->wakeup_fd;
+        sender->pfd[0].events = POLLIN;
+        sender->pfd[0].revents = 0;
+
+        int timeout = get_rest_timeout(sender, 1000);
+        const int interval =
+            sender->config->common_configuration->stats_interval;
+        if (interval > 0) {
+            const uint64_t now = monotonic_ms();
+            const int stats_timeout =
+                sender->next_stats > now ? sender->next_stats - now : 0;
+            if (stats_timeout < timeout) {
+                timeout = stats_timeout;
+            }
         }
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            ERROR("curl_easy_perform() failed: %s", curl_easy_strerror(res));
-            retval = -1;
+        // the producer only signals the eventfd if we are sleeping, so
+        // the queue is checked again after announcing it
+        __atomic_store_n(&sender->sleeping, true, __ATOMIC_SEQ_CST);
+        if (queued_messages(sender) && has_capacity(sender) &&
+            (sender->spool || rest_client_available(sender->rest))) {
+            timeout = 0;
         }
-        curl_easy_cleanup(curl);
+        if (sender->conflator && ring_buffer_depth(sender->queue) &&
+            !conflator_full(sender->conflator)) {
+            timeout = 0;
+        }
+        if (sender->config->spool_before_ack && replay_ready(sender)) {
+            timeout = 0;
+        }
+        const int ret = poll(sender->pfd, rest_nfds + 1, timeout);
+        __atomic_store_n(&sender->sleeping, false, __ATOMIC_SEQ_CST);
+        if (ret < 0 && errno != EINTR) {
+            ERROR("Poll() failed with <%s>, exiting", strerror(errno));
+            break;
+        }
+        if (ret > 0 && sender->pfd[0].revents & POLLIN) {
+            clear_eventfd(sender->label, sender->wakeup_fd);
+        }
+        process_rest(sender, 1, ret > 0 ? rest_nfds : 0);
+        // the unit waits for room in the queue with the block policy
+        if (__atomic_load_n(&sender->room_wanted, __ATOMIC_SEQ_CST) &&
+            ring_buffer_depth(sender->queue) <
+                ring_buffer_capacity(sender->queue)) {
+            __atomic_store_n(&sender->room_wanted, false, __ATOMIC_SEQ_CST);
+            signal_eventfd(sender->label, sender->room_fd);
+        }
+        log_stats(sender);
+    }
+    DEBUG("Sender thread %s exiting...", sender->label);
+    return NULL;
+}
+
+// FNV-1a, so the messages of the same topic always go to the same sender
+static Mqtt2RestSender *select_sender(Mqtt2RestUnit *unit, const char *topic)
+{
+    if (unit->sender_count == 1) {
+        return unit->senders;
     }
+    uint32_t hash = 2166136261u;
+    while (*topic) {
+        hash ^= (unsigned char)*topic++;
+        hash *= 16777619u;
+    }
+    return &unit->senders[hash % unit->sender_count];
+}
+
+// pushing into the queue, under the evict_mutex if it may evict
+static RingPushResult push_message(Mqtt2RestSender *sender, Message *msg)
+{
+    if (!sender->evict_locked) {
+        return ring_buffer_push(sender->queue, msg);
+    }
+    pthread_mutex_lock(&sender->evict_mutex);
+    const RingPushResult retval = ring_buffer_push(sender->queue, msg);
+    pthread_mutex_unlock(&sender->evict_mutex);
     return retval;
 }
 
-void on_mqtt_msg(const char *topic, const char *msg, void *ctx)
+/* pushes the message into the queue of the sender, false if the queue
+ * is full with the block overflow policy
+ */
+static bool queue_message(Mqtt2RestUnit *unit, Mqtt2RestSender *sender,
+                          Message *msg)
+{
+    if (push_message(sender, msg) == RING_PUSH_FULL) {
+        if (!unit->workers) {
+            return false;
+        }
+        // the worker only signals the room_fd if we are waiting, so the
+        // queue is checked again after announcing it
+        __atomic_store_n(&sender->room_wanted, true, __ATOMIC_SEQ_CST);
+        if (push_message(sender, msg) == RING_PUSH_FULL) {
+            return false;
+        }
+    }
+    if (unit->workers &&
+        __atomic_load_n(&sender->sleeping, __ATOMIC_SEQ_CST)) {
+        sender_wakeup(sender);
+    }
+    return true;
+}
+
+// queues the blocked messages in order, true if none is left
+static bool queue_blocked(Mqtt2RestUnit *unit)
+{
+    size_t done = 0;
+    while (done < unit->blocked_count &&
+           queue_message(unit, unit->blocked[done].sender,
+                         unit->blocked[done].msg)) {
+        done++;
+    }
+    if (done) {
+        unit->blocked_count -= done;
+        memmove(unit->blocked, unit->blocked + done,
+                unit->blocked_count * sizeof(BlockedMessage));
+    }
+    return unit->blocked_count == 0;
+}
+
+/* The message is on the disk when this returns, so before the client
+ * (in threaded mode it only queues the PUBACK/PUBREC until the callback
+ * returns) acknowledges it to the broker. The sender then posts it from
+ * the spool, and commits it once the POST succeeded, so it survives a
+ * crash until then. A message rejected by the full spool is dropped.
+ */
+static void spool_before_ack(Mqtt2RestUnit *unit, Mqtt2RestSender *sender,
+                             Message *msg)
+{
+    spool_or_drop(sender, msg);
+    spool_sync(sender->spool, true);
+    if (unit->workers &&
+        __atomic_load_n(&sender->sleeping, __ATOMIC_SEQ_CST)) {
+        sender_wakeup(sender);
+    }
+}
+
+/* the payload is copied once into a pooled message, which is then
+ * posted without further copies
+ */
+void on_mqtt_msg(const char *topic, const void *payload, size_t payload_len,
+                 void *ctx)
 {
     INFO("Got MQTT msg on topic %s", topic);
-    Mqtt2RestUnitConfiguration *unitconfig = (Mqtt2RestUnitConfiguration *)ctx;
-    // tailoring the url, removing the base topic from the beggining by
-    // advancing the pointer
-    const char *url = topic + strlen(unitconfig->mqtt_topic) + 1; // +1 the '/'
-    // calling the URL with the payload
-    if (msg != NULL) {
-        DEBUG("Payload: %s", msg);
+    Mqtt2RestUnit *unit = (Mqtt2RestUnit *)ctx;
+    DEBUG("Payload: %zu bytes", payload_len);
+    Mqtt2RestSender *sender = select_sender(unit, topic);
+    // the same topic always goes to the same sender, so its filter sees
+    // all the repeats
+    if (sender->dedup &&
+        dedup_check(sender->dedup, topic, payload, payload_len)) {
+        return;
+    }
+    Message *queued = message_new(topic, payload, payload_len);
+    if (unit->config->spool_before_ack) {
+        spool_before_ack(unit, sender, queued);
+        return;
     }
-    rest_post(unitconfig, url, msg);
+    // with the block overflow policy the message waits behind the ones
+    // already blocked, and the unit thread stops reading the MQTT socket
+    // until they are all queued
+    if (unit->blocked_count || !queue_message(unit, sender, queued)) {
+        if (unit->blocked_count == unit->blocked_size) {
+            unit->blocked_size = unit->blocked_size * 2 + 16;
+            unit->blocked = SAFEREALLOC(
+                unit->blocked, unit->blocked_size * sizeof(BlockedMessage));
+        }
+        unit->blocked[unit->blocked_count].sender = sender;
+        unit->blocked[unit->blocked_count].msg = queued;
+        unit->blocked_count++;
+    }
+}
+
+// stops the worker threads, and destroys the senders
+static void destroy_senders(Mqtt2RestUnit *unit, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        Mqtt2RestSender *sender = &unit->senders[i];
+        if (unit->workers) {
+            __atomic_store_n(&sender->stop, true, __ATOMIC_RELEASE);
+            sender_wakeup(sender);
+            pthread_join(sender->thread, NULL);
+        }
+        sender_destroy(sender);
+    }
+    free(unit->senders);
 }
 
 void *mqtt2rest_unit_run(void *configdata)
@@ -93,13 +950,64 @@ void *mqtt2rest_unit_run(void *configdata)
     Configuration *config = (Configuration *)unitconfig->common_configuration;
     assert(config != NULL);
 
+    Mqtt2RestUnit unit;
+    unit.config = unitconfig;
+    unit.blocked = NULL;
+    unit.blocked_count = 0;
+    unit.blocked_size = 0;
+    unit.room_fd = -1;
+    unit.shared = unitconfig->mqtt_hub != NULL;
+    // without workers the unit thread sends the messages itself, with
+    // the shared connection it doesn't receive them, so it can't
+    unit.workers = unit.shared || unitconfig->sender_workers > 0;
+    unit.sender_count =
+        unitconfig->sender_workers > 0 ? unitconfig->sender_workers : 1;
+    unit.senders = SAFEMALLOC(unit.sender_count * sizeof(Mqtt2RestSender));
+    for (int i = 0; i < unit.sender_count; i++) {
+        Mqtt2RestSender *sender = &unit.senders[i];
+        if (!sender_init(sender, unitconfig, i, unit.workers)) {
+            destroy_senders(&unit, i);
+            return NULL;
+        }
+        if (unit.workers &&
+            pthread_create(&sender->thread, NULL, sender_run, sender)) {
+            FATAL("Failed to start sender thread %s", sender->label);
+            sender_destroy(sender);
+            destroy_senders(&unit, i);
+            return NULL;
+        }
+    }
+    Mqtt2RestSender *sender = unit.workers ? NULL : unit.senders;
+
+    if (unit.shared) {
+        mqtt_hub_attach(unitconfig->mqtt_hub, unitconfig->mqtt_hub_id,
+                        &on_mqtt_msg, &unit);
+        // everything is done by the hub and the worker threads, we just
+        // wait until the hub is stopped
+        mqtt_hub_wait(unitconfig->mqtt_hub);
+        mqtt_hub_detach(unitconfig->mqtt_hub, unitconfig->mqtt_hub_id);
+        destroy_senders(&unit, unit.sender_count);
+        INFO("Unit thread %s exiting...", unitconfig->unit_name);
+        return NULL;
+    }
+
     // set up the mqtt client config
     MqttClientConfiguration mqtt_config;
     mqtt_config.label = unitconfig->unit_name;
+    mqtt_config.client_id = unitconfig->mqtt_client_id;
+    mqtt_config.persistent_session = unitconfig->mqtt_persistent_session;
+    mqtt_config.qos = unitconfig->mqtt_qos;
     mqtt_config.topic = unitconfig->mqtt_topic;
+    mqtt_config.share_group = unitconfig->mqtt_share_group;
+    mqtt_config.filters = NULL;
+    mqtt_config.filter_count = 0;
     mqtt_config.broker_host = config->mqtt_broker_host;
     mqtt_config.broker_port = config->mqtt_broker_port;
     mqtt_config.keepalive = config->mqtt_keepalive;
+    mqtt_config.protocol_version = config->mqtt_protocol_version;
+    mqtt_config.receive_maximum = config->mqtt_receive_maximum;
+    mqtt_config.topic_alias_maximum = config->mqtt_topic_alias_maximum;
+    mqtt_config.message_expiry = config->mqtt_message_expiry;
     mqtt_config.tls_enabled = config->mqtt_tls;
     mqtt_config.cafile = config->mqtt_cafile;
     mqtt_config.capath = config->mqtt_capath;
@@ -108,18 +1016,33 @@ void *mqtt2rest_unit_run(void *configdata)
     mqtt_config.user_pw_auth_enabled = config->mqtt_user_pw;
     mqtt_config.user = config->mqtt_user;
     mqtt_config.pw = config->mqtt_pw;
-    mqtt_config.callback_context = (void *)unitconfig;
+    mqtt_config.callback_context = (void *)&unit;
     mqtt_config.msg_callback = &on_mqtt_msg;
+    mqtt_config.publish_callback = NULL;
 
     struct MqttClientHandle *mqtt = mqtt_client_init(&mqtt_config);
     if (mqtt == NULL) {
         FATAL("Failed to init MQTT client");
+        destroy_senders(&unit, unit.sender_count);
         return NULL;
     }
     mqtt_client_connect(mqtt);
-    struct pollfd pfd[1];
-    nfds_t nfds = sizeof(pfd) / sizeof(struct pollfd);
     const int poll_timeout = config->mqtt_keepalive / 2 * 1000;
+    // the mqtt socket, and the room_fd with workers
+    struct pollfd unit_pfd[2];
+    if (unit.workers) {
+        unit.room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (unit.room_fd < 0) {
+            FATAL("Failed to create eventfd: %s", strerror(errno));
+            mqtt_client_destroy(mqtt);
+            destroy_senders(&unit, unit.sender_count);
+            return NULL;
+        }
+        for (int i = 0; i < unit.sender_count; i++) {
+            unit.senders[i].room_fd = unit.room_fd;
+        }
+    }
+    uint64_t last_read = monotonic_ms();
 
     while (true) {
         if (!mqtt_client_connected(mqtt)) {
@@ -128,8 +1051,49 @@ void *mqtt2rest_unit_run(void *configdata)
                 continue;
             }
         }
-        mqtt_client_get_pollfds(mqtt, pfd, &nfds);
-        const int ret = poll(pfd, nfds, poll_timeout);
+        // while there are blocked messages the MQTT socket is only read
+        // once in every half keepalive period, so the keepalive traffic
+        // still gets through
+        bool reading = true;
+        int timeout = poll_timeout;
+        if (!queue_blocked(&unit)) {
+            const uint64_t now = monotonic_ms();
+            if (last_read + poll_timeout > now) {
+                reading = false;
+                timeout = last_read + poll_timeout - now;
+            }
+        }
+        // the first pollfd is the mqtt socket, the rest are the
+        // sockets of the ongoing http transfers, if they are
+        // handled in this thread, or the room_fd otherwise
+        struct pollfd *pfd = unit_pfd;
+        nfds_t rest_nfds = 0;
+        if (sender) {
+            rest_nfds = get_rest_pollfds(sender, 1);
+            pfd = sender->pfd;
+            timeout = get_rest_timeout(sender, timeout);
+            if (config->stats_interval > 0) {
+                const uint64_t now = monotonic_ms();
+                const int stats_timeout =
+                    sender->next_stats > now ? sender->next_stats - now : 0;
+                if (stats_timeout < timeout) {
+                    timeout = stats_timeout;
+                }
+            }
+        }
+        nfds_t mqtt_nfds = 1;
+        mqtt_client_get_pollfds(mqtt, pfd, &mqtt_nfds);
+        if (!reading) {
+            pfd[0].events &= ~POLLIN;
+        }
+        if (unit.workers) {
+            pfd[1].fd = unit.room_fd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            rest_nfds = 1;
+        }
+
+        const int ret = poll(pfd, rest_nfds + 1, timeout);
         if (ret < 0) {
             if (errno != EINTR) // we got SIGUSR1 so we halt
             {
@@ -137,10 +1101,33 @@ void *mqtt2rest_unit_run(void *configdata)
             }
             break;
         }
-        mqtt_client_loop(mqtt, pfd[0].revents & POLLIN,
-                         pfd[0].revents & POLLOUT);
+        if (unit.workers && pfd[1].revents & POLLIN) {
+            clear_eventfd(unitconfig->unit_name, unit.room_fd);
+        }
+        if (sender) {
+            process_rest(sender, 1, rest_nfds);
+        }
+        const bool readable = reading && (pfd[0].revents & POLLIN);
+        mqtt_client_loop(mqtt, readable, pfd[0].revents & POLLOUT);
+        if (readable) {
+            last_read = monotonic_ms();
+        }
+        if (sender) {
+            dispatch_queue(sender);
+            log_stats(sender);
+        }
     }
 
+    mqtt_client_destroy(mqtt);
+    // the blocked messages end up in the spool like the queued ones
+    for (size_t i = 0; i < unit.blocked_count; i++) {
+        spool_or_drop(unit.blocked[i].sender, unit.blocked[i].msg);
+    }
+    free(unit.blocked);
+    destroy_senders(&unit, unit.sender_count);
+    if (unit.room_fd >= 0) {
+        close(unit.room_fd);
+    }
     INFO("Unit thread %s exiting...", unitconfig->unit_name);
     return NULL;
 }
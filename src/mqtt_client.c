@@ -1,16 +1,43 @@
 #include "mqtt_client.h"
 #include "logging.h"
+#include "utils.h"
 #include <assert.h>
 #include <mosquitto.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define MAX_TOPIC_LENGTH 256
+// the message ids are 16 bit
+#define MAX_MID 65536
+
+// the MQTT v5 API is available since libmosquitto 1.6
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+#define HAVE_MQTT_V5
+#include <mqtt_protocol.h>
+#endif
+
+// a message queued in libmosquitto, which is not yet sent or acknowledged
+typedef struct {
+    uint32_t size;
+    uint8_t qos;
+    bool used;
+} OutstandingMessage;
 
 typedef struct MqttClientHandle {
     struct mosquitto *mosq;
     MqttClientConfiguration *config;
     bool connected;
+    bool v5;
+    // the topics bound to the topic aliases of the current connection,
+    // indexed by the alias - 1, NULL if the alias is not bound yet
+    char **aliases;
+    int alias_count;
+    // the outstanding messages indexed by their mid, allocated with the
+    // first publish
+    OutstandingMessage *outstanding;
+    int outstanding_count;
+    size_t outstanding_bytes;
 } MqttClientHandle;
 /* Called when a message arrives to the subscribed topic,
  * we just removing the lead topic and turn it into an URL and calling
@@ -19,10 +46,17 @@ typedef struct MqttClientHandle {
 static void mqtt_cb_msg(struct mosquitto *mosq, void *userdata,
                         const struct mosquitto_message *msg)
 {
-    MqttClientConfiguration *config = userdata;
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
     assert(config != NULL);
+    const char *topic = msg->topic;
+    // the brokers deliver the messages of a shared subscription on their
+    // original topic, but just in case, the share prefix is removed here
+    if (!strncmp(topic, "$share/", 7)) {
+        const char *group_end = strchr(topic + 7, '/');
+        topic = group_end ? group_end + 1 : topic;
+    }
     if (config->msg_callback) {
-        config->msg_callback(msg->topic, msg->payload,
+        config->msg_callback(topic, msg->payload, msg->payloadlen,
                              config->callback_context);
     }
 
@@ -33,7 +67,7 @@ static void mqtt_cb_msg(struct mosquitto *mosq, void *userdata,
 static void mqtt_cb_subscribe(struct mosquitto *mosq, void *userdata, int mid,
                               int qos_count, const int *granted_qos)
 {
-    MqttClientConfiguration *config = userdata;
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
     assert(config != NULL);
     INFO("Unit [%s]: Subscribed to topic [%s] (mid: %d): %d", config->label,
          config->topic, mid, granted_qos[0]);
@@ -42,11 +76,71 @@ static void mqtt_cb_subscribe(struct mosquitto *mosq, void *userdata, int mid,
     }
 }
 
+static void outstanding_add(MqttClientHandle *h, int mid, size_t size,
+                            int qos)
+{
+    if (!h->outstanding) {
+        h->outstanding = SAFEMALLOC(MAX_MID * sizeof(OutstandingMessage));
+        memset(h->outstanding, 0, MAX_MID * sizeof(OutstandingMessage));
+    }
+    OutstandingMessage *m = &h->outstanding[mid % MAX_MID];
+    if (m->used) {
+        // the mid was reused, the old message is lost anyway
+        h->outstanding_count--;
+        h->outstanding_bytes -= m->size;
+    }
+    m->size = size;
+    m->qos = qos;
+    m->used = true;
+    h->outstanding_count++;
+    h->outstanding_bytes += size;
+}
+
+static void outstanding_done(MqttClientHandle *h, int mid)
+{
+    if (!h->outstanding || !h->outstanding[mid % MAX_MID].used) {
+        return;
+    }
+    OutstandingMessage *m = &h->outstanding[mid % MAX_MID];
+    m->used = false;
+    h->outstanding_count--;
+    h->outstanding_bytes -= m->size;
+}
+
+/* libmosquitto discards the unsent QoS 0 messages when the connection
+ * is lost, without calling the publish callback. The QoS 1 and 2 ones
+ * are kept, and sent again after reconnecting.
+ */
+static void outstanding_drop_qos0(MqttClientHandle *h)
+{
+    if (!h->outstanding) {
+        return;
+    }
+    for (int mid = 0; mid < MAX_MID; mid++) {
+        if (h->outstanding[mid].used && h->outstanding[mid].qos == 0) {
+            outstanding_done(h, mid);
+        }
+    }
+}
+
+/* As the client is in threaded mode, mosquitto_publish() only queues the
+ * message, so this is never called before the caller got the mid
+ */
+static void mqtt_cb_publish(struct mosquitto *mosq, void *userdata, int mid)
+{
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
+    outstanding_done(userdata, mid);
+    if (config->publish_callback) {
+        config->publish_callback(mid, true, config->callback_context);
+    }
+}
+
 static void mqtt_cb_disconnect(struct mosquitto *mosq, void *userdata, int rc)
 {
-    MqttClientConfiguration *config = userdata;
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
     WARNING("Unit [%s] MQTT disconnect, error: %d: %s", config->label, rc,
             mosquitto_strerror(rc));
+    outstanding_drop_qos0(userdata);
 }
 
 /* transpose libmosquitto log messages into ours
@@ -55,7 +149,7 @@ static void mqtt_cb_disconnect(struct mosquitto *mosq, void *userdata, int rc)
 static void mqtt_cb_log(struct mosquitto *mosq, void *userdata, int level,
                         const char *str)
 {
-    MqttClientConfiguration *config = userdata;
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
     assert(config != NULL);
 
     switch (level) {
@@ -77,51 +171,154 @@ static void mqtt_cb_log(struct mosquitto *mosq, void *userdata, int level,
     }
 }
 
+// the aliases are valid only on the connection they were bound on
+static void mqtt_aliases_reset(MqttClientHandle *h, int count)
+{
+    for (int i = 0; i < h->alias_count; i++) {
+        free(h->aliases[i]);
+    }
+    free(h->aliases);
+    h->aliases = NULL;
+    h->alias_count = count;
+    if (count > 0) {
+        h->aliases = SAFEMALLOC(count * sizeof(char *));
+        memset(h->aliases, 0, count * sizeof(char *));
+    }
+}
+
 static void mqtt_cb_connect(struct mosquitto *mosq, void *userdata, int result)
 {
-    MqttClientConfiguration *config = userdata;
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
     assert(config != NULL);
 
     DEBUG("MQTT connect, UNIT: %s", config->label);
+    if (result) {
+        WARNING("MQTT Connect failed\n");
+        return;
+    }
+    for (int i = 0; i < config->filter_count; i++) {
+        mosquitto_subscribe(mosq, NULL, config->filters[i], config->qos);
+    }
     if (!config->topic) {
         return;
     }
     char buffer[MAX_TOPIC_LENGTH];
-    if (snprintf(buffer, MAX_TOPIC_LENGTH, "%s/#", config->topic) >=
-        MAX_TOPIC_LENGTH) {
+    int len;
+    if (config->share_group) {
+        len = snprintf(buffer, MAX_TOPIC_LENGTH, "$share/%s/%s/#",
+                       config->share_group, config->topic);
+    } else {
+        len = snprintf(buffer, MAX_TOPIC_LENGTH, "%s/#", config->topic);
+    }
+    if (len >= MAX_TOPIC_LENGTH) {
         FATAL("Topic length in config is too long, the max is %d",
               MAX_TOPIC_LENGTH);
         return;
     }
-    if (!result) {
-        mosquitto_subscribe(mosq, NULL, buffer, 2);
-    } else {
-        WARNING("MQTT Connect failed\n");
+    mosquitto_subscribe(mosq, NULL, buffer, config->qos);
+}
+
+#ifdef HAVE_MQTT_V5
+static void mqtt_cb_connect_v5(struct mosquitto *mosq, void *userdata,
+                               int result, int flags,
+                               const mosquitto_property *props)
+{
+    MqttClientHandle *h = userdata;
+    // we use as many aliases as both we and the broker allow
+    uint16_t alias_max = 0;
+    mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+                                  &alias_max, false);
+    mqtt_aliases_reset(h, alias_max < h->config->topic_alias_maximum
+                              ? alias_max
+                              : h->config->topic_alias_maximum);
+    mqtt_cb_connect(mosq, userdata, result);
+}
+
+// the reason codes from 0x80 are errors
+static void mqtt_cb_publish_v5(struct mosquitto *mosq, void *userdata, int mid,
+                               int reason_code,
+                               const mosquitto_property *props)
+{
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
+    if (reason_code >= 0x80) {
+        WARNING("Unit [%s]: the broker refused the message %d: %s",
+                config->label, mid, mosquitto_reason_string(reason_code));
+    }
+    outstanding_done(userdata, mid);
+    if (config->publish_callback) {
+        config->publish_callback(mid, reason_code < 0x80,
+                                 config->callback_context);
     }
 }
 
+static void mqtt_cb_disconnect_v5(struct mosquitto *mosq, void *userdata,
+                                  int rc, const mosquitto_property *props)
+{
+    MqttClientConfiguration *config = ((MqttClientHandle *)userdata)->config;
+    WARNING("Unit [%s] MQTT disconnect, reason: %d: %s", config->label, rc,
+            mosquitto_reason_string(rc));
+    outstanding_drop_qos0(userdata);
+}
+#endif
+
 MqttClientHandle *mqtt_client_init(MqttClientConfiguration *config)
 {
-    bool clean_session = true;
+    assert(config->client_id || !config->persistent_session);
+    bool clean_session = !config->persistent_session;
     MqttClientHandle *retval = malloc(sizeof(MqttClientHandle));
     struct mosquitto *mosq =
-        mosquitto_new(config->label, clean_session, config);
+        mosquitto_new(config->client_id, clean_session, retval);
     if (!mosq) {
         FATAL("Error: Out of memory.\n");
         return NULL;
     }
+    retval->mosq = mosq;
+    retval->config = config;
+    retval->connected = false;
+    retval->v5 = false;
+    retval->aliases = NULL;
+    retval->alias_count = 0;
+    retval->outstanding = NULL;
+    retval->outstanding_count = 0;
+    retval->outstanding_bytes = 0;
     mosquitto_threaded_set(mosq, true);
-    mosquitto_user_data_set(mosq, config);
+
+    int version = MQTT_PROTOCOL_V31;
+    if (config->protocol_version == MQTT_PROTOCOL_3_1_1) {
+        version = MQTT_PROTOCOL_V311;
+    } else if (config->protocol_version == MQTT_PROTOCOL_5) {
+#ifdef HAVE_MQTT_V5
+        version = MQTT_PROTOCOL_V5;
+        retval->v5 = true;
+#else
+        WARNING("Unit [%s]: MQTT v5 is not supported by this libmosquitto, "
+                "using v3.1.1",
+                config->label);
+        version = MQTT_PROTOCOL_V311;
+#endif
+    }
+    mosquitto_opts_set(mosq, MOSQ_OPT_PROTOCOL_VERSION, &version);
 
     mosquitto_log_callback_set(mosq, mqtt_cb_log);
-    mosquitto_connect_callback_set(mosq, mqtt_cb_connect);
     mosquitto_message_callback_set(mosq, mqtt_cb_msg);
     mosquitto_subscribe_callback_set(mosq, mqtt_cb_subscribe);
+#ifdef HAVE_MQTT_V5
+    if (retval->v5) {
+        // bounds the number of QoS 1 and 2 messages the broker sends
+        // before we acknowledge them
+        if (config->receive_maximum > 0) {
+            mosquitto_int_option(mosq, MOSQ_OPT_RECEIVE_MAXIMUM,
+                                 config->receive_maximum);
+        }
+        mosquitto_connect_v5_callback_set(mosq, mqtt_cb_connect_v5);
+        mosquitto_disconnect_v5_callback_set(mosq, mqtt_cb_disconnect_v5);
+        mosquitto_publish_v5_callback_set(mosq, mqtt_cb_publish_v5);
+        return retval;
+    }
+#endif
+    mosquitto_connect_callback_set(mosq, mqtt_cb_connect);
     mosquitto_disconnect_callback_set(mosq, mqtt_cb_disconnect);
-
-    retval->mosq = mosq;
-    retval->config = config;
-    retval->connected = false;
+    mosquitto_publish_callback_set(mosq, mqtt_cb_publish);
     return retval;
 }
 
@@ -177,17 +374,99 @@ bool mqtt_client_reconnect(MqttClientHandle *h)
     return true;
 }
 
+#ifdef HAVE_MQTT_V5
+/* The topic aliases are assigned by the hash of the topic, so a topic
+ * is sent in full only the first time, or when its alias was taken by
+ * another topic meanwhile. They are used only for QoS 0, as the library
+ * may resend the QoS 1 and 2 messages on a new connection, where the
+ * alias is not bound.
+ */
+static int mqtt_publish_v5(MqttClientHandle *h, const char *topic,
+                           const void *payload, size_t payload_len, int qos,
+                           bool retain, int *mid)
+{
+    mosquitto_property *props = NULL;
+    if (h->config->message_expiry > 0) {
+        mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL,
+                                     h->config->message_expiry);
+    }
+    const char *send_topic = topic;
+    int slot = -1;
+    if (h->alias_count > 0 && qos == 0) {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (const char *c = topic; *c; c++) {
+            hash ^= (unsigned char)*c;
+            hash *= 16777619u;
+        }
+        slot = hash % h->alias_count;
+        if (h->aliases[slot] && !strcmp(h->aliases[slot], topic)) {
+            send_topic = NULL;
+        } else {
+            free(h->aliases[slot]);
+            h->aliases[slot] = strdup(topic);
+        }
+        mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, slot + 1);
+    }
+    int ret = mosquitto_publish_v5(h->mosq, mid, send_topic, payload_len,
+                                   payload, qos, retain, props);
+    if (ret != MOSQ_ERR_SUCCESS && slot >= 0) {
+        // the alias may not have reached the broker
+        free(h->aliases[slot]);
+        h->aliases[slot] = NULL;
+    }
+    mosquitto_property_free_all(&props);
+    return ret;
+}
+#endif
+
 bool mqtt_client_publish(struct MqttClientHandle *h, const char *topic,
-                         const char *msg, int qos)
+                         const void *payload, size_t payload_len, int qos,
+                         bool retain, int *mid)
 {
-    INFO("Publishing on topic %s", topic + 1);
+    DEBUG("Publishing on topic %s", topic);
     assert(h != NULL);
-    int ret = mosquitto_publish(h->mosq, NULL, topic + 1, strlen(msg),
-                                (void *)msg, qos, false);
-    if (ret != MOSQ_ERR_SUCCESS) {
+    int local_mid = 0;
+    int ret;
+#ifdef HAVE_MQTT_V5
+    if (h->v5) {
+        ret = mqtt_publish_v5(h, topic, payload, payload_len, qos, retain,
+                              &local_mid);
+    } else
+#endif
+    {
+        ret = mosquitto_publish(h->mosq, &local_mid, topic, payload_len,
+                                payload, qos, retain);
+    }
+    // the QoS 1 and 2 messages are queued even without a connection, and
+    // sent after reconnecting, so they are accepted like the sent ones
+    const bool queued = qos > 0 && ret == MOSQ_ERR_NO_CONN;
+    if (ret == MOSQ_ERR_SUCCESS || queued) {
+        outstanding_add(h, local_mid, strlen(topic) + payload_len, qos);
+    }
+    if (queued) {
+        DEBUG("Not connected, message %d queued for the reconnect",
+              local_mid);
+    } else if (ret != MOSQ_ERR_SUCCESS) {
         WARNING("Failed to publish, reason:  %s", mosquitto_strerror(ret));
     }
-    return (ret == MOSQ_ERR_SUCCESS);
+    if (mid) {
+        *mid = local_mid;
+    }
+    return (ret == MOSQ_ERR_SUCCESS || queued);
+}
+
+/* returns the number of the messages passed to libmosquitto, which are
+ * not yet sent (QoS 0) or acknowledged (QoS 1 and 2), and puts their
+ * size to bytes
+ */
+int mqtt_client_outstanding(struct MqttClientHandle *h, size_t *bytes)
+{
+    assert(h != NULL);
+    if (bytes) {
+        *bytes = h->outstanding_bytes;
+    }
+    return h->outstanding_count;
 }
 
 nfds_t mqtt_client_get_pollfds(MqttClientHandle *h, struct pollfd *pfds,
@@ -226,5 +505,7 @@ void mqtt_client_destroy(MqttClientHandle *h)
 {
     assert(h != NULL);
     mosquitto_destroy(h->mosq);
+    mqtt_aliases_reset(h, 0);
+    free(h->outstanding);
     free(h);
 }
@@ -30,12 +30,39 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+typedef enum {
+    MQTT_PROTOCOL_3_1,
+    MQTT_PROTOCOL_3_1_1,
+    MQTT_PROTOCOL_5
+} MqttProtocolVersion;
+
 typedef struct {
     const char *label;
+    // NULL to let the library generate a random one
+    const char *client_id;
+    // the broker keeps the subscriptions and the undelivered messages
+    // while we are disconnected, needs a client_id
+    bool persistent_session;
+    // the QoS of the subscriptions
+    int qos;
+    // subscribed as <topic>/#, can be NULL
     const char *topic;
+    // if set, the topic is subscribed as $share/<share_group>/<topic>/#
+    const char *share_group;
+    // further topic filters, subscribed as they are
+    const char *const *filters;
+    int filter_count;
     const char *broker_host;
     int broker_port;
     int keepalive;
+    MqttProtocolVersion protocol_version;
+    // the rest is only used with MQTT v5, 0 disables them
+    // max number of unacknowledged QoS 1 and 2 messages from the broker
+    int receive_maximum;
+    // max number of topic aliases used for publishing
+    int topic_alias_maximum;
+    // seconds until the published messages expire
+    int message_expiry;
 
     bool tls_enabled;
     const char *cafile;
@@ -47,7 +74,15 @@ typedef struct {
     const char *user;
     const char *pw;
     void *callback_context;
-    void (*msg_callback)(const char *topic, const char *msg, void *ctx);
+    // the payload is only valid during the call, and it's not
+    // NUL terminated
+    void (*msg_callback)(const char *topic, const void *payload,
+                         size_t payload_len, void *ctx);
+    // called from mqtt_client_loop() with the mid returned by
+    // mqtt_client_publish(), when a QoS 0 message is sent, or a QoS 1
+    // or 2 one is acknowledged. success is false if the broker refused
+    // it, which is only reported with MQTT v5. Can be NULL.
+    void (*publish_callback)(int mid, bool success, void *ctx);
 
 } MqttClientConfiguration;
 
@@ -58,7 +93,9 @@ bool mqtt_client_connect(struct MqttClientHandle *h);
 bool mqtt_client_connected(struct MqttClientHandle *h);
 bool mqtt_client_reconnect(struct MqttClientHandle *h);
 bool mqtt_client_publish(struct MqttClientHandle *h, const char *topic,
-                         const char *msg, int qos);
+                         const void *payload, size_t payload_len, int qos,
+                         bool retain, int *mid);
+int mqtt_client_outstanding(struct MqttClientHandle *h, size_t *bytes);
 nfds_t mqtt_client_get_pollfds(struct MqttClientHandle *h, struct pollfd *pfds,
                                nfds_t *count);
 void mqtt_client_loop(struct MqttClientHandle *h, const bool read,
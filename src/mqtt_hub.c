@@ -0,0 +1,465 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "mqtt_hub.h"
+#include "logging.h"
+#include "mqtt_client.h"
+#include "topic_trie.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <unistd.h>
+
+#define HUB_LABEL "mqtt_hub"
+
+// the units subscribed with the same topic filter
+typedef struct {
+    char *pattern;
+    // the pattern with the share prefix, if any
+    char *subscription;
+    const char *share_group;
+    int *ids;
+    int id_count;
+} HubFilter;
+
+typedef struct {
+    MqttHubCallback callback;
+    void *ctx;
+} HubSubscriber;
+
+typedef struct MqttHub {
+    Configuration *config;
+    MqttClientConfiguration mqtt_config;
+    // maps the topic filters to the HubFilters
+    struct TopicTrie *routes;
+    HubFilter **filters;
+    // the subscriptions of the filters
+    const char **subscriptions;
+    int filter_count;
+    HubSubscriber *subscribers;
+    int subscriber_count;
+    // held for reading while a message is passed to the units, so a
+    // unit can't go away in the middle of its callback
+    pthread_rwlock_t lock;
+    // readable once the hub is stopped, and stays readable
+    int stop_fd;
+} MqttHub;
+
+// one received message while it's passed to the matching units
+typedef struct {
+    MqttHub *hub;
+    const char *topic;
+    const void *payload;
+    size_t payload_len;
+    int delivered;
+} HubMessage;
+
+static void hub_visit(void *value, void *ctx)
+{
+    HubMessage *m = (HubMessage *)ctx;
+    const HubFilter *filter = (const HubFilter *)value;
+    for (int i = 0; i < filter->id_count; i++) {
+        const HubSubscriber *sub = &m->hub->subscribers[filter->ids[i]];
+        if (sub->callback) {
+            sub->callback(m->topic, m->payload, m->payload_len, sub->ctx);
+            m->delivered++;
+        }
+    }
+}
+
+static void hub_on_msg(const char *topic, const void *payload,
+                       size_t payload_len, void *ctx)
+{
+    MqttHub *hub = (MqttHub *)ctx;
+    HubMessage m = {hub, topic, payload, payload_len, 0};
+    pthread_rwlock_rdlock(&hub->lock);
+    topic_trie_match_all(hub->routes, topic, &hub_visit, &m);
+    pthread_rwlock_unlock(&hub->lock);
+    if (!m.delivered) {
+        DEBUG("Unit [%s]: no unit for the message on topic %s", HUB_LABEL,
+              topic);
+    }
+}
+
+static void hub_filter_free(void *value)
+{
+    HubFilter *filter = (HubFilter *)value;
+    free(filter->pattern);
+    free(filter->subscription);
+    free(filter->ids);
+    free(filter);
+}
+
+MqttHub *mqtt_hub_new(Configuration *config)
+{
+    assert(config != NULL);
+    MqttHub *retval = SAFEMALLOC(sizeof(MqttHub));
+    retval->config = config;
+    retval->routes = topic_trie_new();
+    retval->filters = NULL;
+    retval->subscriptions = NULL;
+    retval->filter_count = 0;
+    retval->subscribers = NULL;
+    retval->subscriber_count = 0;
+    pthread_rwlock_init(&retval->lock, NULL);
+    retval->stop_fd = eventfd(0, EFD_NONBLOCK);
+    if (retval->stop_fd < 0) {
+        FATAL("Failed to create the stop eventfd: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    MqttClientConfiguration *mqtt_config = &retval->mqtt_config;
+    mqtt_config->label = HUB_LABEL;
+    // a fixed default would clash between the instances on the broker
+    mqtt_config->client_id = config->mqtt_client_id;
+    mqtt_config->persistent_session = false;
+    mqtt_config->qos = 0;
+    mqtt_config->topic = NULL;
+    mqtt_config->share_group = NULL;
+    mqtt_config->filters = NULL;
+    mqtt_config->filter_count = 0;
+    mqtt_config->broker_host = config->mqtt_broker_host;
+    mqtt_config->broker_port = config->mqtt_broker_port;
+    mqtt_config->keepalive = config->mqtt_keepalive;
+    mqtt_config->protocol_version = config->mqtt_protocol_version;
+    mqtt_config->receive_maximum = config->mqtt_receive_maximum;
+    mqtt_config->topic_alias_maximum = config->mqtt_topic_alias_maximum;
+    mqtt_config->message_expiry = config->mqtt_message_expiry;
+    mqtt_config->tls_enabled = config->mqtt_tls;
+    mqtt_config->cafile = config->mqtt_cafile;
+    mqtt_config->capath = config->mqtt_capath;
+    mqtt_config->certfile = config->mqtt_certfile;
+    mqtt_config->keyfile = config->mqtt_keyfile;
+    mqtt_config->user_pw_auth_enabled = config->mqtt_user_pw;
+    mqtt_config->user = config->mqtt_user;
+    mqtt_config->pw = config->mqtt_pw;
+    mqtt_config->callback_context = (void *)retval;
+    mqtt_config->msg_callback = &hub_on_msg;
+    mqtt_config->publish_callback = NULL;
+    return retval;
+}
+
+static bool same_group(const char *a, const char *b)
+{
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+// whether the pattern a matches all the topics matched by the pattern b,
+// both of them ending with /#
+static bool pattern_covers(const char *a, const char *b)
+{
+    // the wildcards at the first level don't match the $ topics
+    if ((a[0] == '+' || a[0] == '#') && b[0] == '$') {
+        return false;
+    }
+    while (strcmp(a, "#")) {
+        if (!strcmp(b, "#")) {
+            return false;
+        }
+        const size_t alen = strcspn(a, "/");
+        const size_t blen = strcspn(b, "/");
+        if ((alen != 1 || a[0] != '+') &&
+            (alen != blen || strncmp(a, b, alen))) {
+            return false;
+        }
+        // only the last level is without a trailing /
+        a += alen + 1;
+        b += blen + 1;
+    }
+    return true;
+}
+
+// whether a topic can match both of the patterns
+static bool patterns_overlap(const char *a, const char *b)
+{
+    if (((a[0] == '+' || a[0] == '#') && b[0] == '$') ||
+        ((b[0] == '+' || b[0] == '#') && a[0] == '$')) {
+        return false;
+    }
+    while (strcmp(a, "#") && strcmp(b, "#")) {
+        const size_t alen = strcspn(a, "/");
+        const size_t blen = strcspn(b, "/");
+        if ((alen != 1 || a[0] != '+') && (blen != 1 || b[0] != '+') &&
+            (alen != blen || strncmp(a, b, alen))) {
+            return false;
+        }
+        a += alen + 1;
+        b += blen + 1;
+    }
+    return true;
+}
+
+/* Adds a unit receiving the messages of <mqtt_topic>/#, before the hub
+ * is started. Returns the id of the unit, or -1 if the topic is invalid,
+ * or it's already added with another share group.
+ */
+int mqtt_hub_add(MqttHub *hub, const Mqtt2RestUnitConfiguration *unit)
+{
+    assert(hub != NULL);
+    assert(unit != NULL);
+    const char *topic = unit->mqtt_topic;
+    const char *share_group = unit->mqtt_share_group;
+    char *pattern = SAFEMALLOC(strlen(topic) + 3);
+    sprintf(pattern, "%s/#", topic);
+
+    HubFilter *filter = NULL;
+    for (int i = 0; i < hub->filter_count; i++) {
+        if (!strcmp(hub->filters[i]->pattern, pattern)) {
+            filter = hub->filters[i];
+            break;
+        }
+    }
+    if (filter) {
+        free(pattern);
+        if (!same_group(filter->share_group, share_group)) {
+            ERROR("Unit [%s]: different share groups for topic %s",
+                  HUB_LABEL, topic);
+            return -1;
+        }
+    } else {
+        // the overlapping filters are merged into one subscription, which
+        // can't be done across share groups
+        for (int i = 0; i < hub->filter_count; i++) {
+            const HubFilter *other = hub->filters[i];
+            if (!same_group(other->share_group, share_group) &&
+                (pattern_covers(other->pattern, pattern) ||
+                 pattern_covers(pattern, other->pattern))) {
+                ERROR("Unit [%s]: different share groups for the "
+                      "overlapping topics %s and %s",
+                      HUB_LABEL, other->pattern, pattern);
+                free(pattern);
+                return -1;
+            }
+        }
+        filter = SAFEMALLOC(sizeof(HubFilter));
+        filter->pattern = pattern;
+        filter->share_group = share_group;
+        if (share_group) {
+            filter->subscription =
+                SAFEMALLOC(strlen(share_group) + strlen(pattern) + 9);
+            sprintf(filter->subscription, "$share/%s/%s", share_group,
+                    pattern);
+        } else {
+            filter->subscription = strdup(pattern);
+        }
+        filter->ids = NULL;
+        filter->id_count = 0;
+        if (!topic_trie_insert(hub->routes, pattern, filter)) {
+            ERROR("Unit [%s]: invalid topic: %s", HUB_LABEL, topic);
+            hub_filter_free(filter);
+            return -1;
+        }
+        const int count = hub->filter_count + 1;
+        hub->filters = SAFEREALLOC(hub->filters, count * sizeof(HubFilter *));
+        hub->filters[hub->filter_count++] = filter;
+    }
+
+    MqttClientConfiguration *mqtt_config = &hub->mqtt_config;
+    if (unit->mqtt_qos > mqtt_config->qos) {
+        mqtt_config->qos = unit->mqtt_qos;
+    }
+    if (unit->mqtt_persistent_session) {
+        mqtt_config->persistent_session = true;
+    }
+    // by default the broker generates the client id, which has to be set
+    // for a persistent session
+    if (mqtt_config->persistent_session && !hub->config->mqtt_client_id) {
+        ERROR("Unit [%s]: mqtt_client_id needs to be set for a persistent "
+              "session",
+              HUB_LABEL);
+        return -1;
+    }
+
+    const int id = hub->subscriber_count++;
+    hub->subscribers = SAFEREALLOC(hub->subscribers, hub->subscriber_count *
+                                                         sizeof(HubSubscriber));
+    hub->subscribers[id].callback = NULL;
+    hub->subscribers[id].ctx = NULL;
+    filter->ids =
+        SAFEREALLOC(filter->ids, (filter->id_count + 1) * sizeof(int));
+    filter->ids[filter->id_count++] = id;
+    return id;
+}
+
+/* Starts passing the messages to the unit. Until then, its messages
+ * are dropped.
+ */
+void mqtt_hub_attach(MqttHub *hub, int id, MqttHubCallback callback,
+                     void *ctx)
+{
+    assert(hub != NULL);
+    assert(id >= 0 && id < hub->subscriber_count);
+    pthread_rwlock_wrlock(&hub->lock);
+    hub->subscribers[id].callback = callback;
+    hub->subscribers[id].ctx = ctx;
+    pthread_rwlock_unlock(&hub->lock);
+}
+
+// once this returns, the callback of the unit is not called anymore
+void mqtt_hub_detach(MqttHub *hub, int id)
+{
+    assert(hub != NULL);
+    assert(id >= 0 && id < hub->subscriber_count);
+    pthread_rwlock_wrlock(&hub->lock);
+    hub->subscribers[id].callback = NULL;
+    hub->subscribers[id].ctx = NULL;
+    pthread_rwlock_unlock(&hub->lock);
+}
+
+// only write() is used, so it can be called from a signal handler
+void mqtt_hub_stop(MqttHub *hub)
+{
+    if (!hub) {
+        return;
+    }
+    const uint64_t one = 1;
+    if (write(hub->stop_fd, &one, sizeof(one)) < 0) {
+        // the counter can't overflow with a few writes, nothing to do
+    }
+}
+
+static bool hub_stopped(MqttHub *hub)
+{
+    struct pollfd pfd = {hub->stop_fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+// the eventfd isn't read, so a stop before the wait isn't lost
+void mqtt_hub_wait(MqttHub *hub)
+{
+    assert(hub != NULL);
+    struct pollfd pfd = {hub->stop_fd, POLLIN, 0};
+    while (poll(&pfd, 1, -1) < 0 || !(pfd.revents & POLLIN)) {
+        if (errno != EINTR) {
+            ERROR("Poll() failed with <%s>", strerror(errno));
+            return;
+        }
+    }
+}
+
+/* Subscribes only to the filters not covered by another one of the same
+ * share group, e.g. to a/# but not to a/b/#, otherwise the broker would
+ * deliver the messages matching both of them twice. The received
+ * messages are still passed to the units of all the matching filters.
+ */
+static void hub_set_subscriptions(MqttHub *hub)
+{
+    int count = 0;
+    const HubFilter **subscribed =
+        SAFEMALLOC(hub->filter_count * sizeof(HubFilter *));
+    hub->subscriptions = SAFEMALLOC(hub->filter_count * sizeof(char *));
+    for (int i = 0; i < hub->filter_count; i++) {
+        const HubFilter *filter = hub->filters[i];
+        bool covered = false;
+        for (int j = 0; j < hub->filter_count && !covered; j++) {
+            const HubFilter *other = hub->filters[j];
+            covered = j != i &&
+                      same_group(other->share_group, filter->share_group) &&
+                      pattern_covers(other->pattern, filter->pattern);
+        }
+        if (covered) {
+            DEBUG("Unit [%s]: %s is covered by another subscription",
+                  HUB_LABEL, filter->pattern);
+            continue;
+        }
+        subscribed[count] = filter;
+        hub->subscriptions[count++] = filter->subscription;
+    }
+    // e.g. a/+/c/# and a/b/#, neither of them covers the other
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            if (patterns_overlap(subscribed[i]->pattern,
+                                 subscribed[j]->pattern)) {
+                WARNING("Unit [%s]: the messages matching both %s and %s "
+                        "can be delivered twice",
+                        HUB_LABEL, subscribed[i]->pattern,
+                        subscribed[j]->pattern);
+            }
+        }
+    }
+    free(subscribed);
+    hub->mqtt_config.filters = hub->subscriptions;
+    hub->mqtt_config.filter_count = count;
+}
+
+// the thread of the shared connection, until mqtt_hub_stop()
+void *mqtt_hub_run(void *data)
+{
+    assert(data != NULL);
+    MqttHub *hub = (MqttHub *)data;
+    INFO("Starting the shared MQTT connection for %d units",
+         hub->subscriber_count);
+    hub_set_subscriptions(hub);
+    struct MqttClientHandle *mqtt = mqtt_client_init(&hub->mqtt_config);
+    if (mqtt == NULL) {
+        FATAL("Failed to init MQTT client");
+        return NULL;
+    }
+    mqtt_client_connect(mqtt);
+    const int poll_timeout = hub->config->mqtt_keepalive / 2 * 1000;
+    // the mqtt socket and the stop eventfd
+    struct pollfd pfd[2];
+
+    while (!hub_stopped(hub)) {
+        if (!mqtt_client_connected(mqtt)) {
+            DEBUG("Trying to reconnect...");
+            if (!mqtt_client_reconnect(mqtt)) {
+                continue;
+            }
+        }
+        nfds_t nfds = 1;
+        mqtt_client_get_pollfds(mqtt, &pfd[0], &nfds);
+        pfd[1].fd = hub->stop_fd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, poll_timeout) < 0) {
+            if (errno == EINTR) { // we got SIGUSR1, the loop checks the stop
+                continue;
+            }
+            ERROR("Poll() failed with <%s>, exiting", strerror(errno));
+            break;
+        }
+        mqtt_client_loop(mqtt, pfd[0].revents & POLLIN,
+                         pfd[0].revents & POLLOUT);
+    }
+
+    mqtt_client_destroy(mqtt);
+    INFO("Shared MQTT connection exiting...");
+    return NULL;
+}
+
+void mqtt_hub_free(MqttHub *hub)
+{
+    if (!hub) {
+        return;
+    }
+    topic_trie_free(hub->routes, &hub_filter_free);
+    free(hub->filters);
+    free(hub->subscriptions);
+    free(hub->subscribers);
+    pthread_rwlock_destroy(&hub->lock);
+    close(hub->stop_fd);
+    free(hub);
+}
@@ -0,0 +1,54 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file mqtt_hub.h
+ *   @brief The mqtt hub is one MQTT connection shared by the mqtt2rest
+ *   units. Each unit is added with its topic before the hub is started,
+ *   and the hub subscribes to all of them, with the highest QoS of the
+ *   units, and with a persistent session if any of them asks for it.
+ *   The received messages are routed through a topic trie to the
+ *   callback of each unit with a matching subscription. The callbacks
+ *   are run by the hub thread, so they should only queue the messages.
+ *   The hub thread and the units run until mqtt_hub_stop().
+ */
+#ifndef MQTT_HUB_H
+#define MQTT_HUB_H
+#include "configuration.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*MqttHubCallback)(const char *topic, const void *payload,
+                                size_t payload_len, void *ctx);
+
+struct MqttHub;
+
+struct MqttHub *mqtt_hub_new(Configuration *config);
+int mqtt_hub_add(struct MqttHub *hub,
+                 const Mqtt2RestUnitConfiguration *unit);
+void mqtt_hub_attach(struct MqttHub *hub, int id, MqttHubCallback callback,
+                     void *ctx);
+void mqtt_hub_detach(struct MqttHub *hub, int id);
+void *mqtt_hub_run(void *data);
+// stops the hub thread and wakes up the units waiting in mqtt_hub_wait(),
+// it's async-signal-safe
+void mqtt_hub_stop(struct MqttHub *hub);
+// blocks until mqtt_hub_stop() is called, or returns if it already was
+void mqtt_hub_wait(struct MqttHub *hub);
+void mqtt_hub_free(struct MqttHub *hub);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "rate_limiter.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RATE_LIMIT_BUCKETS 256
+// above this many keys, the full buckets are forgotten, as they are
+// the same as the new ones, or the least recently used one if none is
+// full
+#define RATE_LIMIT_MAX_KEYS 4096
+
+typedef struct TokenBucket {
+    // the url prefix, NULL for the bucket of the unit
+    char *key;
+    size_t key_len;
+    double tokens;
+    uint64_t last_refill;
+    uint64_t last_used;
+    struct TokenBucket *next;
+} TokenBucket;
+
+typedef struct RateLimiter {
+    RateLimiterConfiguration *config;
+    pthread_mutex_t mutex;
+    TokenBucket unit_bucket;
+    TokenBucket *buckets[RATE_LIMIT_BUCKETS];
+    int key_count;
+    uint64_t delayed;
+} RateLimiter;
+
+// the length of the prefix of the url which selects the bucket
+static size_t rate_limiter_key_len(const RateLimiter *rl, const char *url)
+{
+    const char *scheme_end = strstr(url, "://");
+    const char *p = scheme_end ? scheme_end + 3 : url;
+    p += strcspn(p, "/?#");
+    if (rl->config->scope == RATE_LIMIT_PREFIX) {
+        for (int i = 0; i < rl->config->prefix_segments && *p == '/'; i++) {
+            p++;
+            p += strcspn(p, "/?#");
+        }
+    }
+    return p - url;
+}
+
+static unsigned int rate_limiter_hash(const char *key, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash % RATE_LIMIT_BUCKETS;
+}
+
+static void rate_limiter_refill(const RateLimiter *rl, TokenBucket *b,
+                                uint64_t now)
+{
+    b->tokens += (now - b->last_refill) * rl->config->rate / 1000.0;
+    if (b->tokens > rl->config->burst) {
+        b->tokens = rl->config->burst;
+    }
+    b->last_refill = now;
+}
+
+/* dropping the buckets which are full again, or the least recently
+ * used one if none is full
+ */
+static void rate_limiter_expire(RateLimiter *rl, uint64_t now)
+{
+    const int key_count = rl->key_count;
+    TokenBucket **oldest = NULL;
+    for (int i = 0; i < RATE_LIMIT_BUCKETS; i++) {
+        TokenBucket **p = &rl->buckets[i];
+        while (*p) {
+            TokenBucket *b = *p;
+            rate_limiter_refill(rl, b, now);
+            if (b->tokens < rl->config->burst) {
+                if (!oldest || b->last_used < (*oldest)->last_used) {
+                    oldest = p;
+                }
+                p = &b->next;
+                continue;
+            }
+            *p = b->next;
+            free(b->key);
+            free(b);
+            rl->key_count--;
+        }
+    }
+    if (rl->key_count == key_count && oldest) {
+        TokenBucket *b = *oldest;
+        *oldest = b->next;
+        free(b->key);
+        free(b);
+        rl->key_count--;
+    }
+}
+
+static TokenBucket *rate_limiter_bucket(RateLimiter *rl, const char *url,
+                                        uint64_t now)
+{
+    if (rl->config->scope == RATE_LIMIT_UNIT) {
+        return &rl->unit_bucket;
+    }
+    const size_t len = rate_limiter_key_len(rl, url);
+    const unsigned int hash = rate_limiter_hash(url, len);
+    TokenBucket *b = rl->buckets[hash];
+    while (b && (b->key_len != len || memcmp(b->key, url, len))) {
+        b = b->next;
+    }
+    if (b) {
+        return b;
+    }
+    if (rl->key_count >= RATE_LIMIT_MAX_KEYS) {
+        rate_limiter_expire(rl, now);
+    }
+    b = SAFEMALLOC(sizeof(TokenBucket));
+    b->key = strndup(url, len);
+    b->key_len = len;
+    b->tokens = rl->config->burst;
+    b->last_refill = now;
+    b->last_used = now;
+    b->next = rl->buckets[hash];
+    rl->buckets[hash] = b;
+    rl->key_count++;
+    return b;
+}
+
+RateLimiter *rate_limiter_new(RateLimiterConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->rate > 0);
+    assert(config->burst > 0);
+    RateLimiter *retval = SAFEMALLOC(sizeof(RateLimiter));
+    retval->config = config;
+    pthread_mutex_init(&retval->mutex, NULL);
+    retval->unit_bucket.key = NULL;
+    retval->unit_bucket.key_len = 0;
+    retval->unit_bucket.tokens = config->burst;
+    retval->unit_bucket.last_refill = monotonic_ms();
+    retval->unit_bucket.last_used = retval->unit_bucket.last_refill;
+    retval->unit_bucket.next = NULL;
+    memset(retval->buckets, 0, sizeof(retval->buckets));
+    retval->key_count = 0;
+    retval->delayed = 0;
+    return retval;
+}
+
+/* takes a token from the bucket of the url. Returns 0 if there was
+ * one, otherwise the time in ms until the next one is available
+ */
+uint64_t rate_limiter_acquire(RateLimiter *rl, const char *url)
+{
+    assert(rl != NULL);
+    assert(url != NULL);
+    const uint64_t now = monotonic_ms();
+    uint64_t wait = 0;
+    pthread_mutex_lock(&rl->mutex);
+    TokenBucket *b = rate_limiter_bucket(rl, url, now);
+    rate_limiter_refill(rl, b, now);
+    b->last_used = now;
+    if (b->tokens >= 1) {
+        b->tokens -= 1;
+    } else {
+        wait = (uint64_t)((1 - b->tokens) * 1000 / rl->config->rate) + 1;
+        rl->delayed++;
+    }
+    pthread_mutex_unlock(&rl->mutex);
+    return wait;
+}
+
+// the number of times a request had to wait for a token
+uint64_t rate_limiter_delayed(RateLimiter *rl)
+{
+    assert(rl != NULL);
+    pthread_mutex_lock(&rl->mutex);
+    const uint64_t retval = rl->delayed;
+    pthread_mutex_unlock(&rl->mutex);
+    return retval;
+}
+
+void rate_limiter_free(RateLimiter *rl)
+{
+    if (!rl) {
+        return;
+    }
+    for (int i = 0; i < RATE_LIMIT_BUCKETS; i++) {
+        while (rl->buckets[i]) {
+            TokenBucket *b = rl->buckets[i];
+            rl->buckets[i] = b->next;
+            free(b->key);
+            free(b);
+        }
+    }
+    pthread_mutex_destroy(&rl->mutex);
+    free(rl);
+}
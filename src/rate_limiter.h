@@ -0,0 +1,54 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file rate_limiter.h
+ *   @brief Token buckets limiting the rate of the HTTP requests of a
+ *   mqtt2rest unit. There is either one bucket for the whole unit, or
+ *   one for each host (scheme://host:port) of the request urls, or one
+ *   for each url prefix of the host and the first prefix_segments path
+ *   segments. A bucket holds at most burst tokens, and it's refilled
+ *   with rate tokens per second. It's shared by the sender workers of
+ *   the unit, so it's thread safe.
+ */
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+#include <stdint.h>
+
+typedef enum {
+    RATE_LIMIT_UNIT,
+    RATE_LIMIT_HOST,
+    RATE_LIMIT_PREFIX
+} RateLimitScope;
+
+typedef struct {
+    const char *label;
+    // requests per second
+    int rate;
+    int burst;
+    RateLimitScope scope;
+    int prefix_segments;
+} RateLimiterConfiguration;
+
+struct RateLimiter;
+
+struct RateLimiter *rate_limiter_new(RateLimiterConfiguration *config);
+uint64_t rate_limiter_acquire(struct RateLimiter *rl, const char *url);
+uint64_t rate_limiter_delayed(struct RateLimiter *rl);
+void rate_limiter_free(struct RateLimiter *rl);
+
+#endif
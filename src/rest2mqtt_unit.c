@@ -25,32 +25,296 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "ack_tracker.h"
+#include "bulk_parser.h"
+#include "compress.h"
+#include "message.h"
 #include "mqtt_client.h"
+#include "rewrite.h"
+#include "ring_buffer.h"
 #include "utils.h"
 #include <microhttpd.h>
 
+// the epoll flags were renamed in 0.9.53
+#if MHD_VERSION < 0x00095300
+#define MHD_USE_EPOLL MHD_USE_EPOLL_LINUX_ONLY
+#define MHD_DAEMON_INFO_EPOLL_FD MHD_DAEMON_INFO_EPOLL_FD_LINUX_ONLY
+#define MHD_USE_INTERNAL_POLLING_THREAD MHD_USE_SELECT_INTERNALLY
+#define MHD_ALLOW_SUSPEND_RESUME MHD_USE_SUSPEND_RESUME
+#endif
+#ifndef MHD_HTTP_PAYLOAD_TOO_LARGE
+#define MHD_HTTP_PAYLOAD_TOO_LARGE MHD_HTTP_REQUEST_ENTITY_TOO_LARGE
+#endif
+
+// max number of idle request contexts kept for reuse per unit
+#define INCOMING_POOL_SIZE 64
+// the bodies of the idle request contexts are kept allocated up to
+// this size, the bigger ones are freed
+#define INCOMING_KEPT_CAPACITY (64 << 10)
+
+typedef struct {
+    Rest2MqttUnitConfiguration *config;
+    struct MqttClientHandle *mqtt;
+    struct MHD_Daemon *daemon;
+    // the epoll fd of the daemon, -1 if its sockets are polled one by one
+    int mhd_epoll_fd;
+    // the pollfds of the daemon, followed by the mqtt socket
+    struct pollfd *pfd;
+    nfds_t pfd_size;
+    // reused for assembling the topics, if the requests are handled
+    // by the unit thread
+    Buffer topic;
+    // the idle request contexts, with their body buffers still
+    // allocated. Lock-free, as the thread pool shares it.
+    RingBufferConfiguration incoming_pool_config;
+    struct RingBuffer *incoming_pool;
+    // NULL if the requests are handled by the unit thread. Otherwise
+    // they are handled by the thread pool of the daemon, and handed
+    // over to the unit thread through this queue to be published
+    RingBufferConfiguration queue_config;
+    struct RingBuffer *queue;
+    // wakes up the unit thread when the queue gets new messages
+    int wakeup_fd;
+    bool sleeping;
+    BulkParserConfiguration bulk_config;
+    // NULL if the requests are answered without waiting for the
+    // publish to be confirmed
+    AckTrackerConfiguration ack_config;
+    struct AckTracker *acks;
+    // the number of requests being suspended by the thread pool,
+    // the unit waits for them when it's stopping
+    int suspending;
+    bool stopping;
+    // set by the unit thread when the outstanding publishes cross the
+    // high water mark, and cleared below the low water mark
+    bool overloaded;
+} Rest2MqttUnit;
+
+/* the context of one request, from its first call until the request
+ * is completed or aborted, then it goes back to the pool of the unit
+ */
 typedef struct IncomingData {
-    size_t length;
-    char *data;
+    Buffer body;
+    // NULL if the body is not compressed
+    struct Decompressor *decoder;
+    // the response code if the request failed, 0 otherwise
+    int error;
+    // NULL if it's not a bulk request
+    struct BulkParser *bulk;
+    // set while the request is suspended until its publish is confirmed
+    struct MHD_Connection *connection;
+    // the response to a resumed request, 0 until it's resumed
+    unsigned int ack_status;
 } IncomingData;
 
-// as MHD doesn't have API to get pollfds, we use this function
-// to  convert the select fd_sets to pollfd
-nfds_t get_mhd_pollfds(struct MHD_Daemon *h, struct pollfd *pfds, nfds_t *count)
+static void incoming_destroy(void *item, void *ctx)
+{
+    IncomingData *incoming = item;
+    (void)ctx;
+    buffer_free(&incoming->body);
+    free(incoming);
+}
+
+static IncomingData *incoming_get(Rest2MqttUnit *unit)
+{
+    IncomingData *incoming = ring_buffer_pop(unit->incoming_pool);
+    if (!incoming) {
+        incoming = SAFEMALLOC(sizeof(IncomingData));
+        buffer_init(&incoming->body);
+    }
+    buffer_clear(&incoming->body);
+    incoming->decoder = NULL;
+    incoming->error = 0;
+    incoming->bulk = NULL;
+    incoming->connection = NULL;
+    incoming->ack_status = 0;
+    return incoming;
+}
+
+static void incoming_release(Rest2MqttUnit *unit, IncomingData *incoming)
+{
+    decompressor_free(incoming->decoder);
+    incoming->decoder = NULL;
+    bulk_parser_free(incoming->bulk);
+    incoming->bulk = NULL;
+    if (incoming->body.capacity > INCOMING_KEPT_CAPACITY) {
+        buffer_free(&incoming->body);
+    }
+    // if the pool is full, it's freed by incoming_destroy()
+    ring_buffer_push(unit->incoming_pool, incoming);
+}
+
+// called by MHD when a request is done, even if it was aborted
+static void request_completed(void *cls, struct MHD_Connection *connection,
+                              void **con_cls,
+                              enum MHD_RequestTerminationCode toe)
+{
+    (void)connection;
+    (void)toe;
+    if (*con_cls) {
+        incoming_release(cls, *con_cls);
+        *con_cls = NULL;
+    }
+}
+
+static int queue_empty_response(struct MHD_Connection *connection,
+                                unsigned int status)
+{
+    struct MHD_Response *response =
+        MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+    int ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// the client is asked to come back later
+static int queue_unavailable_response(Rest2MqttUnit *unit,
+                                      struct MHD_Connection *connection)
+{
+    struct MHD_Response *response =
+        MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+    char retry_after[16];
+    snprintf(retry_after, sizeof(retry_after), "%d",
+             unit->config->retry_after);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER,
+                            retry_after);
+    int ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE,
+                                 response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+static int queue_publish_response(Rest2MqttUnit *unit,
+                                  struct MHD_Connection *connection,
+                                  unsigned int status)
+{
+    if (status == MHD_HTTP_SERVICE_UNAVAILABLE) {
+        return queue_unavailable_response(unit, connection);
+    }
+    if (status != MHD_HTTP_OK) {
+        return queue_empty_response(connection, status);
+    }
+    struct MHD_Response *response =
+        MHD_create_response_from_buffer(3, "OK", MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                            "text/html");
+    int ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+/* the request is answered when MHD calls answer_to_connection() again.
+ * It's thread safe, and the daemon is woken up by its ITC.
+ */
+static void resume_request(IncomingData *incoming, unsigned int status)
+{
+    incoming->ack_status = status;
+    MHD_resume_connection(incoming->connection);
+}
+
+static void on_ack_done(void *userdata, AckResult result, void *ctx)
+{
+    (void)ctx;
+    switch (result) {
+    case ACK_OK:
+        resume_request(userdata, MHD_HTTP_OK);
+        break;
+    case ACK_REFUSED:
+        resume_request(userdata, MHD_HTTP_BAD_GATEWAY);
+        break;
+    case ACK_TIMEOUT:
+        resume_request(userdata, MHD_HTTP_GATEWAY_TIMEOUT);
+        break;
+    }
+}
+
+static void on_published(int mid, bool success, void *ctx)
+{
+    Rest2MqttUnit *unit = ctx;
+    if (unit->acks) {
+        ack_tracker_ack(unit->acks, mid, success);
+    }
+}
+
+/* The requests are refused while too many publishes are outstanding in
+ * libmosquitto, until they drop below the low water marks. Called by
+ * the unit thread, the flag is read by the thread pool as well.
+ */
+static void update_admission(Rest2MqttUnit *unit)
+{
+    const Rest2MqttUnitConfiguration *config = unit->config;
+    size_t bytes;
+    const int messages = mqtt_client_outstanding(unit->mqtt, &bytes);
+    bool overloaded = __atomic_load_n(&unit->overloaded, __ATOMIC_RELAXED);
+    if (!overloaded) {
+        overloaded = (config->max_outstanding_messages &&
+                      messages >= config->max_outstanding_messages) ||
+                     (config->max_outstanding_bytes &&
+                      bytes >= config->max_outstanding_bytes);
+        if (overloaded) {
+            WARNING("Unit [%s]: %d messages (%zu bytes) are waiting for the "
+                    "broker, refusing the requests",
+                    config->unit_name, messages, bytes);
+        }
+    } else if (messages <= config->resume_outstanding_messages &&
+               bytes <= config->resume_outstanding_bytes) {
+        overloaded = false;
+        INFO("Unit [%s]: accepting the requests again", config->unit_name);
+    }
+    __atomic_store_n(&unit->overloaded, overloaded, __ATOMIC_RELAXED);
+}
+
+/* publishes the message on the unit thread, and if a request waits for
+ * it, tracks it until it's confirmed. Returns false if it couldn't be
+ * published.
+ */
+static bool publish_tracked(Rest2MqttUnit *unit, const char *topic,
+                            const void *payload, size_t payload_len, int qos,
+                            bool retain, IncomingData *waiting)
+{
+    int mid;
+    if (!mqtt_client_publish(unit->mqtt, topic, payload, payload_len, qos,
+                             retain, &mid)) {
+        update_admission(unit);
+        return false;
+    }
+    if (waiting) {
+        ack_tracker_add(unit->acks, mid, waiting);
+    }
+    update_admission(unit);
+    return true;
+}
+
+/* puts the pollfds of the daemon to unit->pfd, and returns their
+ * number. With epoll it's only the epoll fd of the daemon, otherwise
+ * the select() fd_sets are converted to pollfds, as MHD doesn't have
+ * an API to get pollfds.
+ */
+static nfds_t get_mhd_pollfds(Rest2MqttUnit *unit)
 {
+    if (unit->mhd_epoll_fd >= 0) {
+        unit->pfd[0].fd = unit->mhd_epoll_fd;
+        unit->pfd[0].events = POLLIN;
+        unit->pfd[0].revents = 0;
+        return 1;
+    }
     int max = 0;
     fd_set rs, ws, es;
     FD_ZERO(&rs);
     FD_ZERO(&ws);
     FD_ZERO(&es);
-    if (MHD_YES != MHD_get_fdset(h, &rs, &ws, &es, &max)) {
+    if (MHD_YES != MHD_get_fdset(unit->daemon, &rs, &ws, &es, &max)) {
         FATAL("Failed to get MHD fdset");
         return 0;
     }
@@ -60,22 +324,168 @@ nfds_t get_mhd_pollfds(struct MHD_Daemon *h, struct pollfd *pfds, nfds_t *count)
         bool w_set = FD_ISSET(fd, &ws);
         bool e_set = FD_ISSET(fd, &es);
         if (r_set || w_set || e_set) {
-            pfds[pollfd_counter].fd = fd;
-            pfds[pollfd_counter].events = 0;
+            // keeping room for the mqtt socket
+            if (pollfd_counter + 2 > unit->pfd_size) {
+                unit->pfd_size *= 2;
+                unit->pfd = SAFEREALLOC(unit->pfd, unit->pfd_size *
+                                                       sizeof(struct pollfd));
+            }
+            struct pollfd *pfd = &unit->pfd[pollfd_counter++];
+            pfd->fd = fd;
+            pfd->events = 0;
+            pfd->revents = 0;
             if (r_set)
-                pfds[pollfd_counter].events |= POLLIN;
+                pfd->events |= POLLIN;
             if (w_set)
-                pfds[pollfd_counter].events |= POLLOUT;
+                pfd->events |= POLLOUT;
             if (e_set)
-                pfds[pollfd_counter].events |= POLLPRI;
-            if (++pollfd_counter >= *count) {
-                FATAL("Not enough pollfd-s allocated for libmicrohttpd!");
-                return *count;
-            }
+                pfd->events |= POLLPRI;
+        }
+    }
+    return pollfd_counter;
+}
+
+static void unit_wakeup(Rest2MqttUnit *unit)
+{
+    const uint64_t one = 1;
+    if (write(unit->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        ERROR("Unit [%s]: failed to wake up the unit thread: %s",
+              unit->config->unit_name, strerror(errno));
+    }
+}
+
+/* hands the message over to the unit thread, returns false if the
+ * queue is full
+ */
+static bool queue_message(Rest2MqttUnit *unit, const char *topic,
+                          const void *payload, size_t payload_len, int qos,
+                          bool retain, IncomingData *waiting)
+{
+    Message *msg = message_new(topic, payload, payload_len);
+    msg->qos = qos;
+    msg->userdata = waiting;
+    if (retain) {
+        msg->flags |= MESSAGE_FLAG_RETAIN;
+    }
+    if (ring_buffer_push(unit->queue, msg) != RING_PUSH_OK) {
+        message_free(msg);
+        return false;
+    }
+    if (__atomic_load_n(&unit->sleeping, __ATOMIC_SEQ_CST)) {
+        unit_wakeup(unit);
+    }
+    return true;
+}
+
+/* publishes the body of a completed request, or hands it over to the
+ * unit thread if it's called by the thread pool. Returns the status
+ * of the response. If the request waits for the confirmation, it's
+ * tracked when MHD_HTTP_OK is returned.
+ */
+static unsigned int publish_request(Rest2MqttUnit *unit, const char *url,
+                                    const Buffer *body, int qos,
+                                    IncomingData *waiting)
+{
+    // the topic is the url without the leading '/',
+    // unless a rewrite rule matches
+    Buffer local_topic;
+    buffer_init(&local_topic);
+    Buffer *topic_buffer = unit->queue ? &local_topic : &unit->topic;
+    const char *topic = *url == '/' ? url + 1 : url;
+    if (unit->config->rewrite &&
+        rewrite_apply(unit->config->rewrite, url, topic_buffer,
+                      realtime_ms())) {
+        topic = topic_buffer->data;
+    }
+    if (!unit->queue) {
+        if (!publish_tracked(unit, topic, body->data, body->length, qos,
+                             false, waiting) &&
+            waiting) {
+            return MHD_HTTP_SERVICE_UNAVAILABLE;
+        }
+        return MHD_HTTP_OK;
+    }
+    const bool queued = queue_message(unit, topic, body->data, body->length,
+                                      qos, false, waiting);
+    buffer_free(&local_topic);
+    if (!queued) {
+        WARNING("Unit [%s]: the publish queue is full, refusing the request "
+                "to %s",
+                unit->config->unit_name, url);
+        return MHD_HTTP_SERVICE_UNAVAILABLE;
+    }
+    return MHD_HTTP_OK;
+}
+
+/* publishes one record of a bulk request. The records are published
+ * one after the other without waiting for the broker, the topics are
+ * used as they are.
+ */
+static bool on_bulk_record(const BulkRecord *record, void *ctx)
+{
+    Rest2MqttUnit *unit = ctx;
+    // the rest of the records are refused when the broker falls behind
+    if (__atomic_load_n(&unit->overloaded, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    if (!unit->queue) {
+        return publish_tracked(unit, record->topic, record->payload,
+                               record->payload_len, record->qos,
+                               record->retain, NULL);
+    }
+    return queue_message(unit, record->topic, record->payload,
+                         record->payload_len, record->qos, record->retain,
+                         NULL);
+}
+
+// feeds the chunk of a bulk request to its parser
+static void feed_bulk(IncomingData *incoming, const char *data, size_t len)
+{
+    if (incoming->decoder) {
+        // the decompressed data is only buffered until it's parsed
+        buffer_clear(&incoming->body);
+        if (!decompressor_feed(incoming->decoder, data, len,
+                               &incoming->body)) {
+            WARNING("Failed to decompress the request body");
+            incoming->error = MHD_HTTP_BAD_REQUEST;
+            return;
+        }
+        data = incoming->body.data;
+        len = incoming->body.length;
+    }
+    bulk_parser_feed(incoming->bulk, data, len);
+}
+
+// responds with the summary of a bulk request
+static int queue_bulk_response(struct MHD_Connection *connection,
+                               IncomingData *incoming)
+{
+    const bool ok = bulk_parser_finish(incoming->bulk);
+    buffer_clear(&incoming->body);
+    bulk_parser_result(incoming->bulk, &incoming->body);
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        incoming->body.length, incoming->body.data, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+                            "application/json");
+    int ret = MHD_queue_response(
+        connection, ok ? MHD_HTTP_OK : MHD_HTTP_BAD_REQUEST, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// publishes the messages handed over by the thread pool
+static void publish_queued(Rest2MqttUnit *unit)
+{
+    Message *msg;
+    while ((msg = ring_buffer_pop(unit->queue))) {
+        if (!publish_tracked(unit, msg->topic, msg->payload, msg->payload_len,
+                             msg->qos, msg->flags & MESSAGE_FLAG_RETAIN,
+                             msg->userdata) &&
+            msg->userdata) {
+            resume_request(msg->userdata, MHD_HTTP_SERVICE_UNAVAILABLE);
         }
+        message_free(msg);
     }
-    *count = pollfd_counter;
-    return *count;
 }
 
 static int answer_to_connection(void *cls, struct MHD_Connection *connection,
@@ -83,56 +493,141 @@ static int answer_to_connection(void *cls, struct MHD_Connection *connection,
                                 const char *version, const char *upload_data,
                                 size_t *upload_data_size, void **con_cls)
 {
-    (void)cls;     /* Unused. Silent compiler warning. */
     (void)url;     /* Unused. Silent compiler warning. */
     (void)version; /* Unused. Silent compiler warning. */
-    INFO("CONNECT, url: %s, type: %s, version: %s ", url, method, version);
+    DEBUG("CONNECT, url: %s, type: %s, version: %s ", url, method, version);
 
     if (strcmp(method, "POST")) // we accept only POST
     {
         return MHD_NO;
     }
 
+    Rest2MqttUnit *unit = cls;
+    const size_t max_body_size = unit->config->max_body_size;
     if (!*con_cls) {
-        INFO("GOT POST connect, data: %s %zd", upload_data, *upload_data_size);
-        IncomingData *incoming = SAFEMALLOC(sizeof(IncomingData));
-        incoming->length = 0;
-        incoming->data = NULL;
+        DEBUG("GOT POST connect, %zd bytes", *upload_data_size);
+        IncomingData *incoming = incoming_get(unit);
         *con_cls = (void *)incoming;
+        // refused before reading the body if the broker falls behind
+        if (__atomic_load_n(&unit->overloaded, __ATOMIC_RELAXED)) {
+            incoming->error = MHD_HTTP_SERVICE_UNAVAILABLE;
+            return queue_unavailable_response(unit, connection);
+        }
+        // the bulk requests are parsed as they arrive, only their
+        // records are limited in size
+        if (unit->config->bulk_path && !strcmp(url, unit->config->bulk_path)) {
+            incoming->bulk = bulk_parser_new(&unit->bulk_config);
+        }
+        // the body is sized by Content-Length up front, and refused
+        // without reading it if it's too big
+        const char *length_val = MHD_lookup_connection_value(
+            connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH);
+        unsigned long long content_length = 0;
+        if (length_val) {
+            char *end;
+            content_length = strtoull(length_val, &end, 10);
+            if (end == length_val || *end) {
+                content_length = 0;
+            }
+        }
+        if (content_length > max_body_size && !incoming->bulk) {
+            WARNING("Unit [%s]: refusing a body of %llu bytes to %s",
+                    unit->config->unit_name, content_length, url);
+            incoming->error = MHD_HTTP_PAYLOAD_TOO_LARGE;
+            return queue_empty_response(connection, incoming->error);
+        }
+        // the compressed bodies are decompressed as they arrive
+        const char *encoding = MHD_lookup_connection_value(
+            connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_ENCODING);
+        if (encoding && strcasecmp(encoding, "identity")) {
+            incoming->decoder = decompressor_new(encoding, max_body_size);
+            if (!incoming->decoder) {
+                WARNING("Unsupported Content-Encoding: %s", encoding);
+                incoming->error = MHD_HTTP_UNSUPPORTED_MEDIA_TYPE;
+            }
+        } else if (content_length && !incoming->bulk) {
+            // the header is not trusted beyond the size of the kept
+            // bodies, the buffer grows as the data actually arrives
+            buffer_reserve(&incoming->body,
+                           content_length < INCOMING_KEPT_CAPACITY
+                               ? content_length
+                               : INCOMING_KEPT_CAPACITY);
+        }
         return MHD_YES;
     }
     if (*upload_data_size) {
-        INFO("GOT POST continuation, size %zd,  data: %s", *upload_data_size,
-             upload_data);
+        DEBUG("GOT POST continuation, %zd bytes", *upload_data_size);
         IncomingData *incoming = *con_cls;
-        incoming->data =
-            SAFEREALLOC(incoming->data, incoming->length + *upload_data_size);
-        incoming->data[incoming->length] = '\0';
-        strncat(incoming->data + incoming->length, upload_data,
-                *upload_data_size);
-        incoming->length += *upload_data_size;
+        if (incoming->error) {
+            // the rest of the body is discarded
+        } else if (incoming->bulk) {
+            feed_bulk(incoming, upload_data, *upload_data_size);
+        } else if (incoming->decoder) {
+            if (!decompressor_feed(incoming->decoder, upload_data,
+                                   *upload_data_size, &incoming->body)) {
+                WARNING("Failed to decompress the request body");
+                incoming->error = incoming->body.length > max_body_size
+                                      ? MHD_HTTP_PAYLOAD_TOO_LARGE
+                                      : MHD_HTTP_BAD_REQUEST;
+            }
+        } else if (incoming->body.length + *upload_data_size >
+                   max_body_size) {
+            WARNING("Unit [%s]: the body to %s is bigger than %zu bytes",
+                    unit->config->unit_name, url, max_body_size);
+            incoming->error = MHD_HTTP_PAYLOAD_TOO_LARGE;
+        } else {
+            buffer_append(&incoming->body, upload_data, *upload_data_size);
+        }
         *upload_data_size = 0;
 
         return MHD_YES;
     } else {
         IncomingData *incoming = *con_cls;
+        if (incoming->ack_status) {
+            // resumed after the publish was confirmed, or it failed
+            return queue_publish_response(unit, connection,
+                                          incoming->ack_status);
+        }
+        if (!incoming->error && incoming->decoder &&
+            !decompressor_finished(incoming->decoder)) {
+            WARNING("Truncated compressed request body");
+            incoming->error = MHD_HTTP_BAD_REQUEST;
+        }
+        if (incoming->error) {
+            return queue_empty_response(connection, incoming->error);
+        }
+        if (incoming->bulk) {
+            return queue_bulk_response(connection, incoming);
+        }
         const char *qos_val = MHD_lookup_connection_value(
             connection, MHD_GET_ARGUMENT_KIND, "qos");
-        INFO("QOS: %s", qos_val);
-        int qos;
-        parseInt(qos_val, &qos);
-        mqtt_client_publish((struct MqttClientHandle *)cls, url, incoming->data,
-                            qos);
-
-        struct MHD_Response *response =
-            MHD_create_response_from_buffer(3, "OK", MHD_RESPMEM_PERSISTENT);
-        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
-                                "text/html");
-        int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        free(incoming->data);
-        free(incoming);
-        return ret;
+        DEBUG("QOS: %s", qos_val);
+        int qos = 0;
+        if (qos_val && !parseInt(qos_val, &qos)) {
+            qos = 0;
+        }
+        if (!unit->acks) {
+            return queue_publish_response(
+                unit, connection,
+                publish_request(unit, url, &incoming->body, qos, NULL));
+        }
+        // the response is held back until the publish is confirmed. The
+        // request is suspended before it's handed over, as the unit
+        // thread may resume it right away.
+        __atomic_add_fetch(&unit->suspending, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&unit->stopping, __ATOMIC_SEQ_CST)) {
+            __atomic_sub_fetch(&unit->suspending, 1, __ATOMIC_SEQ_CST);
+            return queue_unavailable_response(unit, connection);
+        }
+        incoming->connection = connection;
+        MHD_suspend_connection(connection);
+        const unsigned int status =
+            publish_request(unit, url, &incoming->body, qos, incoming);
+        if (status != MHD_HTTP_OK) {
+            resume_request(incoming, status);
+        }
+        __atomic_sub_fetch(&unit->suspending, 1, __ATOMIC_SEQ_CST);
+        return MHD_YES;
     }
 }
 
@@ -147,10 +642,20 @@ void *rest2mqtt_unit_run(void *configdata)
     // set up the mqtt client config
     MqttClientConfiguration mqtt_config;
     mqtt_config.label = unitconfig->unit_name;
+    mqtt_config.client_id = unitconfig->unit_name;
+    mqtt_config.persistent_session = false;
+    mqtt_config.qos = 0;
     mqtt_config.topic = NULL;
+    mqtt_config.share_group = NULL;
+    mqtt_config.filters = NULL;
+    mqtt_config.filter_count = 0;
     mqtt_config.broker_host = config->mqtt_broker_host;
     mqtt_config.broker_port = config->mqtt_broker_port;
     mqtt_config.keepalive = config->mqtt_keepalive;
+    mqtt_config.protocol_version = config->mqtt_protocol_version;
+    mqtt_config.receive_maximum = config->mqtt_receive_maximum;
+    mqtt_config.topic_alias_maximum = config->mqtt_topic_alias_maximum;
+    mqtt_config.message_expiry = config->mqtt_message_expiry;
     mqtt_config.tls_enabled = config->mqtt_tls;
     mqtt_config.cafile = config->mqtt_cafile;
     mqtt_config.capath = config->mqtt_capath;
@@ -159,8 +664,10 @@ void *rest2mqtt_unit_run(void *configdata)
     mqtt_config.user_pw_auth_enabled = config->mqtt_user_pw;
     mqtt_config.user = config->mqtt_user;
     mqtt_config.pw = config->mqtt_pw;
-    mqtt_config.callback_context = NULL;
+    Rest2MqttUnit unit;
+    mqtt_config.callback_context = (void *)&unit;
     mqtt_config.msg_callback = NULL;
+    mqtt_config.publish_callback = &on_published;
 
     struct MqttClientHandle *mqtt = mqtt_client_init(&mqtt_config);
     if (mqtt == NULL) {
@@ -168,13 +675,106 @@ void *rest2mqtt_unit_run(void *configdata)
         return NULL;
     }
     mqtt_client_connect(mqtt);
+    unit.config = unitconfig;
+    unit.mqtt = mqtt;
+    buffer_init(&unit.topic);
+    unit.incoming_pool_config.capacity = INCOMING_POOL_SIZE;
+    unit.incoming_pool_config.overflow_policy = RING_OVERFLOW_DROP_NEWEST;
+    unit.incoming_pool_config.callback_context = NULL;
+    unit.incoming_pool_config.drop_callback = &incoming_destroy;
+    unit.incoming_pool = ring_buffer_init(&unit.incoming_pool_config);
+    unit.bulk_config.label = unitconfig->unit_name;
+    unit.bulk_config.max_record_size = unitconfig->max_body_size;
+    unit.bulk_config.callback_context = (void *)&unit;
+    unit.bulk_config.record_callback = &on_bulk_record;
+    unit.acks = NULL;
+    unit.suspending = 0;
+    unit.stopping = false;
+    unit.overloaded = false;
+    if (unitconfig->publish_ack) {
+        unit.ack_config.label = unitconfig->unit_name;
+        unit.ack_config.timeout_ms = unitconfig->publish_ack_timeout_ms;
+        unit.ack_config.callback_context = (void *)&unit;
+        unit.ack_config.done_callback = &on_ack_done;
+        unit.acks = ack_tracker_init(&unit.ack_config);
+    }
     const int poll_timeout = config->mqtt_keepalive / 2 * 1000;
 
-    // microhttpd setup
-    struct MHD_Daemon *daemon;
-    daemon =
-        MHD_start_daemon(MHD_USE_DEBUG, unitconfig->listen_port, NULL, NULL,
-                         &answer_to_connection, (void *)mqtt, MHD_OPTION_END);
+    // with the thread pool, the completed requests are queued for this
+    // thread, which is woken up by the eventfd
+    unit.queue = NULL;
+    unit.wakeup_fd = -1;
+    unit.sleeping = false;
+    if (unitconfig->http_threads > 0) {
+        unit.queue_config.capacity = unitconfig->publish_queue_size;
+        // the push fails when the queue is full, and the request is refused
+        unit.queue_config.overflow_policy = RING_OVERFLOW_BLOCK;
+        unit.queue_config.callback_context = NULL;
+        unit.queue_config.drop_callback = NULL;
+        unit.queue = ring_buffer_init(&unit.queue_config);
+        unit.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (unit.wakeup_fd < 0) {
+            FATAL("Failed to create eventfd: %s", strerror(errno));
+            ring_buffer_destroy(unit.queue);
+            ring_buffer_destroy(unit.incoming_pool);
+            if (unit.acks) {
+                ack_tracker_destroy(unit.acks);
+            }
+            mqtt_client_destroy(mqtt);
+            return NULL;
+        }
+    }
+
+    // microhttpd setup: with epoll, the daemon has only one fd to poll,
+    // regardless of the number of connections
+    unsigned int flags = MHD_USE_DEBUG;
+    if (unit.queue) {
+        flags |= MHD_USE_INTERNAL_POLLING_THREAD;
+    }
+    if (unit.acks) {
+        flags |= MHD_ALLOW_SUSPEND_RESUME;
+    }
+    unsigned int max_clients = unitconfig->max_clients;
+    if (MHD_is_feature_supported(MHD_FEATURE_EPOLL) == MHD_YES) {
+        flags |= MHD_USE_EPOLL;
+    } else if (max_clients > FD_SETSIZE - 4) {
+        WARNING("Unit [%s]: libmicrohttpd is built without epoll support, "
+                "max_clients is limited to %d",
+                unitconfig->unit_name, FD_SETSIZE - 4);
+        max_clients = FD_SETSIZE - 4;
+    }
+    unit.daemon = MHD_start_daemon(
+        flags, unitconfig->listen_port, NULL, NULL, &answer_to_connection,
+        (void *)&unit, MHD_OPTION_CONNECTION_LIMIT, max_clients,
+        MHD_OPTION_NOTIFY_COMPLETED, &request_completed, (void *)&unit,
+        // the thread pool size is only passed with the internal threads
+        unit.queue ? MHD_OPTION_THREAD_POOL_SIZE : MHD_OPTION_END,
+        (unsigned int)unitconfig->http_threads, MHD_OPTION_END);
+    if (unit.daemon == NULL) {
+        FATAL("Unit [%s]: failed to start the HTTP server on port %d",
+              unitconfig->unit_name, unitconfig->listen_port);
+        if (unit.queue) {
+            ring_buffer_destroy(unit.queue);
+            close(unit.wakeup_fd);
+        }
+        if (unit.acks) {
+            ack_tracker_destroy(unit.acks);
+        }
+        ring_buffer_destroy(unit.incoming_pool);
+        mqtt_client_destroy(mqtt);
+        buffer_free(&unit.topic);
+        return NULL;
+    }
+    unit.mhd_epoll_fd = -1;
+    if ((flags & MHD_USE_EPOLL) && !unit.queue) {
+        const union MHD_DaemonInfo *info =
+            MHD_get_daemon_info(unit.daemon, MHD_DAEMON_INFO_EPOLL_FD);
+        if (info) {
+            unit.mhd_epoll_fd = info->epoll_fd;
+        }
+    }
+    unit.pfd_size = 16;
+    unit.pfd = SAFEMALLOC(unit.pfd_size * sizeof(struct pollfd));
     while (true) {
         if (!mqtt_client_connected(mqtt)) {
             DEBUG("Trying to reconnect...");
@@ -182,15 +782,40 @@ void *rest2mqtt_unit_run(void *configdata)
                 continue;
             }
         }
-        struct pollfd pfd[64];
-        nfds_t nfds = sizeof(pfd) / sizeof(struct pollfd);
-        nfds_t pfd_count = get_mhd_pollfds(daemon, pfd, &nfds);
-
-        struct pollfd mqtt_pfd[1];
-        nfds_t mqtt_pfd_size = 1;
-        mqtt_client_get_pollfds(mqtt, mqtt_pfd, &mqtt_pfd_size);
-        pfd[pfd_count++] = mqtt_pfd[0];
-        const int ret = poll(pfd, pfd_count, poll_timeout);
+        // the first pollfds are either the ones of the daemon, or the
+        // eventfd of the queue, the last one is the mqtt socket
+        int timeout = poll_timeout;
+        nfds_t http_nfds = 1;
+        if (unit.queue) {
+            unit.pfd[0].fd = unit.wakeup_fd;
+            unit.pfd[0].events = POLLIN;
+            unit.pfd[0].revents = 0;
+            // the producers only signal the eventfd if we are sleeping,
+            // so the queue is checked again after announcing it
+            __atomic_store_n(&unit.sleeping, true, __ATOMIC_SEQ_CST);
+            if (ring_buffer_depth(unit.queue)) {
+                timeout = 0;
+            }
+        } else {
+            http_nfds = get_mhd_pollfds(&unit);
+            // waking up for the connection timeouts of the daemon as well
+            MHD_UNSIGNED_LONG_LONG mhd_timeout;
+            if (MHD_get_timeout(unit.daemon, &mhd_timeout) == MHD_YES &&
+                mhd_timeout < (MHD_UNSIGNED_LONG_LONG)timeout) {
+                timeout = (int)mhd_timeout;
+            }
+        }
+        // and for the oldest request waiting for its publish
+        if (unit.acks) {
+            const int ack_timeout = ack_tracker_get_timeout(unit.acks);
+            if (ack_timeout >= 0 && ack_timeout < timeout) {
+                timeout = ack_timeout;
+            }
+        }
+        nfds_t mqtt_nfds = 1;
+        mqtt_client_get_pollfds(mqtt, &unit.pfd[http_nfds], &mqtt_nfds);
+        const int ret = poll(unit.pfd, http_nfds + 1, timeout);
+        __atomic_store_n(&unit.sleeping, false, __ATOMIC_SEQ_CST);
         if (ret < 0) {
             if (errno != EINTR) // we got SIGUSR1 so we halt
             {
@@ -198,12 +823,51 @@ void *rest2mqtt_unit_run(void *configdata)
             }
             break;
         }
-        MHD_run(daemon);
-        mqtt_client_loop(mqtt, pfd[pfd_count - 1].revents & POLLIN,
-                         pfd[pfd_count - 1].revents & POLLOUT);
+        const short mqtt_revents = unit.pfd[http_nfds].revents;
+        if (unit.queue) {
+            uint64_t value;
+            if ((unit.pfd[0].revents & POLLIN) &&
+                read(unit.wakeup_fd, &value, sizeof(value)) < 0 &&
+                errno != EAGAIN) {
+                ERROR("Unit [%s]: failed to read eventfd: %s",
+                      unitconfig->unit_name, strerror(errno));
+            }
+            publish_queued(&unit);
+        } else {
+            MHD_run(unit.daemon);
+        }
+        mqtt_client_loop(mqtt, mqtt_revents & POLLIN, mqtt_revents & POLLOUT);
+        update_admission(&unit);
+        if (unit.acks) {
+            ack_tracker_expire(unit.acks);
+        }
+    }
+    if (unit.acks) {
+        // MHD can't be stopped with suspended requests, so no more
+        // requests are suspended, and the waiting ones are answered
+        __atomic_store_n(&unit.stopping, true, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&unit.suspending, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+        if (unit.queue) {
+            publish_queued(&unit);
+        }
+        mqtt_client_loop(mqtt, false, true);
+        ack_tracker_destroy(unit.acks);
+        unit.acks = NULL;
+    }
+    MHD_stop_daemon(unit.daemon);
+    if (unit.queue) {
+        // the requests already accepted are still published
+        publish_queued(&unit);
+        mqtt_client_loop(mqtt, false, true);
+        ring_buffer_destroy(unit.queue);
+        close(unit.wakeup_fd);
     }
-    MHD_stop_daemon(daemon);
+    ring_buffer_destroy(unit.incoming_pool);
     mqtt_client_destroy(mqtt);
+    free(unit.pfd);
+    buffer_free(&unit.topic);
     INFO("Unit thread %s exiting...", unitconfig->unit_name);
 
     return NULL;
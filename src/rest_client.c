@@ -0,0 +1,943 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "rest_client.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// max number of idle easy handles kept for reuse per client
+#define MAX_IDLE_TRANSFERS 64
+
+/* The DNS and TLS session caches are shared between all of the
+ * clients talking to the same host (scheme://host:port), even if they
+ * are running in different threads. The connection cache is not, as
+ * a connection picked up by another multi handle would not be reported
+ * by the socket callback of that multi handle.
+ */
+typedef struct RestShare {
+    char *key;
+    CURLSH *share;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+    int refcount;
+    // the circuit breaker of the host, protected by breaker_mutex. Its
+    // settings are taken from the client which created the share.
+    int breaker_threshold;
+    int breaker_cooldown_ms;
+    pthread_mutex_t breaker_mutex;
+    int failures;
+    // 0 if the breaker is closed
+    uint64_t open_until;
+    bool probe_inflight;
+    struct RestShare *next;
+} RestShare;
+
+typedef enum {
+    REST_OUTCOME_OK,
+    REST_OUTCOME_CONNECT_ERROR,
+    REST_OUTCOME_TIMEOUT,
+    REST_OUTCOME_TRANSPORT_ERROR,
+    REST_OUTCOME_SERVER_ERROR,
+    REST_OUTCOME_THROTTLED,
+    REST_OUTCOME_CLIENT_ERROR
+} RestOutcome;
+
+static pthread_mutex_t shares_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RestShare *shares = NULL;
+
+// one POST request, set as the private data of the easy handle. After the
+// request completes, it's kept on the idle list with its easy handle
+typedef struct RestTransfer {
+    CURL *easy;
+    char *url;
+    struct curl_slist *headers;
+    // the compressed body, kept allocated for the next requests
+    Buffer body;
+    void *userdata;
+    int attempts;
+    // the time of the next attempt, 0 if the transfer is running
+    uint64_t retry_at;
+    // from the Retry-After header of the last response, or 0
+    uint64_t retry_after_ms;
+    // set if this is the probe request of a half-open breaker
+    bool probe;
+    // set while the transfer waits for the rate limiter, retry_at is
+    // the time it's tried again
+    bool throttled;
+    struct RestTransfer *prev;
+    struct RestTransfer *next;
+} RestTransfer;
+
+typedef struct RestClientHandle {
+    CURLM *multi;
+    RestClientConfiguration *config;
+    // the sockets libcurl asked us to watch, kept up to date
+    // by the socket callback
+    struct pollfd *sockets;
+    nfds_t socket_count;
+    nfds_t socket_capacity;
+    // absolute deadline of the libcurl timer, 0 if not set
+    uint64_t timer_deadline;
+    RestTransfer *transfers;
+    int inflight;
+    // the number of transfers waiting for the rate limiter
+    int throttled;
+    RestTransfer *idle;
+    int idle_count;
+    RestShare *share;
+    // state of the random generator for the backoff jitter
+    uint32_t random;
+    // NULL if compression is disabled
+    struct Compressor *compressor;
+} RestClientHandle;
+
+// response bodies are not used, we just drop them instead of
+// letting libcurl print them to stdout
+static size_t rest_cb_write(char *ptr, size_t size, size_t nmemb, void *userp)
+{
+    (void)ptr;
+    (void)userp;
+    return size * nmemb;
+}
+
+/* picking up the Retry-After header, either as seconds or as an
+ * HTTP date
+ */
+static size_t rest_cb_header(char *buffer, size_t size, size_t nitems,
+                             void *userp)
+{
+    RestTransfer *t = userp;
+    const size_t len = size * nitems;
+    static const char name[] = "Retry-After:";
+    if (len <= sizeof(name) || strncasecmp(buffer, name, sizeof(name) - 1)) {
+        return len;
+    }
+    char value[64];
+    size_t value_len = len - (sizeof(name) - 1);
+    if (value_len >= sizeof(value)) {
+        value_len = sizeof(value) - 1;
+    }
+    memcpy(value, buffer + sizeof(name) - 1, value_len);
+    value[value_len] = '\0';
+    char *end;
+    const long seconds = strtol(value, &end, 10);
+    if (end != value && seconds >= 0) {
+        t->retry_after_ms = (uint64_t)seconds * 1000;
+        return len;
+    }
+    const time_t date = curl_getdate(value, NULL);
+    const uint64_t now = realtime_ms();
+    if (date > 0 && (uint64_t)date * 1000 > now) {
+        t->retry_after_ms = (uint64_t)date * 1000 - now;
+    }
+    return len;
+}
+
+static void rest_cb_share_lock(CURL *easy, curl_lock_data data,
+                               curl_lock_access access, void *userp)
+{
+    RestShare *s = userp;
+    (void)easy;
+    (void)access;
+    pthread_mutex_lock(&s->locks[data]);
+}
+
+static void rest_cb_share_unlock(CURL *easy, curl_lock_data data, void *userp)
+{
+    RestShare *s = userp;
+    (void)easy;
+    pthread_mutex_unlock(&s->locks[data]);
+}
+
+/* the share key is the scheme://host:port part of the url,
+ * without any user info
+ */
+static char *rest_share_key(const char *url)
+{
+    const char *scheme_end = strstr(url, "://");
+    const char *host = scheme_end ? scheme_end + 3 : url;
+    const size_t scheme_len = host - url;
+    size_t len = strcspn(host, "/?#");
+    const char *at = memchr(host, '@', len);
+    if (at) {
+        len -= at + 1 - host;
+        host = at + 1;
+    }
+    char *key = SAFEMALLOC(scheme_len + len + 1);
+    memcpy(key, url, scheme_len);
+    memcpy(key + scheme_len, host, len);
+    key[scheme_len + len] = '\0';
+    return key;
+}
+
+static RestShare *rest_share_get(const RestClientConfiguration *config)
+{
+    char *key = rest_share_key(config->base_url);
+    pthread_mutex_lock(&shares_mutex);
+    RestShare *s = shares;
+    while (s && strcmp(s->key, key)) {
+        s = s->next;
+    }
+    if (s) {
+        if (s->breaker_threshold != config->breaker_threshold ||
+            s->breaker_cooldown_ms != config->breaker_cooldown_ms) {
+            WARNING("Unit [%s]: the circuit breaker of %s is shared, using "
+                    "threshold %d and cooldown %d ms",
+                    config->label, key, s->breaker_threshold,
+                    s->breaker_cooldown_ms);
+        }
+        free(key);
+        s->refcount++;
+        pthread_mutex_unlock(&shares_mutex);
+        return s;
+    }
+    s = SAFEMALLOC(sizeof(RestShare));
+    s->key = key;
+    s->share = curl_share_init();
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&s->locks[i], NULL);
+    }
+    curl_share_setopt(s->share, CURLSHOPT_LOCKFUNC, rest_cb_share_lock);
+    curl_share_setopt(s->share, CURLSHOPT_UNLOCKFUNC, rest_cb_share_unlock);
+    curl_share_setopt(s->share, CURLSHOPT_USERDATA, s);
+    curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    pthread_mutex_init(&s->breaker_mutex, NULL);
+    s->breaker_threshold = config->breaker_threshold;
+    s->breaker_cooldown_ms = config->breaker_cooldown_ms;
+    s->failures = 0;
+    s->open_until = 0;
+    s->probe_inflight = false;
+    s->refcount = 1;
+    s->next = shares;
+    shares = s;
+    DEBUG("Created shared DNS and TLS session cache for %s", key);
+    pthread_mutex_unlock(&shares_mutex);
+    return s;
+}
+
+static void rest_share_release(RestShare *s)
+{
+    pthread_mutex_lock(&shares_mutex);
+    if (--s->refcount) {
+        pthread_mutex_unlock(&shares_mutex);
+        return;
+    }
+    RestShare **p = &shares;
+    while (*p != s) {
+        p = &(*p)->next;
+    }
+    *p = s->next;
+    pthread_mutex_unlock(&shares_mutex);
+
+    curl_share_cleanup(s->share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&s->locks[i]);
+    }
+    pthread_mutex_destroy(&s->breaker_mutex);
+    free(s->key);
+    free(s);
+}
+
+/* checks if a request can be sent to the host. If the cooldown of an
+ * open breaker is over, the first request is let through as a probe
+ */
+static bool rest_breaker_allow(RestClientHandle *h, RestTransfer *t)
+{
+    RestShare *s = h->share;
+    bool allowed = true;
+    pthread_mutex_lock(&s->breaker_mutex);
+    if (s->open_until) {
+        if (s->probe_inflight || monotonic_ms() < s->open_until) {
+            allowed = false;
+        } else if (t) {
+            s->probe_inflight = true;
+            t->probe = true;
+        }
+    }
+    pthread_mutex_unlock(&s->breaker_mutex);
+    return allowed;
+}
+
+// the probe request wasn't sent after all, letting another one through
+static void rest_breaker_cancel_probe(RestClientHandle *h, RestTransfer *t)
+{
+    if (!t->probe) {
+        return;
+    }
+    pthread_mutex_lock(&h->share->breaker_mutex);
+    h->share->probe_inflight = false;
+    t->probe = false;
+    pthread_mutex_unlock(&h->share->breaker_mutex);
+}
+
+static void rest_breaker_record(RestClientHandle *h, RestTransfer *t,
+                                bool available)
+{
+    RestShare *s = h->share;
+    pthread_mutex_lock(&s->breaker_mutex);
+    if (t->probe) {
+        s->probe_inflight = false;
+        t->probe = false;
+    }
+    if (available) {
+        if (s->open_until) {
+            INFO("Unit [%s]: circuit breaker closed for %s", h->config->label,
+                 s->key);
+        }
+        s->failures = 0;
+        s->open_until = 0;
+    } else if (s->breaker_threshold > 0 &&
+               (++s->failures >= s->breaker_threshold || s->open_until)) {
+        if (!s->open_until) {
+            WARNING("Unit [%s]: circuit breaker opened for %s after %d "
+                    "failures",
+                    h->config->label, s->key, s->failures);
+        }
+        s->open_until = monotonic_ms() + s->breaker_cooldown_ms;
+    }
+    pthread_mutex_unlock(&s->breaker_mutex);
+}
+
+static RestOutcome rest_classify(CURLcode result, long status)
+{
+    switch (result) {
+    case CURLE_OK:
+        break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_CONNECT:
+        return REST_OUTCOME_CONNECT_ERROR;
+    case CURLE_OPERATION_TIMEDOUT:
+        return REST_OUTCOME_TIMEOUT;
+    default:
+        return REST_OUTCOME_TRANSPORT_ERROR;
+    }
+    if (status == 429) {
+        return REST_OUTCOME_THROTTLED;
+    }
+    if (status == 408) {
+        return REST_OUTCOME_TIMEOUT;
+    }
+    if (status >= 500) {
+        return REST_OUTCOME_SERVER_ERROR;
+    }
+    if (status >= 400) {
+        return REST_OUTCOME_CLIENT_ERROR;
+    }
+    return REST_OUTCOME_OK;
+}
+
+// xorshift32, good enough for spreading the retries
+static uint32_t rest_random(RestClientHandle *h)
+{
+    uint32_t x = h->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    h->random = x;
+    return x;
+}
+
+// full jitter: a random delay between 0 and the exponential backoff
+static uint64_t rest_backoff(RestClientHandle *h, int attempt)
+{
+    uint64_t max = h->config->retry_max_ms;
+    uint64_t backoff = (uint64_t)h->config->retry_base_ms
+                       << (attempt < 20 ? attempt : 20);
+    if (backoff > max) {
+        backoff = max;
+    }
+    return backoff ? rest_random(h) % (backoff + 1) : 0;
+}
+
+static void rest_transfer_destroy(RestTransfer *t)
+{
+    curl_easy_cleanup(t->easy);
+    curl_slist_free_all(t->headers);
+    buffer_free(&t->body);
+    free(t->url);
+    free(t);
+}
+
+// putting the transfer to the idle list, or destroying it if it's full
+static void rest_transfer_idle(RestClientHandle *h, RestTransfer *t)
+{
+    free(t->url);
+    t->url = NULL;
+    curl_slist_free_all(t->headers);
+    t->headers = NULL;
+    t->retry_at = 0;
+    if (h->idle_count >= MAX_IDLE_TRANSFERS) {
+        rest_transfer_destroy(t);
+        return;
+    }
+    t->prev = NULL;
+    t->next = h->idle;
+    h->idle = t;
+    h->idle_count++;
+}
+
+/* detaching the transfer from the multi handle, and keeping
+ * its easy handle for the next request
+ */
+static void rest_transfer_release(RestClientHandle *h, RestTransfer *t)
+{
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        h->transfers = t->next;
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+    curl_multi_remove_handle(h->multi, t->easy);
+    h->inflight--;
+    if (t->throttled) {
+        t->throttled = false;
+        h->throttled--;
+    }
+    rest_transfer_idle(h, t);
+}
+
+/* returning an idle transfer, or setting up a new one with
+ * the options which are the same for all of the requests
+ */
+static RestTransfer *rest_transfer_get(RestClientHandle *h)
+{
+    if (h->idle) {
+        RestTransfer *t = h->idle;
+        h->idle = t->next;
+        h->idle_count--;
+        t->next = NULL;
+        return t;
+    }
+    CURL *easy = curl_easy_init();
+    if (!easy) {
+        return NULL;
+    }
+    RestTransfer *t = SAFEMALLOC(sizeof(RestTransfer));
+    t->easy = easy;
+    t->url = NULL;
+    t->headers = NULL;
+    buffer_init(&t->body);
+    t->userdata = NULL;
+    t->retry_at = 0;
+    t->probe = false;
+    t->throttled = false;
+    t->prev = NULL;
+    t->next = NULL;
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, t);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, rest_cb_write);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, rest_cb_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, t);
+    if (h->config->connect_timeout_ms > 0) {
+        curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS,
+                         (long)h->config->connect_timeout_ms);
+    }
+    if (h->config->request_timeout_ms > 0) {
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS,
+                         (long)h->config->request_timeout_ms);
+    }
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_SHARE, h->share->share);
+    switch (h->config->http_version) {
+    case REST_HTTP_1_1:
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        break;
+    case REST_HTTP_2_PRIOR_KNOWLEDGE:
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+                         CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        break;
+    case REST_HTTP_2:
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        break;
+    }
+    return t;
+}
+
+static int rest_cb_socket(CURL *easy, curl_socket_t s, int what, void *userp,
+                          void *socketp)
+{
+    RestClientHandle *h = userp;
+    (void)easy;
+    (void)socketp;
+
+    nfds_t i = 0;
+    while (i < h->socket_count && h->sockets[i].fd != s) {
+        i++;
+    }
+    if (what == CURL_POLL_REMOVE) {
+        if (i < h->socket_count) {
+            h->sockets[i] = h->sockets[--h->socket_count];
+        }
+        return 0;
+    }
+    if (i == h->socket_count) {
+        if (h->socket_count == h->socket_capacity) {
+            h->socket_capacity =
+                h->socket_capacity ? h->socket_capacity * 2 : 8;
+            h->sockets = SAFEREALLOC(h->sockets, h->socket_capacity *
+                                                     sizeof(struct pollfd));
+        }
+        h->sockets[i].fd = s;
+        h->socket_count++;
+    }
+    h->sockets[i].events = 0;
+    h->sockets[i].revents = 0;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) {
+        h->sockets[i].events |= POLLIN;
+    }
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) {
+        h->sockets[i].events |= POLLOUT;
+    }
+    return 0;
+}
+
+static int rest_cb_timer(CURLM *multi, long timeout_ms, void *userp)
+{
+    RestClientHandle *h = userp;
+    (void)multi;
+    if (timeout_ms < 0) {
+        h->timer_deadline = 0;
+    } else {
+        h->timer_deadline = monotonic_ms() + timeout_ms;
+    }
+    return 0;
+}
+
+static void rest_transfer_finish(RestClientHandle *h, RestTransfer *t,
+                                 RestResult result)
+{
+    void *userdata = t->userdata;
+    rest_transfer_release(h, t);
+    if (h->config->done_callback) {
+        h->config->done_callback(userdata, result,
+                                 h->config->callback_context);
+    }
+}
+
+static const char *rest_outcome_str(RestOutcome outcome)
+{
+    switch (outcome) {
+    case REST_OUTCOME_OK:
+        return "ok";
+    case REST_OUTCOME_CONNECT_ERROR:
+        return "connect error";
+    case REST_OUTCOME_TIMEOUT:
+        return "timeout";
+    case REST_OUTCOME_TRANSPORT_ERROR:
+        return "transport error";
+    case REST_OUTCOME_SERVER_ERROR:
+        return "server error";
+    case REST_OUTCOME_THROTTLED:
+        return "throttled";
+    case REST_OUTCOME_CLIENT_ERROR:
+        return "client error";
+    }
+    return "unknown";
+}
+
+/* handling the outcome of one attempt: the retryable failures are
+ * scheduled again after the backoff, unless the breaker is open
+ */
+static void rest_transfer_done(RestClientHandle *h, RestTransfer *t,
+                               CURLcode result)
+{
+    long status = 0;
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &status);
+    }
+    const RestOutcome outcome = rest_classify(result, status);
+    // a 4xx means that the web service is up, just doesn't like the request
+    rest_breaker_record(h, t,
+                        outcome == REST_OUTCOME_OK ||
+                            outcome == REST_OUTCOME_CLIENT_ERROR);
+    if (outcome == REST_OUTCOME_OK) {
+        DEBUG("Unit [%s]: POST to %s done, status: %ld", h->config->label,
+              t->url, status);
+        rest_transfer_finish(h, t, REST_RESULT_OK);
+        return;
+    }
+    if (outcome == REST_OUTCOME_CLIENT_ERROR) {
+        ERROR("Unit [%s]: POST to %s rejected, status: %ld", h->config->label,
+              t->url, status);
+        rest_transfer_finish(h, t, REST_RESULT_REJECTED);
+        return;
+    }
+    if (result != CURLE_OK) {
+        WARNING("Unit [%s]: POST to %s failed (%s): %s", h->config->label,
+                t->url, rest_outcome_str(outcome), curl_easy_strerror(result));
+    } else {
+        WARNING("Unit [%s]: POST to %s failed (%s), status: %ld",
+                h->config->label, t->url, rest_outcome_str(outcome), status);
+    }
+    if (t->attempts > h->config->max_retries || !rest_breaker_allow(h, NULL)) {
+        ERROR("Unit [%s]: giving up POST to %s after %d attempts",
+              h->config->label, t->url, t->attempts);
+        rest_transfer_finish(h, t, REST_RESULT_FAILED);
+        return;
+    }
+    uint64_t delay = rest_backoff(h, t->attempts - 1);
+    if (outcome == REST_OUTCOME_THROTTLED && t->retry_after_ms) {
+        // the transfer is not parked for longer than the max backoff,
+        // it's handed back to be spooled instead
+        if (t->retry_after_ms > (uint64_t)h->config->retry_max_ms) {
+            ERROR("Unit [%s]: giving up POST to %s, the server asked to "
+                  "retry after %llu ms",
+                  h->config->label, t->url,
+                  (unsigned long long)t->retry_after_ms);
+            rest_transfer_finish(h, t, REST_RESULT_FAILED);
+            return;
+        }
+        delay = t->retry_after_ms;
+    }
+    DEBUG("Unit [%s]: retrying POST to %s in %llu ms", h->config->label,
+          t->url, (unsigned long long)delay);
+    curl_multi_remove_handle(h->multi, t->easy);
+    t->retry_at = monotonic_ms() + delay;
+    // 0 is reserved for the running transfers
+    if (!t->retry_at) {
+        t->retry_at = 1;
+    }
+}
+
+// starting the next attempt of a transfer
+static bool rest_transfer_start(RestClientHandle *h, RestTransfer *t)
+{
+    t->retry_at = 0;
+    t->retry_after_ms = 0;
+    t->attempts++;
+    CURLMcode rc = curl_multi_add_handle(h->multi, t->easy);
+    if (rc != CURLM_OK) {
+        ERROR("Unit [%s]: failed to start POST to %s: %s", h->config->label,
+              t->url, curl_multi_strerror(rc));
+        return false;
+    }
+    return true;
+}
+
+/* starting the next attempt, if the rate limiter lets it through.
+ * Otherwise it's tried again by rest_start_retries() when the limiter
+ * has a token for it.
+ */
+static bool rest_transfer_try_start(RestClientHandle *h, RestTransfer *t)
+{
+    if (h->config->rate_limiter) {
+        const uint64_t wait =
+            rate_limiter_acquire(h->config->rate_limiter, t->url);
+        if (wait) {
+            if (!t->throttled) {
+                t->throttled = true;
+                h->throttled++;
+            }
+            t->retry_at = monotonic_ms() + wait;
+            return true;
+        }
+        if (t->throttled) {
+            t->throttled = false;
+            h->throttled--;
+        }
+    }
+    return rest_transfer_start(h, t);
+}
+
+// restarting the transfers whose backoff or rate limit wait is over
+static void rest_start_retries(RestClientHandle *h)
+{
+    const uint64_t now = monotonic_ms();
+    RestTransfer *t = h->transfers;
+    while (t) {
+        RestTransfer *next = t->next;
+        if (t->retry_at && t->retry_at <= now) {
+            // the throttled ones were already let through by the breaker
+            if (!t->throttled && !rest_breaker_allow(h, t)) {
+                DEBUG("Unit [%s]: circuit breaker is open, not retrying "
+                      "POST to %s",
+                      h->config->label, t->url);
+                rest_transfer_finish(h, t, REST_RESULT_FAILED);
+            } else if (!rest_transfer_try_start(h, t)) {
+                rest_breaker_cancel_probe(h, t);
+                rest_transfer_finish(h, t, REST_RESULT_FAILED);
+            }
+        }
+        t = next;
+    }
+}
+
+// collecting the finished transfers, and releasing their handles
+static void rest_check_completed(RestClientHandle *h)
+{
+    CURLMsg *msg;
+    int pending;
+    while ((msg = curl_multi_info_read(h->multi, &pending))) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        RestTransfer *t = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+        assert(t != NULL);
+        rest_transfer_done(h, t, msg->data.result);
+    }
+}
+
+RestClientHandle *rest_client_init(RestClientConfiguration *config)
+{
+    assert(config != NULL);
+    RestClientHandle *retval = SAFEMALLOC(sizeof(RestClientHandle));
+    retval->multi = curl_multi_init();
+    if (!retval->multi) {
+        FATAL("Failed to init curl multi handle");
+        free(retval);
+        return NULL;
+    }
+    retval->config = config;
+    retval->sockets = NULL;
+    retval->socket_count = 0;
+    retval->socket_capacity = 0;
+    retval->timer_deadline = 0;
+    retval->transfers = NULL;
+    retval->inflight = 0;
+    retval->throttled = 0;
+    retval->idle = NULL;
+    retval->idle_count = 0;
+    retval->share = rest_share_get(config);
+    retval->random = (uint32_t)(monotonic_ms() ^ (uintptr_t)retval) | 1;
+    retval->compressor =
+        compressor_new(config->compression, config->compression_level);
+
+    curl_multi_setopt(retval->multi, CURLMOPT_SOCKETFUNCTION, rest_cb_socket);
+    curl_multi_setopt(retval->multi, CURLMOPT_SOCKETDATA, retval);
+    curl_multi_setopt(retval->multi, CURLMOPT_TIMERFUNCTION, rest_cb_timer);
+    curl_multi_setopt(retval->multi, CURLMOPT_TIMERDATA, retval);
+    if (config->max_connections > 0) {
+        curl_multi_setopt(retval->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          (long)config->max_connections);
+    }
+    if (config->http_version != REST_HTTP_1_1) {
+        if (!(curl_version_info(CURLVERSION_NOW)->features &
+              CURL_VERSION_HTTP2)) {
+            WARNING("Unit [%s]: libcurl is built without HTTP/2 support",
+                    config->label);
+        }
+        curl_multi_setopt(retval->multi, CURLMOPT_PIPELINING,
+                          CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+        if (config->max_streams > 0) {
+            curl_multi_setopt(retval->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                              (long)config->max_streams);
+        }
+#else
+        if (config->max_streams > 0) {
+            WARNING("Unit [%s]: max_streams needs libcurl 7.67.0 or newer, "
+                    "ignoring it",
+                    config->label);
+        }
+#endif
+    }
+    return retval;
+}
+
+/* Starts a POST request to the given url. The payload is not copied
+ * (unless it's compressed), it has to be kept alive until the done
+ * callback is called for the request, or until this call returns false.
+ * The transfer itself is driven by rest_client_loop(). If content_type
+ * is NULL, libcurl's default form content type is sent.
+ */
+bool rest_client_post(RestClientHandle *h, const char *url,
+                      const void *payload, size_t payload_len,
+                      const char *content_type, void *userdata)
+{
+    assert(h != NULL);
+    assert(url != NULL);
+    RestTransfer *t = rest_transfer_get(h);
+    if (!t) {
+        ERROR("Unit [%s]: failed to init curl handle", h->config->label);
+        return false;
+    }
+    if (!rest_breaker_allow(h, t)) {
+        DEBUG("Unit [%s]: circuit breaker is open, not sending POST to %s",
+              h->config->label, url);
+        rest_transfer_idle(h, t);
+        return false;
+    }
+    t->url = strdup(url);
+    t->userdata = userdata;
+    t->attempts = 0;
+    curl_easy_setopt(t->easy, CURLOPT_URL, t->url);
+    // an empty body for the NULL payload keeps it a POST request
+    const void *body = payload ? payload : "";
+    size_t body_len = payload ? payload_len : 0;
+    bool compressed = false;
+    if (h->compressor && body_len >= h->config->compression_min_size &&
+        compressor_compress(h->compressor, body, body_len, &t->body)) {
+        body = t->body.data;
+        body_len = t->body.length;
+        compressed = true;
+    }
+    // the size is set first, so libcurl doesn't call strlen() on the body
+    curl_easy_setopt(t->easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t)body_len);
+    curl_easy_setopt(t->easy, CURLOPT_POSTFIELDS, body);
+    char header[128];
+    if (content_type) {
+        snprintf(header, sizeof(header), "Content-Type: %s", content_type);
+        t->headers = curl_slist_append(t->headers, header);
+    }
+    if (compressed) {
+        snprintf(header, sizeof(header), "Content-Encoding: %s",
+                 compressor_encoding(h->compressor));
+        t->headers = curl_slist_append(t->headers, header);
+    }
+    curl_easy_setopt(t->easy, CURLOPT_HTTPHEADER, t->headers);
+    t->prev = NULL;
+    t->next = h->transfers;
+    if (h->transfers) {
+        h->transfers->prev = t;
+    }
+    h->transfers = t;
+    h->inflight++;
+    if (!rest_transfer_try_start(h, t)) {
+        rest_breaker_cancel_probe(h, t);
+        rest_transfer_release(h, t);
+        return false;
+    }
+    return true;
+}
+
+nfds_t rest_client_pollfd_count(RestClientHandle *h)
+{
+    assert(h != NULL);
+    return h->socket_count;
+}
+
+nfds_t rest_client_get_pollfds(RestClientHandle *h, struct pollfd *pfds,
+                               nfds_t *count)
+{
+    assert(h != NULL);
+    assert(pfds != NULL);
+    if (*count > h->socket_count) {
+        *count = h->socket_count;
+    }
+    memcpy(pfds, h->sockets, *count * sizeof(struct pollfd));
+    return *count;
+}
+
+/* returns the time in ms until libcurl needs to be called
+ * even if there is no socket activity, or -1 if there is no
+ * such deadline
+ */
+int rest_client_get_timeout(RestClientHandle *h)
+{
+    assert(h != NULL);
+    uint64_t deadline = h->timer_deadline;
+    for (RestTransfer *t = h->transfers; t; t = t->next) {
+        if (t->retry_at && (!deadline || t->retry_at < deadline)) {
+            deadline = t->retry_at;
+        }
+    }
+    if (!deadline) {
+        return -1;
+    }
+    const uint64_t now = monotonic_ms();
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+void rest_client_loop(RestClientHandle *h, const struct pollfd *pfds,
+                      const nfds_t count)
+{
+    assert(h != NULL);
+    int running = 0;
+    for (nfds_t i = 0; i < count; i++) {
+        if (!pfds[i].revents) {
+            continue;
+        }
+        int flags = 0;
+        if (pfds[i].revents & POLLIN) {
+            flags |= CURL_CSELECT_IN;
+        }
+        if (pfds[i].revents & POLLOUT) {
+            flags |= CURL_CSELECT_OUT;
+        }
+        if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            flags |= CURL_CSELECT_ERR;
+        }
+        curl_multi_socket_action(h->multi, pfds[i].fd, flags, &running);
+    }
+    if (h->timer_deadline && h->timer_deadline <= monotonic_ms()) {
+        h->timer_deadline = 0;
+        curl_multi_socket_action(h->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+    rest_check_completed(h);
+    rest_start_retries(h);
+}
+
+int rest_client_inflight(RestClientHandle *h)
+{
+    assert(h != NULL);
+    return h->inflight;
+}
+
+// the number of requests waiting for the rate limiter
+int rest_client_throttled(RestClientHandle *h)
+{
+    assert(h != NULL);
+    return h->throttled;
+}
+
+/* returns false while the circuit breaker of the host is open,
+ * and the requests would be refused anyway
+ */
+bool rest_client_available(RestClientHandle *h)
+{
+    assert(h != NULL);
+    return rest_breaker_allow(h, NULL);
+}
+
+void rest_client_destroy(RestClientHandle *h)
+{
+    assert(h != NULL);
+    if (h->inflight) {
+        WARNING("Unit [%s]: dropping %d unfinished POST requests",
+                h->config->label, h->inflight);
+    }
+    while (h->transfers) {
+        rest_breaker_cancel_probe(h, h->transfers);
+        rest_transfer_finish(h, h->transfers, REST_RESULT_FAILED);
+    }
+    while (h->idle) {
+        RestTransfer *t = h->idle;
+        h->idle = t->next;
+        rest_transfer_destroy(t);
+    }
+    curl_multi_cleanup(h->multi);
+    rest_share_release(h->share);
+    compressor_free(h->compressor);
+    free(h->sockets);
+    free(h);
+}
@@ -0,0 +1,112 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file rest_client.h
+ *   @brief The rest_client unit wraps a libcurl multi handle, so the
+ *   HTTP POST requests are performed asynchronously. The sockets of the
+ *   ongoing transfers are exported as pollfds, so they can be polled
+ *   in the same loop as the mqtt client. The easy handles are reused
+ *   between the requests, so the keep-alive connections are kept open.
+ *   The failed requests are retried with a jittered exponential backoff,
+ *   and a circuit breaker per host stops sending requests to a web
+ *   service which keeps failing. The bodies can be compressed with
+ *   gzip or zstd. With a rate limiter, the requests over the limit
+ *   are started later, when the limiter lets them through.
+ */
+#ifndef REST_CLIENT_H
+#define REST_CLIENT_H
+#include "compress.h"
+#include "rate_limiter.h"
+#include <stdbool.h>
+#include <sys/poll.h>
+#include <sys/types.h>
+
+typedef enum {
+    REST_HTTP_1_1,
+    // HTTP/2 over cleartext, without upgrade
+    REST_HTTP_2_PRIOR_KNOWLEDGE,
+    // HTTP/2 if the server accepts it during the TLS (ALPN) negotiation
+    REST_HTTP_2
+} RestHttpVersion;
+
+// the final outcome of a request, after the retries
+typedef enum {
+    REST_RESULT_OK,
+    // the web service couldn't be reached or kept failing, worth
+    // sending again later
+    REST_RESULT_FAILED,
+    // the web service refused the request with a 4xx status,
+    // sending it again would not help
+    REST_RESULT_REJECTED
+} RestResult;
+
+typedef struct {
+    const char *label;
+    // the clients with the same scheme://host:port in their base url
+    // share their DNS and TLS session caches, and the circuit breaker
+    const char *base_url;
+    // max number of parallel connections, the rest of the
+    // requests are queued by libcurl
+    int max_connections;
+    RestHttpVersion http_version;
+    // max number of the multiplexed requests over one HTTP/2 connection
+    int max_streams;
+    int connect_timeout_ms;
+    int request_timeout_ms;
+    // the failed requests are retried max_retries times, waiting a
+    // random time up to retry_base_ms * 2^attempt, at most retry_max_ms
+    int max_retries;
+    int retry_base_ms;
+    int retry_max_ms;
+    // after breaker_threshold consecutive failures, the requests to the
+    // host are refused for breaker_cooldown_ms, then one probe request
+    // is let through, which closes the breaker if it succeeds
+    int breaker_threshold;
+    int breaker_cooldown_ms;
+    // the bodies of at least compression_min_size bytes are compressed,
+    // if it makes them smaller
+    CompressionType compression;
+    int compression_level;
+    size_t compression_min_size;
+    // NULL if the requests are not rate limited
+    struct RateLimiter *rate_limiter;
+    void *callback_context;
+    // called when a request is finished, with the userdata passed to
+    // rest_client_post(). Also called for the unfinished ones when the
+    // client is destroyed.
+    void (*done_callback)(void *userdata, RestResult result, void *ctx);
+} RestClientConfiguration;
+
+struct RestClientHandle;
+
+struct RestClientHandle *rest_client_init(RestClientConfiguration *config);
+bool rest_client_post(struct RestClientHandle *h, const char *url,
+                      const void *payload, size_t payload_len,
+                      const char *content_type, void *userdata);
+nfds_t rest_client_get_pollfds(struct RestClientHandle *h, struct pollfd *pfds,
+                               nfds_t *count);
+nfds_t rest_client_pollfd_count(struct RestClientHandle *h);
+int rest_client_get_timeout(struct RestClientHandle *h);
+void rest_client_loop(struct RestClientHandle *h, const struct pollfd *pfds,
+                      const nfds_t count);
+int rest_client_inflight(struct RestClientHandle *h);
+int rest_client_throttled(struct RestClientHandle *h);
+bool rest_client_available(struct RestClientHandle *h);
+void rest_client_destroy(struct RestClientHandle *h);
+
+#endif
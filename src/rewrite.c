@@ -0,0 +1,118 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "rewrite.h"
+#include "logging.h"
+#include "topic_trie.h"
+#include "url_template.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REWRITE_ARROW " -> "
+
+typedef struct RewriteRules {
+    RewriteDirection direction;
+    struct TopicTrie *trie;
+} RewriteRules;
+
+RewriteRules *rewrite_rules_new(RewriteDirection direction)
+{
+    RewriteRules *r = SAFEMALLOC(sizeof(RewriteRules));
+    r->direction = direction;
+    r->trie = topic_trie_new();
+    return r;
+}
+
+/* Compiles one rule, and adds it to the trie. Returns false, and
+ * prints the error on stderr if the rule is invalid, or there is
+ * already a rule with the same pattern.
+ */
+bool rewrite_rules_add(RewriteRules *r, const char *rule)
+{
+    assert(r != NULL);
+    assert(rule != NULL);
+    const char *arrow = strstr(rule, REWRITE_ARROW);
+    if (!arrow) {
+        fprintf(stderr, "config error: missing '" REWRITE_ARROW "' in "
+                        "rewrite rule: %s\n",
+                rule);
+        return false;
+    }
+    char *pattern = strndup(rule, arrow - rule);
+    // the url paths start with a '/', which is not part of the pattern
+    const char *trimmed = pattern;
+    if (r->direction == REWRITE_URL_TO_TOPIC && *trimmed == '/') {
+        trimmed++;
+    }
+    struct UrlTemplate *t =
+        url_template_compile(arrow + strlen(REWRITE_ARROW), "",
+                             r->direction == REWRITE_TOPIC_TO_URL);
+    if (!t) {
+        free(pattern);
+        return false;
+    }
+    if (!topic_trie_insert(r->trie, trimmed, t)) {
+        fprintf(stderr,
+                "config error: invalid or duplicate rewrite pattern: %s\n",
+                pattern);
+        url_template_free(t);
+        free(pattern);
+        return false;
+    }
+    free(pattern);
+    return true;
+}
+
+/* Rewrites the input with the most specific matching rule into out.
+ * Returns false if no rule matches.
+ */
+bool rewrite_apply(const RewriteRules *r, const char *input, Buffer *out,
+                   uint64_t timestamp)
+{
+    assert(r != NULL);
+    assert(input != NULL);
+    if (r->direction == REWRITE_URL_TO_TOPIC && *input == '/') {
+        input++;
+    }
+    TopicCapture captures[TOPIC_TRIE_MAX_CAPTURES];
+    int capture_count = 0;
+    const struct UrlTemplate *t =
+        topic_trie_match(r->trie, input, captures, &capture_count);
+    if (!t) {
+        return false;
+    }
+    url_template_expand(t, out, input, timestamp, captures, capture_count);
+    return true;
+}
+
+static void free_template(void *t)
+{
+    url_template_free(t);
+}
+
+void rewrite_rules_free(RewriteRules *r)
+{
+    if (!r) {
+        return;
+    }
+    topic_trie_free(r->trie, &free_template);
+    free(r);
+}
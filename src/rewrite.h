@@ -0,0 +1,50 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file rewrite.h
+ *   @brief The rewrite rules map MQTT topics to URLs, and URL paths to
+ *   MQTT topics, a'la Apache mod_rewrite. One rule is written as
+ *   "<pattern> -> <template>", where the pattern is an MQTT topic
+ *   filter ('+' and '#' wildcards, see topic_trie.h), and the template
+ *   uses the placeholders of url_template.h, {$1}, {$2}... referring
+ *   to the segments matched by the wildcards. The rules are compiled
+ *   into a trie once, when the configuration is read.
+ */
+#ifndef REWRITE_H
+#define REWRITE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+typedef enum {
+    // the input is an MQTT topic, the result is an URL
+    REWRITE_TOPIC_TO_URL,
+    // the input is an URL path, the result is an MQTT topic
+    REWRITE_URL_TO_TOPIC
+} RewriteDirection;
+
+struct RewriteRules;
+
+struct RewriteRules *rewrite_rules_new(RewriteDirection direction);
+bool rewrite_rules_add(struct RewriteRules *r, const char *rule);
+bool rewrite_apply(const struct RewriteRules *r, const char *input,
+                   Buffer *out, uint64_t timestamp);
+void rewrite_rules_free(struct RewriteRules *r);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "ring_buffer.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#define CACHELINE_SIZE 64
+
+typedef struct {
+    size_t sequence;
+    void *data;
+} RingSlot;
+
+/* the producer and consumer positions are on separate cache lines,
+ * so they don't slow down each other
+ */
+typedef struct RingBuffer {
+    RingBufferConfiguration *config;
+    RingSlot *slots;
+    size_t mask;
+    char pad0[CACHELINE_SIZE];
+    size_t enqueue_pos;
+    char pad1[CACHELINE_SIZE];
+    size_t dequeue_pos;
+    char pad2[CACHELINE_SIZE];
+    uint64_t dropped;
+    size_t max_depth;
+} RingBuffer;
+
+static bool ring_try_push(RingBuffer *rb, void *item)
+{
+    size_t pos = __atomic_load_n(&rb->enqueue_pos, __ATOMIC_RELAXED);
+    RingSlot *slot;
+    while (true) {
+        slot = &rb->slots[pos & rb->mask];
+        const size_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&rb->enqueue_pos, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&rb->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->data = item;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+RingBuffer *ring_buffer_init(RingBufferConfiguration *config)
+{
+    assert(config != NULL);
+    assert(config->capacity > 0 &&
+           config->capacity <= RING_BUFFER_MAX_CAPACITY);
+    size_t capacity = 2;
+    while (capacity < config->capacity) {
+        capacity *= 2;
+    }
+    config->capacity = capacity;
+    RingBuffer *retval = SAFEMALLOC(sizeof(RingBuffer));
+    retval->config = config;
+    retval->slots = SAFEMALLOC(capacity * sizeof(RingSlot));
+    for (size_t i = 0; i < capacity; i++) {
+        retval->slots[i].sequence = i;
+        retval->slots[i].data = NULL;
+    }
+    retval->mask = capacity - 1;
+    retval->enqueue_pos = 0;
+    retval->dequeue_pos = 0;
+    retval->dropped = 0;
+    retval->max_depth = 0;
+    return retval;
+}
+
+RingPushResult ring_buffer_push(RingBuffer *rb, void *item)
+{
+    assert(rb != NULL);
+    while (!ring_try_push(rb, item)) {
+        if (rb->config->overflow_policy == RING_OVERFLOW_BLOCK) {
+            return RING_PUSH_FULL;
+        }
+        void *dropped = item;
+        if (rb->config->overflow_policy == RING_OVERFLOW_DROP_OLDEST) {
+            dropped = ring_buffer_pop(rb);
+        }
+        if (dropped) {
+            __atomic_add_fetch(&rb->dropped, 1, __ATOMIC_RELAXED);
+            if (rb->config->drop_callback) {
+                rb->config->drop_callback(dropped,
+                                          rb->config->callback_context);
+            }
+        }
+        if (dropped == item) {
+            return RING_PUSH_DROPPED;
+        }
+    }
+    const size_t depth = ring_buffer_depth(rb);
+    if (depth > __atomic_load_n(&rb->max_depth, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rb->max_depth, depth, __ATOMIC_RELAXED);
+    }
+    return RING_PUSH_OK;
+}
+
+// returns the oldest item, or NULL if the queue is empty
+void *ring_buffer_pop(RingBuffer *rb)
+{
+    assert(rb != NULL);
+    size_t pos = __atomic_load_n(&rb->dequeue_pos, __ATOMIC_RELAXED);
+    RingSlot *slot;
+    while (true) {
+        slot = &rb->slots[pos & rb->mask];
+        const size_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&rb->dequeue_pos, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&rb->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    void *item = slot->data;
+    __atomic_store_n(&slot->sequence, pos + rb->mask + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// approximate number of queued items, exact if there is no concurrent access
+size_t ring_buffer_depth(RingBuffer *rb)
+{
+    assert(rb != NULL);
+    const size_t dequeued = __atomic_load_n(&rb->dequeue_pos, __ATOMIC_RELAXED);
+    const size_t enqueued = __atomic_load_n(&rb->enqueue_pos, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+size_t ring_buffer_capacity(RingBuffer *rb)
+{
+    assert(rb != NULL);
+    return rb->mask + 1;
+}
+
+uint64_t ring_buffer_dropped(RingBuffer *rb)
+{
+    assert(rb != NULL);
+    return __atomic_load_n(&rb->dropped, __ATOMIC_RELAXED);
+}
+
+size_t ring_buffer_max_depth(RingBuffer *rb)
+{
+    assert(rb != NULL);
+    return __atomic_load_n(&rb->max_depth, __ATOMIC_RELAXED);
+}
+
+/* the remaining items are passed to the drop callback,
+ * so they can be freed
+ */
+void ring_buffer_destroy(RingBuffer *rb)
+{
+    assert(rb != NULL);
+    void *item;
+    while ((item = ring_buffer_pop(rb))) {
+        if (rb->config->drop_callback) {
+            rb->config->drop_callback(item, rb->config->callback_context);
+        }
+    }
+    free(rb->slots);
+    free(rb);
+}
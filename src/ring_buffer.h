@@ -0,0 +1,68 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file ring_buffer.h
+ *   @brief Bounded, lock-free queue of pointers, based on the array of
+ *   sequenced slots by Dmitry Vyukov. Any number of threads can push and
+ *   pop concurrently, which allows the producer to evict the oldest
+ *   item itself. The overflow policy decides what happens when a new
+ *   item is pushed into a full queue.
+ */
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    // the push fails, the caller has to wait for the consumers
+    RING_OVERFLOW_BLOCK,
+    // the oldest queued item is evicted to make room
+    RING_OVERFLOW_DROP_OLDEST,
+    // the new item is dropped
+    RING_OVERFLOW_DROP_NEWEST
+} RingOverflowPolicy;
+
+// the biggest accepted capacity
+#define RING_BUFFER_MAX_CAPACITY (1 << 24)
+
+typedef enum { RING_PUSH_OK, RING_PUSH_FULL, RING_PUSH_DROPPED } RingPushResult;
+
+typedef struct {
+    // rounded up to the next power of 2, between 1 and
+    // RING_BUFFER_MAX_CAPACITY
+    size_t capacity;
+    RingOverflowPolicy overflow_policy;
+    void *callback_context;
+    // called with the evicted or rejected items, which are
+    // owned by the callback from that point
+    void (*drop_callback)(void *item, void *ctx);
+} RingBufferConfiguration;
+
+struct RingBuffer;
+
+struct RingBuffer *ring_buffer_init(RingBufferConfiguration *config);
+RingPushResult ring_buffer_push(struct RingBuffer *rb, void *item);
+void *ring_buffer_pop(struct RingBuffer *rb);
+size_t ring_buffer_depth(struct RingBuffer *rb);
+size_t ring_buffer_capacity(struct RingBuffer *rb);
+uint64_t ring_buffer_dropped(struct RingBuffer *rb);
+size_t ring_buffer_max_depth(struct RingBuffer *rb);
+void ring_buffer_destroy(struct RingBuffer *rb);
+
+#endif
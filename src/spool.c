@@ -0,0 +1,560 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "spool.h"
+#include "logging.h"
+#include "utils.h"
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define SPOOL_MAGIC "MQRSPOOL"
+#define SPOOL_VERSION 1
+#define SPOOL_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // end of the last record in this segment
+    uint64_t write_offset;
+    // the committed read position, only used in the oldest segment
+    uint64_t read_offset;
+} SpoolHeader;
+
+// the topic and the payload follow the record header, 8 bytes aligned
+typedef struct {
+    uint32_t length;
+    uint32_t checksum;
+    uint16_t flags;
+    uint16_t topic_len;
+    uint32_t payload_len;
+    uint64_t timestamp;
+} SpoolRecord;
+
+typedef struct {
+    uint64_t seq;
+    int fd;
+    char *map;
+    // the size of the file, the existing segments may have been created
+    // with another segment_size
+    size_t size;
+} SpoolSegment;
+
+typedef struct Spool {
+    SpoolConfiguration *config;
+    pthread_mutex_t mutex;
+    char *path;
+    // the segments on the disk are first_seq..write.seq
+    uint64_t first_seq;
+    SpoolSegment write;
+    SpoolSegment read;
+    SpoolPosition cursor;
+    SpoolPosition committed;
+    bool committed_dirty;
+    bool dirty;
+    uint64_t last_sync;
+    uint64_t pending;
+    uint64_t rejected;
+    // to warn only once when the spool gets full
+    bool full;
+    // set when records were dropped from a corrupt segment
+    bool recount;
+} Spool;
+
+static uint32_t spool_checksum(const char *data, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void segment_path(Spool *s, uint64_t seq, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%016" PRIx64 ".seg", s->path, seq);
+}
+
+static bool segment_open(Spool *s, SpoolSegment *seg, uint64_t seq,
+                         bool create)
+{
+    char path[PATH_MAX];
+    segment_path(s, seq, path);
+    seg->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (seg->fd < 0) {
+        ERROR("Unit [%s]: failed to open spool segment %s: %s",
+              s->config->label, path, strerror(errno));
+        return false;
+    }
+    if (create && ftruncate(seg->fd, s->config->segment_size)) {
+        ERROR("Unit [%s]: failed to resize spool segment %s: %s",
+              s->config->label, path, strerror(errno));
+        close(seg->fd);
+        unlink(path);
+        return false;
+    }
+    seg->size = s->config->segment_size;
+    struct stat st;
+    if (!create) {
+        if (fstat(seg->fd, &st) || st.st_size < (off_t)sizeof(SpoolHeader)) {
+            ERROR("Unit [%s]: invalid spool segment %s", s->config->label,
+                  path);
+            close(seg->fd);
+            return false;
+        }
+        seg->size = st.st_size;
+    }
+    seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        ERROR("Unit [%s]: failed to map spool segment %s: %s",
+              s->config->label, path, strerror(errno));
+        close(seg->fd);
+        return false;
+    }
+    seg->seq = seq;
+    SpoolHeader *header = (SpoolHeader *)seg->map;
+    if (create) {
+        memcpy(header->magic, SPOOL_MAGIC, sizeof(header->magic));
+        header->version = SPOOL_VERSION;
+        header->write_offset = sizeof(SpoolHeader);
+        header->read_offset = sizeof(SpoolHeader);
+    } else if (memcmp(header->magic, SPOOL_MAGIC, sizeof(header->magic)) ||
+               header->version != SPOOL_VERSION ||
+               header->write_offset > seg->size ||
+               header->read_offset > header->write_offset) {
+        ERROR("Unit [%s]: invalid spool segment %s", s->config->label, path);
+        munmap(seg->map, seg->size);
+        close(seg->fd);
+        return false;
+    }
+    return true;
+}
+
+static void segment_close(Spool *s, SpoolSegment *seg)
+{
+    if (seg->fd < 0) {
+        return;
+    }
+    munmap(seg->map, seg->size);
+    close(seg->fd);
+    seg->fd = -1;
+    seg->map = NULL;
+}
+
+// returns the mapping of the segment, mapping it for reading if needed
+static char *segment_map(Spool *s, uint64_t seq)
+{
+    if (seq == s->write.seq) {
+        return s->write.map;
+    }
+    if (s->read.fd < 0 || s->read.seq != seq) {
+        segment_close(s, &s->read);
+        if (!segment_open(s, &s->read, seq, false)) {
+            return NULL;
+        }
+    }
+    return s->read.map;
+}
+
+/* returns the record at the position, or NULL if there are no
+ * more (valid) records in the segment. The segment is truncated at a
+ * corrupt record, so the records appended later are still read, and
+ * the pending records need to be counted again.
+ */
+static SpoolRecord *record_at(Spool *s, char *map, uint64_t seq,
+                              size_t offset)
+{
+    SpoolHeader *header = (SpoolHeader *)map;
+    if (offset + sizeof(SpoolRecord) > header->write_offset) {
+        return NULL;
+    }
+    SpoolRecord *r = (SpoolRecord *)(map + offset);
+    const size_t data_len = (size_t)r->topic_len + r->payload_len;
+    if (r->length != SPOOL_ALIGN(sizeof(SpoolRecord) + data_len) ||
+        offset + r->length > header->write_offset ||
+        r->checksum != spool_checksum((char *)(r + 1), data_len)) {
+        ERROR("Unit [%s]: corrupt spool record in segment %" PRIu64
+              " at %zu, dropping the rest of the segment",
+              s->config->label, seq, offset);
+        header->write_offset = offset;
+        s->dirty = true;
+        s->recount = true;
+        return NULL;
+    }
+    return r;
+}
+
+// counts the records from the committed position, after startup
+static void count_pending(Spool *s)
+{
+    s->pending = 0;
+    for (uint64_t seq = s->first_seq; seq <= s->write.seq; seq++) {
+        char *map = segment_map(s, seq);
+        if (!map) {
+            continue;
+        }
+        size_t offset = seq == s->committed.segment ? s->committed.offset
+                                                    : sizeof(SpoolHeader);
+        SpoolRecord *r;
+        while ((r = record_at(s, map, seq, offset))) {
+            offset += r->length;
+            s->pending++;
+        }
+    }
+    // the corrupt records found meanwhile are already dropped
+    s->recount = false;
+}
+
+static bool spool_open_dir(Spool *s)
+{
+    DIR *dir = opendir(s->path);
+    if (!dir) {
+        ERROR("Unit [%s]: failed to open spool directory %s: %s",
+              s->config->label, s->path, strerror(errno));
+        return false;
+    }
+    bool found = false;
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        uint64_t seq;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%16" SCNx64 ".%4s", &seq, suffix) == 2 &&
+            !strcmp(suffix, "seg")) {
+            found = true;
+            first = seq < first ? seq : first;
+            last = seq > last ? seq : last;
+        }
+    }
+    closedir(dir);
+
+    if (!found) {
+        s->first_seq = 0;
+        return segment_open(s, &s->write, 0, true);
+    }
+    s->first_seq = first;
+    if (!segment_open(s, &s->write, last, false)) {
+        return false;
+    }
+    char *map = segment_map(s, first);
+    if (!map) {
+        return false;
+    }
+    s->committed.segment = first;
+    s->committed.offset = ((SpoolHeader *)map)->read_offset;
+    count_pending(s);
+    INFO("Unit [%s]: found %" PRIu64 " spooled messages in %s",
+         s->config->label, s->pending, s->path);
+    return true;
+}
+
+static void mkdir_if_missing(const char *path)
+{
+    if (mkdir(path, 0700) && errno != EEXIST) {
+        ERROR("Failed to create directory %s: %s", path, strerror(errno));
+    }
+}
+
+Spool *spool_init(SpoolConfiguration *config)
+{
+    assert(config != NULL);
+    if (config->segment_size < 2 * sizeof(SpoolHeader) ||
+        config->max_size < config->segment_size) {
+        ERROR("Unit [%s]: invalid spool sizes", config->label);
+        return NULL;
+    }
+    Spool *retval = SAFEMALLOC(sizeof(Spool));
+    retval->config = config;
+    pthread_mutex_init(&retval->mutex, NULL);
+    retval->path = SAFEMALLOC(strlen(config->dir) + strlen(config->label) + 2);
+    sprintf(retval->path, "%s/%s", config->dir, config->label);
+    mkdir_if_missing(config->dir);
+    mkdir_if_missing(retval->path);
+
+    retval->write.fd = -1;
+    retval->read.fd = -1;
+    retval->committed.segment = 0;
+    retval->committed.offset = sizeof(SpoolHeader);
+    retval->committed_dirty = false;
+    retval->dirty = false;
+    retval->last_sync = monotonic_ms();
+    retval->pending = 0;
+    retval->rejected = 0;
+    retval->full = false;
+    retval->recount = false;
+    if (!spool_open_dir(retval)) {
+        spool_destroy(retval);
+        return NULL;
+    }
+    retval->cursor = retval->committed;
+    return retval;
+}
+
+// starts a new segment, if the size limit allows it
+static bool spool_rotate(Spool *s)
+{
+    const uint64_t segments = s->write.seq - s->first_seq + 1;
+    if ((segments + 1) * s->config->segment_size > s->config->max_size) {
+        return false;
+    }
+    SpoolSegment next;
+    if (!segment_open(s, &next, s->write.seq + 1, true)) {
+        return false;
+    }
+    msync(s->write.map, s->write.size, MS_ASYNC);
+    segment_close(s, &s->write);
+    s->write = next;
+    return true;
+}
+
+bool spool_append(Spool *s, const Message *msg)
+{
+    assert(s != NULL);
+    const size_t topic_len = strlen(msg->topic);
+    const size_t length =
+        SPOOL_ALIGN(sizeof(SpoolRecord) + topic_len + msg->payload_len);
+    if (length > s->config->segment_size - sizeof(SpoolHeader) ||
+        topic_len > UINT16_MAX) {
+        ERROR("Unit [%s]: message on topic %s is too large for the spool",
+              s->config->label, msg->topic);
+        __atomic_add_fetch(&s->rejected, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    SpoolHeader *header = (SpoolHeader *)s->write.map;
+    if (header->write_offset + length > s->write.size) {
+        if (!spool_rotate(s)) {
+            if (!s->full) {
+                WARNING("Unit [%s]: spool is full, dropping the messages "
+                        "until there is room again",
+                        s->config->label);
+            }
+            s->full = true;
+            pthread_mutex_unlock(&s->mutex);
+            __atomic_add_fetch(&s->rejected, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        header = (SpoolHeader *)s->write.map;
+    }
+    SpoolRecord *r = (SpoolRecord *)(s->write.map + header->write_offset);
+    char *data = (char *)(r + 1);
+    memcpy(data, msg->topic, topic_len);
+    if (msg->payload_len) {
+        memcpy(data + topic_len, msg->payload, msg->payload_len);
+    }
+    r->length = length;
+    r->checksum = spool_checksum(data, topic_len + msg->payload_len);
+    r->flags = msg->flags;
+    r->topic_len = topic_len;
+    r->payload_len = msg->payload_len;
+    r->timestamp = msg->timestamp;
+    header->write_offset += length;
+    s->pending++;
+    s->dirty = true;
+    s->full = false;
+    pthread_mutex_unlock(&s->mutex);
+    return true;
+}
+
+/* returns a copy of the next record after the read cursor, or NULL
+ * if there is nothing more to read. pos is set to the end of the
+ * record, to be passed to spool_commit() after it was delivered
+ */
+Message *spool_read(Spool *s, SpoolPosition *pos)
+{
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    Message *msg = NULL;
+    while (!msg) {
+        char *map = segment_map(s, s->cursor.segment);
+        SpoolRecord *r =
+            map ? record_at(s, map, s->cursor.segment, s->cursor.offset)
+                : NULL;
+        if (!r) {
+            if (s->cursor.segment >= s->write.seq) {
+                break;
+            }
+            // continuing in the next segment
+            s->cursor.segment++;
+            s->cursor.offset = sizeof(SpoolHeader);
+            continue;
+        }
+        char *data = (char *)(r + 1);
+        char topic[UINT16_MAX + 1];
+        memcpy(topic, data, r->topic_len);
+        topic[r->topic_len] = '\0';
+        msg = message_new(topic, data + r->topic_len, r->payload_len);
+        msg->timestamp = r->timestamp;
+        msg->flags = r->flags;
+        s->cursor.offset += r->length;
+        *pos = s->cursor;
+    }
+    // the dropped records are not pending anymore, otherwise the
+    // sender would wait for them forever
+    if (s->recount) {
+        count_pending(s);
+        WARNING("Unit [%s]: %" PRIu64 " spooled messages left after "
+                "dropping the corrupt records",
+                s->config->label, s->pending);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return msg;
+}
+
+/* marks the oldest uncommitted record as delivered, pos is its end
+ * position. The segments which were completely delivered are removed.
+ */
+void spool_commit(Spool *s, SpoolPosition pos)
+{
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    while (s->first_seq < pos.segment) {
+        char path[PATH_MAX];
+        segment_path(s, s->first_seq, path);
+        if (s->read.seq == s->first_seq) {
+            segment_close(s, &s->read);
+        }
+        unlink(path);
+        s->first_seq++;
+    }
+    s->committed = pos;
+    s->committed_dirty = true;
+    if (s->pending) {
+        s->pending--;
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
+
+// moves the read cursor back to the last committed record
+void spool_rewind(Spool *s)
+{
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    s->cursor = s->committed;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+uint64_t spool_pending(Spool *s)
+{
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    const uint64_t pending = s->pending;
+    pthread_mutex_unlock(&s->mutex);
+    return pending;
+}
+
+uint64_t spool_rejected(Spool *s)
+{
+    assert(s != NULL);
+    return __atomic_load_n(&s->rejected, __ATOMIC_RELAXED);
+}
+
+/* the committed read position is stored in the header of the first
+ * segment, which is usually not mapped, so it's written with pwrite()
+ */
+static void spool_sync_committed(Spool *s)
+{
+    const uint64_t offset = s->committed.offset;
+    const size_t field = offsetof(SpoolHeader, read_offset);
+    if (s->committed.segment == s->write.seq) {
+        ((SpoolHeader *)s->write.map)->read_offset = offset;
+        return;
+    }
+    char path[PATH_MAX];
+    segment_path(s, s->committed.segment, path);
+    const int fd = open(path, O_WRONLY);
+    if (fd < 0 || pwrite(fd, &offset, sizeof(offset), field) < 0 ||
+        fdatasync(fd)) {
+        ERROR("Unit [%s]: failed to store the spool read position in %s: %s",
+              s->config->label, path, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* flushing the appended records and the read position to the disk,
+ * if the sync interval elapsed since the last one, or if forced
+ */
+void spool_sync(Spool *s, bool force)
+{
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    const uint64_t now = monotonic_ms();
+    const uint64_t interval = s->config->sync_interval_ms;
+    if ((s->dirty || s->committed_dirty) &&
+        (force || now - s->last_sync >= interval)) {
+        if (s->committed_dirty) {
+            spool_sync_committed(s);
+        }
+        if (msync(s->write.map, s->write.size, MS_SYNC)) {
+            ERROR("Unit [%s]: failed to sync spool: %s", s->config->label,
+                  strerror(errno));
+        }
+        s->dirty = false;
+        s->committed_dirty = false;
+        s->last_sync = now;
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
+
+// returns the time until the next sync is due, or -1 if nothing to sync
+int spool_get_timeout(Spool *s)
+{
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    int timeout = -1;
+    if (s->dirty || s->committed_dirty) {
+        const uint64_t due = s->last_sync + s->config->sync_interval_ms;
+        const uint64_t now = monotonic_ms();
+        timeout = due > now ? (int)(due - now) : 0;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return timeout;
+}
+
+void spool_destroy(Spool *s)
+{
+    assert(s != NULL);
+    if (s->write.fd >= 0) {
+        spool_sync(s, true);
+    }
+    segment_close(s, &s->read);
+    segment_close(s, &s->write);
+    pthread_mutex_destroy(&s->mutex);
+    free(s->path);
+    free(s);
+}
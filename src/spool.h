@@ -0,0 +1,64 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file spool.h
+ *   @brief Disk backed, append-only store for the messages which could
+ *   not be delivered. The records are written into memory mapped
+ *   segment files of fixed size under <dir>/<unit name>/, and read back
+ *   in the same order. The reading is a two step process: records are
+ *   read ahead with spool_read(), and committed with spool_commit() once
+ *   delivered, so the ones in flight are not lost if we crash. The
+ *   committed position and the appended records are synced to the disk
+ *   at most once per sync interval, so the cost of msync() is shared by
+ *   many records.
+ */
+#ifndef SPOOL_H
+#define SPOOL_H
+#include "message.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char *label;
+    const char *dir;
+    size_t max_size;
+    size_t segment_size;
+    int sync_interval_ms;
+} SpoolConfiguration;
+
+// position right after a record, as returned by spool_read()
+typedef struct {
+    uint64_t segment;
+    size_t offset;
+} SpoolPosition;
+
+struct Spool;
+
+struct Spool *spool_init(SpoolConfiguration *config);
+bool spool_append(struct Spool *s, const Message *msg);
+Message *spool_read(struct Spool *s, SpoolPosition *pos);
+void spool_commit(struct Spool *s, SpoolPosition pos);
+void spool_rewind(struct Spool *s);
+uint64_t spool_pending(struct Spool *s);
+uint64_t spool_rejected(struct Spool *s);
+void spool_sync(struct Spool *s, bool force);
+int spool_get_timeout(struct Spool *s);
+void spool_destroy(struct Spool *s);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "topic_trie.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* One segment of the patterns. The literal children are sorted by
+ * their segment, so they can be binary searched
+ */
+typedef struct TrieNode {
+    char *segment;
+    size_t segment_len;
+    struct TrieNode **children;
+    int child_count;
+    struct TrieNode *plus;
+    struct TrieNode *hash;
+    // the value of the pattern ending here, NULL if none
+    void *value;
+} TrieNode;
+
+typedef struct TopicTrie {
+    TrieNode root;
+} TopicTrie;
+
+static int segment_cmp(const char *a, size_t a_len, const char *b,
+                       size_t b_len)
+{
+    const int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (ret || a_len == b_len) {
+        return ret;
+    }
+    return a_len < b_len ? -1 : 1;
+}
+
+// returns the index of the child, or where it should be inserted
+static int find_child(const TrieNode *node, const char *segment, size_t len,
+                      bool *found)
+{
+    int low = 0;
+    int high = node->child_count;
+    while (low < high) {
+        const int mid = (low + high) / 2;
+        const TrieNode *child = node->children[mid];
+        const int cmp =
+            segment_cmp(child->segment, child->segment_len, segment, len);
+        if (!cmp) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *found = false;
+    return low;
+}
+
+static TrieNode *node_new(const char *segment, size_t len)
+{
+    TrieNode *node = SAFEMALLOC(sizeof(TrieNode));
+    memset(node, 0, sizeof(TrieNode));
+    node->segment = SAFEMALLOC(len + 1);
+    memcpy(node->segment, segment, len);
+    node->segment[len] = '\0';
+    node->segment_len = len;
+    return node;
+}
+
+static void node_free(TrieNode *node, void (*free_value)(void *))
+{
+    for (int i = 0; i < node->child_count; i++) {
+        node_free(node->children[i], free_value);
+    }
+    if (node->plus) {
+        node_free(node->plus, free_value);
+    }
+    if (node->hash) {
+        node_free(node->hash, free_value);
+    }
+    if (node->value && free_value) {
+        free_value(node->value);
+    }
+    free(node->children);
+    free(node->segment);
+    free(node);
+}
+
+TopicTrie *topic_trie_new()
+{
+    TopicTrie *t = SAFEMALLOC(sizeof(TopicTrie));
+    memset(t, 0, sizeof(TopicTrie));
+    return t;
+}
+
+/* Adds the pattern to the trie. Returns false if the pattern is
+ * invalid ('#' not as the last segment, wildcards mixed with other
+ * characters in a segment, or too many wildcards) or it's already added.
+ */
+static bool pattern_valid(const char *pattern)
+{
+    int wildcards = 0;
+    const char *segment = pattern;
+    while (true) {
+        const size_t len = strcspn(segment, "/");
+        const bool last = segment[len] == '\0';
+        if (memchr(segment, '+', len) || memchr(segment, '#', len)) {
+            if (len != 1 || ++wildcards > TOPIC_TRIE_MAX_CAPTURES ||
+                (*segment == '#' && !last)) {
+                return false;
+            }
+        }
+        if (last) {
+            return true;
+        }
+        segment += len + 1;
+    }
+}
+
+bool topic_trie_insert(TopicTrie *t, const char *pattern, void *value)
+{
+    assert(t != NULL);
+    assert(pattern != NULL);
+    assert(value != NULL);
+    if (!pattern_valid(pattern)) {
+        return false;
+    }
+    TrieNode *node = &t->root;
+    const char *segment = pattern;
+    while (true) {
+        const size_t len = strcspn(segment, "/");
+        const bool last = segment[len] == '\0';
+        const bool has_wildcard = len == 1 && (*segment == '+' ||
+                                               *segment == '#');
+        TrieNode **next = NULL;
+        if (has_wildcard && *segment == '#') {
+            next = &node->hash;
+        } else if (has_wildcard) {
+            next = &node->plus;
+        }
+        if (next) {
+            if (!*next) {
+                *next = node_new(segment, len);
+            }
+            node = *next;
+        } else {
+            bool found;
+            const int i = find_child(node, segment, len, &found);
+            if (!found) {
+                node->children =
+                    SAFEREALLOC(node->children, (node->child_count + 1) *
+                                                    sizeof(TrieNode *));
+                memmove(node->children + i + 1, node->children + i,
+                        (node->child_count - i) * sizeof(TrieNode *));
+                node->children[i] = node_new(segment, len);
+                node->child_count++;
+            }
+            node = node->children[i];
+        }
+        if (last) {
+            break;
+        }
+        segment += len + 1;
+    }
+    if (node->value) {
+        return false;
+    }
+    node->value = value;
+    return true;
+}
+
+// depth first search, trying the more specific branches first
+static void *match_node(const TrieNode *node, const char *segment,
+                        TopicCapture *captures, int depth)
+{
+    if (!segment) {
+        if (node->value) {
+            return node->value;
+        }
+        // a '#' also matches the parent level
+        if (node->hash && depth < TOPIC_TRIE_MAX_CAPTURES) {
+            captures[depth].start = "";
+            captures[depth].length = 0;
+            return node->hash->value;
+        }
+        return NULL;
+    }
+    const size_t len = strcspn(segment, "/");
+    const char *next = segment[len] ? segment + len + 1 : NULL;
+    bool found;
+    const int i = find_child(node, segment, len, &found);
+    if (found) {
+        void *value = match_node(node->children[i], next, captures, depth);
+        if (value) {
+            return value;
+        }
+    }
+    if (node->plus && depth < TOPIC_TRIE_MAX_CAPTURES) {
+        void *value = match_node(node->plus, next, captures, depth + 1);
+        if (value) {
+            captures[depth].start = segment;
+            captures[depth].length = len;
+            return value;
+        }
+    }
+    if (node->hash && depth < TOPIC_TRIE_MAX_CAPTURES) {
+        captures[depth].start = segment;
+        captures[depth].length = strlen(segment);
+        return node->hash->value;
+    }
+    return NULL;
+}
+
+/* Returns the value of the most specific pattern matching the topic,
+ * or NULL. The wildcard matches are put into captures, which needs
+ * space for TOPIC_TRIE_MAX_CAPTURES items.
+ */
+void *topic_trie_match(const TopicTrie *t, const char *topic,
+                       TopicCapture *captures, int *capture_count)
+{
+    assert(t != NULL);
+    assert(topic != NULL);
+    assert(captures != NULL);
+    TopicCapture found[TOPIC_TRIE_MAX_CAPTURES + 1];
+    memset(found, 0, sizeof(found));
+    void *value = match_node(&t->root, topic, found, 0);
+    if (!value) {
+        return NULL;
+    }
+    // the number of captures is the depth of the wildcards on the path,
+    // which is not known until the match is complete
+    int count = 0;
+    while (count < TOPIC_TRIE_MAX_CAPTURES && found[count].start) {
+        captures[count] = found[count];
+        count++;
+    }
+    if (capture_count) {
+        *capture_count = count;
+    }
+    return value;
+}
+
+static void match_all_node(const TrieNode *node, const char *segment,
+                           void (*visit)(void *value, void *ctx), void *ctx)
+{
+    // a '#' matches the rest of the topic, including the parent level
+    if (node->hash && node->hash->value) {
+        visit(node->hash->value, ctx);
+    }
+    if (!segment) {
+        if (node->value) {
+            visit(node->value, ctx);
+        }
+        return;
+    }
+    const size_t len = strcspn(segment, "/");
+    const char *next = segment[len] ? segment + len + 1 : NULL;
+    bool found;
+    const int i = find_child(node, segment, len, &found);
+    if (found) {
+        match_all_node(node->children[i], next, visit, ctx);
+    }
+    if (node->plus) {
+        match_all_node(node->plus, next, visit, ctx);
+    }
+}
+
+/* Calls visit with the value of every pattern matching the topic,
+ * in no particular order
+ */
+void topic_trie_match_all(const TopicTrie *t, const char *topic,
+                          void (*visit)(void *value, void *ctx), void *ctx)
+{
+    assert(t != NULL);
+    assert(topic != NULL);
+    assert(visit != NULL);
+    match_all_node(&t->root, topic, visit, ctx);
+}
+
+void topic_trie_free(TopicTrie *t, void (*free_value)(void *))
+{
+    if (!t) {
+        return;
+    }
+    for (int i = 0; i < t->root.child_count; i++) {
+        node_free(t->root.children[i], free_value);
+    }
+    if (t->root.plus) {
+        node_free(t->root.plus, free_value);
+    }
+    if (t->root.hash) {
+        node_free(t->root.hash, free_value);
+    }
+    if (t->root.value && free_value) {
+        free_value(t->root.value);
+    }
+    free(t->root.children);
+    free(t);
+}
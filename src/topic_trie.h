@@ -0,0 +1,52 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file topic_trie.h
+ *   @brief The topic trie maps MQTT style topic patterns to values.
+ *   The patterns are split into '/' separated segments, each level of
+ *   the trie is one segment. '+' matches exactly one segment, '#' at
+ *   the end matches any number of them, including none. The segments
+ *   matched by the wildcards are captured. Looking up a topic costs the
+ *   same regardless of the number of patterns, as only the children
+ *   matching the next segment are visited. If more patterns match, the
+ *   most specific one wins: a literal segment before '+', '+' before '#'.
+ *   topic_trie_match_all() visits all the matching patterns instead.
+ */
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TOPIC_TRIE_MAX_CAPTURES 9
+
+typedef struct {
+    const char *start;
+    size_t length;
+} TopicCapture;
+
+struct TopicTrie;
+
+struct TopicTrie *topic_trie_new();
+bool topic_trie_insert(struct TopicTrie *t, const char *pattern, void *value);
+void *topic_trie_match(const struct TopicTrie *t, const char *topic,
+                       TopicCapture *captures, int *capture_count);
+void topic_trie_match_all(const struct TopicTrie *t, const char *topic,
+                          void (*visit)(void *value, void *ctx), void *ctx);
+void topic_trie_free(struct TopicTrie *t, void (*free_value)(void *));
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ */
+
+#include "url_template.h"
+#include "logging.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    URL_PART_LITERAL,
+    URL_PART_SUBTOPIC,
+    URL_PART_SUBTOPIC_RAW,
+    URL_PART_TOPIC,
+    URL_PART_SEGMENT,
+    URL_PART_CAPTURE,
+    URL_PART_TIMESTAMP
+} UrlPartType;
+
+typedef struct {
+    UrlPartType type;
+    char *literal;
+    size_t literal_len;
+    // the index of the segment or the capture, 1 based
+    int segment;
+} UrlPart;
+
+typedef struct UrlTemplate {
+    UrlPart *parts;
+    int part_count;
+    size_t prefix_len;
+    bool encode;
+} UrlTemplate;
+
+static const struct {
+    const char *name;
+    UrlPartType type;
+} placeholders[] = {{"subtopic", URL_PART_SUBTOPIC},
+                    {"subtopic_raw", URL_PART_SUBTOPIC_RAW},
+                    {"topic", URL_PART_TOPIC},
+                    {"timestamp", URL_PART_TIMESTAMP}};
+
+static UrlPart *add_part(UrlTemplate *t, UrlPartType type)
+{
+    t->parts = SAFEREALLOC(t->parts, (t->part_count + 1) * sizeof(UrlPart));
+    UrlPart *part = &t->parts[t->part_count++];
+    part->type = type;
+    part->literal = NULL;
+    part->literal_len = 0;
+    part->segment = 0;
+    return part;
+}
+
+// appending to the last literal part, or starting a new one
+static void add_literal(UrlTemplate *t, const char *text, size_t len)
+{
+    UrlPart *part = t->part_count ? &t->parts[t->part_count - 1] : NULL;
+    if (!part || part->type != URL_PART_LITERAL) {
+        part = add_part(t, URL_PART_LITERAL);
+    }
+    part->literal = SAFEREALLOC(part->literal, part->literal_len + len + 1);
+    memcpy(part->literal + part->literal_len, text, len);
+    part->literal_len += len;
+    part->literal[part->literal_len] = '\0';
+}
+
+/* Compiles the pattern, the topic prefix is the subscribed topic,
+ * which is cut from the beginning of the topic for {subtopic}.
+ * Returns NULL if the pattern is invalid.
+ */
+UrlTemplate *url_template_compile(const char *pattern,
+                                  const char *topic_prefix, bool encode)
+{
+    assert(pattern != NULL);
+    assert(topic_prefix != NULL);
+    UrlTemplate *t = SAFEMALLOC(sizeof(UrlTemplate));
+    t->parts = NULL;
+    t->part_count = 0;
+    t->prefix_len = strlen(topic_prefix);
+    t->encode = encode;
+    const char *p = pattern;
+    while (*p) {
+        const char *brace = strchr(p, '{');
+        if (!brace) {
+            add_literal(t, p, strlen(p));
+            break;
+        }
+        add_literal(t, p, brace - p);
+        if (brace[1] == '{') {
+            add_literal(t, "{", 1);
+            p = brace + 2;
+            continue;
+        }
+        const char *end = strchr(brace, '}');
+        if (!end) {
+            fprintf(stderr, "config error: unterminated placeholder in %s\n",
+                    pattern);
+            url_template_free(t);
+            return NULL;
+        }
+        const char *name = brace + 1;
+        const size_t name_len = end - name;
+        bool found = false;
+        for (size_t i = 0; i < sizeof(placeholders) / sizeof(placeholders[0]);
+             i++) {
+            if (strlen(placeholders[i].name) == name_len &&
+                !strncmp(name, placeholders[i].name, name_len)) {
+                add_part(t, placeholders[i].type);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            const bool capture = *name == '$';
+            const int max = capture ? TOPIC_TRIE_MAX_CAPTURES : 255;
+            char *num_end;
+            const long index = strtol(name + capture, &num_end, 10);
+            if (num_end != end || index < 1 || index > max) {
+                fprintf(stderr, "config error: unknown placeholder %.*s\n",
+                        (int)name_len, name);
+                url_template_free(t);
+                return NULL;
+            }
+            add_part(t, capture ? URL_PART_CAPTURE : URL_PART_SEGMENT)
+                ->segment = index;
+        }
+        p = end + 1;
+    }
+    return t;
+}
+
+/* the template used without an explicit pattern: the topic
+ * without the prefix is appended to the base url as it is
+ */
+UrlTemplate *url_template_default(const char *base_url,
+                                  const char *topic_prefix)
+{
+    assert(base_url != NULL);
+    UrlTemplate *t = url_template_compile("", topic_prefix, true);
+    size_t len = strlen(base_url);
+    add_literal(t, base_url, len);
+    if (!len || base_url[len - 1] != '/') {
+        add_literal(t, "/", 1);
+    }
+    add_part(t, URL_PART_SUBTOPIC_RAW);
+    return t;
+}
+
+// percent-encoding everything except the unreserved characters
+static void append_encoded(const UrlTemplate *t, Buffer *out,
+                           const char *text, size_t len, bool keep_slash)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    if (!t->encode) {
+        buffer_append(out, text, len);
+        return;
+    }
+    buffer_reserve(out, out->length + len);
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char c = text[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+            c == '~' || (c == '/' && keep_slash)) {
+            continue;
+        }
+        buffer_append(out, text + start, i - start);
+        start = i + 1;
+        const char esc[3] = {'%', hex[c >> 4], hex[c & 0xf]};
+        buffer_append(out, esc, 3);
+    }
+    buffer_append(out, text + start, len - start);
+}
+
+// appending the n-th (1 based) segment of the topic, if there is one
+static void append_segment(const UrlTemplate *t, Buffer *out,
+                           const char *topic, int segment)
+{
+    const char *start = topic;
+    while (--segment) {
+        start = strchr(start, '/');
+        if (!start) {
+            return;
+        }
+        start++;
+    }
+    append_encoded(t, out, start, strcspn(start, "/"), false);
+}
+
+/* Assembles the url of the message into out, replacing its content.
+ * The buffer grows as needed, so nothing is truncated.
+ */
+void url_template_expand(const UrlTemplate *t, Buffer *out, const char *topic,
+                         uint64_t timestamp, const TopicCapture *captures,
+                         int capture_count)
+{
+    assert(t != NULL);
+    assert(out != NULL);
+    buffer_clear(out);
+    // skipping the prefix and the separating '/', if the topic has them
+    const size_t topic_len = strlen(topic);
+    const char *subtopic = topic + topic_len;
+    if (!t->prefix_len) {
+        subtopic = topic;
+    } else if (topic_len > t->prefix_len) {
+        subtopic = topic + t->prefix_len + 1;
+    }
+    const size_t subtopic_len = topic + topic_len - subtopic;
+    for (int i = 0; i < t->part_count; i++) {
+        const UrlPart *part = &t->parts[i];
+        switch (part->type) {
+        case URL_PART_LITERAL:
+            buffer_append(out, part->literal, part->literal_len);
+            break;
+        case URL_PART_SUBTOPIC:
+            append_encoded(t, out, subtopic, subtopic_len, true);
+            break;
+        case URL_PART_SUBTOPIC_RAW:
+            buffer_append(out, subtopic, subtopic_len);
+            break;
+        case URL_PART_TOPIC:
+            append_encoded(t, out, topic, topic_len, true);
+            break;
+        case URL_PART_SEGMENT:
+            append_segment(t, out, topic, part->segment);
+            break;
+        case URL_PART_CAPTURE:
+            if (part->segment <= capture_count) {
+                const TopicCapture *c = &captures[part->segment - 1];
+                append_encoded(t, out, c->start, c->length, true);
+            }
+            break;
+        case URL_PART_TIMESTAMP: {
+            char number[24];
+            const int len = snprintf(number, sizeof(number), "%" PRIu64,
+                                     timestamp);
+            buffer_append(out, number, len);
+            break;
+        }
+        }
+    }
+    // an empty result is still a valid, NUL terminated string
+    buffer_append(out, "", 0);
+}
+
+void url_template_free(UrlTemplate *t)
+{
+    if (!t) {
+        return;
+    }
+    for (int i = 0; i < t->part_count; i++) {
+        free(t->parts[i].literal);
+    }
+    free(t->parts);
+    free(t);
+}
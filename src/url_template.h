@@ -0,0 +1,55 @@
+/*
+ *  This file is part of mqrestt.
+ *
+ *  Mqrestt is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mqrestt is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with mqrestt.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *   Copyright  Zoltan Gyarmati <zgyarmati@zgyarmati.de> 2021
+ *
+ *   @file url_template.h
+ *   @brief The url template describes how the URL of the POST request
+ *   is assembled from the topic of the MQTT message. It's compiled once
+ *   from the configuration, and expanded for each message in one pass
+ *   into a reusable buffer. The placeholders:
+ *   {subtopic}: the topic without the subscribed prefix, with each
+ *   segment percent-encoded
+ *   {subtopic_raw}: the same without encoding
+ *   {topic}: the whole topic, with each segment percent-encoded
+ *   {1}, {2}...: one segment of the whole topic, percent-encoded
+ *   {timestamp}: the arrival time of the message, ms since the epoch
+ *   {$1}, {$2}...: the segments captured by the wildcards of a
+ *   rewrite rule, percent-encoded
+ *   A literal '{' is written as "{{". The same templates are used for
+ *   assembling MQTT topics, in that case nothing is encoded.
+ */
+#ifndef URL_TEMPLATE_H
+#define URL_TEMPLATE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "topic_trie.h"
+#include "utils.h"
+
+struct UrlTemplate;
+
+struct UrlTemplate *url_template_compile(const char *pattern,
+                                         const char *topic_prefix,
+                                         bool encode);
+struct UrlTemplate *url_template_default(const char *base_url,
+                                         const char *topic_prefix);
+void url_template_expand(const struct UrlTemplate *t, Buffer *out,
+                         const char *topic, uint64_t timestamp,
+                         const TopicCapture *captures, int capture_count);
+void url_template_free(struct UrlTemplate *t);
+
+#endif
@@ -19,6 +19,8 @@
 
 #include "utils.h"
 #include "stdio.h"
+#include <string.h>
+#include <time.h>
 
 bool parseInt(const char *str, int *val)
 {
@@ -55,3 +57,66 @@ void *safe_realloc(void *ptr, size_t n, unsigned long line)
     }
     return p;
 }
+
+uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t realtime_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void buffer_init(Buffer *b)
+{
+    b->data = NULL;
+    b->length = 0;
+    b->capacity = 0;
+}
+
+// making sure there is room for size bytes plus the terminating NUL,
+// growing by doubling to keep the appends amortized O(1)
+void buffer_reserve(Buffer *b, size_t size)
+{
+    if (size + 1 <= b->capacity) {
+        return;
+    }
+    size_t capacity = b->capacity ? b->capacity : 64;
+    while (capacity < size + 1) {
+        capacity *= 2;
+    }
+    b->data = SAFEREALLOC(b->data, capacity);
+    b->capacity = capacity;
+}
+
+void buffer_append(Buffer *b, const void *data, size_t len)
+{
+    buffer_reserve(b, b->length + len);
+    memcpy(b->data + b->length, data, len);
+    b->length += len;
+    b->data[b->length] = '\0';
+}
+
+void buffer_append_str(Buffer *b, const char *str)
+{
+    buffer_append(b, str, strlen(str));
+}
+
+void buffer_clear(Buffer *b)
+{
+    b->length = 0;
+    if (b->data) {
+        b->data[0] = '\0';
+    }
+}
+
+void buffer_free(Buffer *b)
+{
+    free(b->data);
+    buffer_init(b);
+}
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
@@ -32,4 +33,25 @@ void *safe_malloc(size_t n, unsigned long line);
 void *safe_realloc(void *ptr, size_t n, unsigned long line);
 #define SAFEREALLOC(ptr, n) safe_realloc(ptr, n, __LINE__)
 
+// milliseconds from the monotonic clock, for timeouts and deadlines
+uint64_t monotonic_ms();
+// milliseconds since the epoch, for timestamps
+uint64_t realtime_ms();
+
+/* growable byte buffer, the data is always kept NUL terminated,
+ * but it can contain NUL bytes as well, as the length is tracked
+ */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+void buffer_init(Buffer *b);
+void buffer_reserve(Buffer *b, size_t size);
+void buffer_append(Buffer *b, const void *data, size_t len);
+void buffer_append_str(Buffer *b, const char *str);
+void buffer_clear(Buffer *b);
+void buffer_free(Buffer *b);
+
 #endif